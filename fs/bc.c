@@ -24,6 +24,43 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// LAB 5 挑战 2：驱逐缓存
+// 最终项目：按范围操作页面的系统调用
+// 驱逐最多 max 个没被访问过的块（keep 所在的块除外），脏块先写回磁盘，
+// 然后用一次 sys_page_unmap_list 一起取消映射。返回驱逐的块数
+#define BC_EVICT_BATCH	16
+
+static int
+bc_evict(void *keep, int max)
+{
+	static uint32_t victims[BC_EVICT_BATCH];
+	void *addr, *blk;
+	int i, n = 0, r;
+
+	for (addr = (void*)DISKMAP; addr < (void*)(DISKMAP + DISKSIZE) && n < max; addr += PTSIZE)
+	{
+		if (!(uvpd[PDX(addr)] & PTE_P))
+			continue;
+		for (i = 0; i < NPTENTRIES && n < max; i++)
+		{
+			blk = addr + i * PGSIZE;
+			if ((uvpt[PGNUM(blk)] & (PTE_P | PTE_A)) != PTE_P || blk == keep)
+				continue;
+			dbg_cprintf("\033[1;31;44mEvictingBlock: [%x]\033[0m\n", blk);
+			if ((uvpt[PGNUM(blk)] & PTE_D) == PTE_D)
+			{
+				if ((r = ide_write(((uint32_t)blk - DISKMAP) / SECTSIZE, blk, BLKSECTS)) < 0)
+					panic("bc_evict: ide_write failed (%e)", r);
+			}
+			victims[n++] = (uint32_t)blk;
+		}
+	}
+
+	if (n && (r = sys_page_unmap_list(0, victims, n)) < 0)
+		panic("bc_evict: sys_page_unmap_list failed (%e)", r);
+	return n;
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -53,32 +90,8 @@ bc_pgfault(struct UTrapframe *utf)
 	if ((r = sys_page_alloc(0, ROUNDDOWN(addr, PGSIZE), PTE_U | PTE_P | PTE_W)) < 0)
 	{
 		// LAB 5 挑战 2：驱逐缓存
-		// 找个没被访问的驱逐掉
-		for (addr = (void*)DISKMAP; addr < (void*)(DISKMAP + DISKSIZE);)
-		{
-			if (uvpd[PDX(addr)] & PTE_P)
-			{
-				int i;
-				for (i = 0; i < NPTENTRIES; i++)
-					if ((uvpt[PGNUM(addr + i * PGSIZE)] & (PTE_P | PTE_A)) == PTE_P &&
-						((uint32_t)addr + i * PGSIZE) != utf->utf_fault_va)
-					{
-						addr = (void *)((uint32_t)addr + i * PGSIZE);
-						dbg_cprintf("\033[1;31;44mUrgentEvictingBlock: [%x]\033[0m\n", addr);
-						if ((uvpt[PGNUM(addr)] & PTE_D) == PTE_D)
-						{
-							if ((r = ide_write(((uint32_t)addr - DISKMAP) / SECTSIZE, addr, BLKSECTS)) < 0)
-								panic("bc_pgfault: ide_write failed (%e)", r);
-						}
-						if ((r = sys_page_unmap(0, addr) < 0))
-							panic("bc_pgfault: sys_page_unmap failed (%e)", r);
-						goto fin;
-					}
-			}
-			addr = (void *)((uint32_t)addr + PTSIZE);
-		}
-	fin:
-		addr = ROUNDDOWN((void *)utf->utf_fault_va, PGSIZE);
+		// 内存不够了，一次多驱逐几个没被访问的块
+		bc_evict(addr, BC_EVICT_BATCH);
 		if ((r = sys_page_alloc(0, ROUNDDOWN(addr, PGSIZE), PTE_U | PTE_P | PTE_W)) < 0)
 			panic("in bc_pgfault, sys_page_alloc: %e", r);
 	}
@@ -132,29 +145,7 @@ flush_block(void *addr)
 
 	// LAB 5 挑战 2：驱逐缓存
 	// 找个没被访问的驱逐掉
-	for (addr = (void*)DISKMAP; addr < (void*)(DISKMAP + DISKSIZE);)
-	{
-		if (uvpd[PDX(addr)] & PTE_P)
-		{
-			int i;
-			for (i = 0; i < NPTENTRIES; i++)
-				if ((uvpt[PGNUM(addr + i * PGSIZE)] & (PTE_P | PTE_A)) == PTE_P && 
-					(void *)((uint32_t)addr + i * PGSIZE) != oldaddr)
-				{
-					addr = (void *)((uint32_t)addr + i * PGSIZE);
-					dbg_cprintf("\033[1;31;44mEvictingBlock: [%x]\033[0m\n", addr);
-					if ((uvpt[PGNUM(addr)] & PTE_D) == PTE_D)
-					{
-						if ((r = ide_write(((uint32_t)addr - DISKMAP) / SECTSIZE, addr, BLKSECTS)) < 0)
-							panic("flush_block: ide_write failed (%e)", r);
-					}
-					if ((r = sys_page_unmap(0, addr) < 0))
-						panic("flush_block: sys_page_unmap failed (%e)", r);
-					return;
-				}
-		}
-		addr = (void *)((uint32_t)addr + PTSIZE);
-	}
+	bc_evict(oldaddr, 1);
 
 	// panic("flush_block not implemented");
 }
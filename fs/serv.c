@@ -11,6 +11,11 @@
 
 #define debug 0
 
+// 最终项目：调用/回复 IPC
+// 定义后 serve 回到调用/回复之前的方式：ipc_send 回复，再 ipc_recv 等待
+// 下一个请求。用来给 user/fsreadbench 的旧协议测出真正的对照数字
+// #define SERVE_SEND_RECV
+
 // The file system server maintains three structures
 // for each open file.
 //
@@ -46,7 +51,14 @@ struct OpenFile opentab[MAXOPEN] = {
 };
 
 // Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// 最终项目：多页 IPC 消息
+// 接收窗口是请求页加上之后的 FSIPC_MAXPAGES 个数据页（FSREQ_WRITE_MAP），
+// 窗口的末尾紧挨着 DISKMAP
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - (1 + FSIPC_MAXPAGES) * PGSIZE);
+#define fsdata	((char *) fsreq + PGSIZE)
+#define FSREQ_WINDOW	IPC_WINDOW(fsreq, 1 + FSIPC_MAXPAGES)
+// serve_read_map 把文件最后一块的副本放在请求窗口下面的这一页
+#define fstail	((char *) fsreq - PGSIZE)
 
 void
 serve_init(void)
@@ -229,6 +241,67 @@ serve_read(envid_t envid, union Fsipc *ipc)
 }
 
 
+// 最终项目：多页 IPC 消息
+// 同 serve_read，但不复制数据：把覆盖所读范围的块缓存页面（最多
+// FSIPC_MAXPAGES 个）作为段向量放进 *pg_store 和 *perm_store，
+// 由回复映射进客户端的窗口。相邻的块合成一段。
+// 客户端拿到的是块缓存页面的只读别名：之后对文件的写入它也看得到，
+// 块被换出时它仍然持有旧的页面，所以客户端应当收到回复后立即复制
+// （见 lib/file.c 的 devfile_read）。文件的最后一块不给别名，而是复制到
+// 新分配的一页，EOF 之后清零，块缓存里 EOF 之后的字节不会交给客户端
+int
+serve_read_map(envid_t envid, struct Fsreq_read *req, void **pg_store, int *perm_store)
+{
+	static struct IpcSeg segs[FSIPC_MAXPAGES];
+	struct OpenFile *o;
+	struct IpcSeg *last;
+	uint32_t bn, nsegs = 0;
+	off_t offset;
+	size_t count;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	offset = o->o_fd->fd_offset;
+	if (offset >= o->o_file->f_size)
+		return 0;
+	count = MIN(req->req_n, o->o_file->f_size - offset);
+	count = MIN(count, FSIPC_MAXPAGES * BLKSIZE - offset % BLKSIZE);
+
+	for (bn = offset / BLKSIZE; bn * BLKSIZE < offset + count; bn++) {
+		if ((r = file_get_block(o->o_file, bn, &blk)) < 0)
+			return r;
+		// 块缓存按需从磁盘读入，先访问一次让它进入内存
+		(void) *(volatile char *) blk;
+		if ((bn + 1) * BLKSIZE > o->o_file->f_size) {
+			// 每次分配新的一页：上一次回复出去的副本留给那个客户端
+			if ((r = sys_page_alloc(0, fstail, PTE_P | PTE_U | PTE_W)) < 0)
+				return r;
+			memmove(fstail, blk, o->o_file->f_size - bn * BLKSIZE);
+			blk = fstail;
+		}
+		last = nsegs ? &segs[nsegs - 1] : NULL;
+		if (last && last->seg_va + last->seg_npages * PGSIZE == (uint32_t) blk)
+			last->seg_npages++;
+		else {
+			segs[nsegs].seg_va = (uint32_t) blk;
+			segs[nsegs].seg_npages = 1;
+			segs[nsegs].seg_perm = PTE_P | PTE_U;
+			nsegs++;
+		}
+	}
+
+	o->o_fd->fd_offset += count;
+	*pg_store = segs;
+	*perm_store = IPC_SEGV | nsegs;
+	return count;
+}
+
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
 // accordingly.  Extend the file if necessary.  Returns the number of
@@ -257,6 +330,32 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	// panic("serve_write not implemented");
 }
 
+// 最终项目：多页 IPC 消息
+// 同 serve_write，但数据在请求页之后的页面里（fsdata）
+int
+serve_write_map(envid_t envid, struct Fsreq_write *req)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_write_map %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if (req->req_n > FSIPC_MAXPAGES * PGSIZE ||
+	    thisenv->env_ipc_npages < 1 + ROUNDUP(req->req_n, PGSIZE) / PGSIZE)
+		return -E_INVAL;
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	r = file_write(o->o_file, fsdata, req->req_n, o->o_fd->fd_offset);
+
+	if (r > 0)
+		o->o_fd->fd_offset += r;
+
+	return r;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -313,20 +412,24 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_WRITE_MAP] =	(fshandler)serve_write_map
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
 void
 serve(void)
 {
-	uint32_t req, whom;
+	uint32_t req, whom, client;
 	int perm, r;
 	void *pg;
 
+	// 最终项目：调用/回复 IPC
+	// 回复上一个请求和等待下一个请求合成一次 ipc_reply_wait。
+	// 上一个请求的页面不再单独解除映射，下一个请求的页面会替换它
+	perm = 0;
+	req = ipc_recv((int32_t *) &whom, FSREQ_WINDOW, &perm);
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -335,20 +438,40 @@ serve(void)
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
-			continue; // just leave it hanging...
+			// just leave it hanging...
+			perm = 0;
+			req = ipc_recv((int32_t *) &whom, FSREQ_WINDOW, &perm);
+			continue;
 		}
 
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_READ_MAP) {
+			r = serve_read_map(whom, &fsreq->read, &pg, &perm);
 		} else if (req < NHANDLERS && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
+#ifdef SERVE_SEND_RECV
 		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		perm = 0;
+		req = ipc_recv((int32_t *) &whom, FSREQ_WINDOW, &perm);
+#else
+		client = whom;
+		req = ipc_reply_wait(client, r, pg, perm, FSREQ_WINDOW, (envid_t *) &whom, &perm);
+		// 回复的页面映射不进客户端（例如它的接收窗口太小），
+		// 或者是这里给出的页面有错：报告出来，改为只回复错误码
+		if ((int32_t) req < 0) {
+			cprintf("fs: reply %d to %08x failed: %e\n", r, client, req);
+			req = ipc_reply_wait(client, req, NULL, 0, FSREQ_WINDOW,
+					     (envid_t *) &whom, &perm);
+			if ((int32_t) req < 0)
+				panic("fs: error reply to %08x failed: %e", client, req);
+		}
+#endif
 	}
 }
 
@@ -367,6 +490,8 @@ umain(int argc, char **argv)
 	cprintf("FS can do I/O\n");
 
 	serve_init();
+	// 文件系统服务是吞吐型的，给它更长的时间片
+	sys_env_set_quantum(0, ENV_QUANTUM_DEFAULT * 4);
 	fs_init();
         fs_test();
 	serve();
@@ -6,6 +6,7 @@
 #include <inc/types.h>
 #include <inc/trap.h>
 #include <inc/memlayout.h>
+#include <inc/sysstat.h>
 
 typedef int32_t envid_t;
 
@@ -38,6 +39,12 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// 最终项目：调度器时间片
+// 每个进程时间片长度（微秒）的默认值和上下限
+#define ENV_QUANTUM_DEFAULT	10000
+#define ENV_QUANTUM_MIN		1000
+#define ENV_QUANTUM_MAX		1000000
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -47,6 +54,7 @@ enum EnvType {
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
+	uint32_t env_free_epoch;	// env_epoch when freed (see env_reclaim)
 	envid_t env_id;			// Unique environment identifier
 	envid_t env_parent_id;		// env_id of this env's parent
 	enum EnvType env_type;		// Indicates special system environments
@@ -72,6 +80,84 @@ struct Env {
 
 	// Lab 4 挑战 5：允许用户处理更多异常
 	void *env_other_exception_upcall;	// 其他异常回调入口点
+
+	// 最终项目：调度器时间片
+	uint32_t env_quantum;		// 实际生效的时间片长度（微秒）
+	uint32_t env_slice_left;	// 本次时间片剩余的计时器中断数
+	uint32_t env_preempts;		// 时间片用完被抢占的次数（非自愿切换）
+
+	// 最终项目：CPU 时间统计（单位均为 TSC 周期）
+	uint64_t env_utime;		// 用户态运行时间
+	uint64_t env_stime;		// 内核态运行时间
+	uint64_t env_wait_time;		// 处于可运行状态、等待调度的时间
+	uint64_t env_runnable_since;	// 最近一次变为可运行的时刻
+	uint32_t env_nvcsw;		// 主动让出 CPU 的次数
+
+	// 最终项目：EDF 实时调度
+	// 每个周期释放一个作业，作业以 sys_yield 结束
+	uint32_t env_rt_period;		// 周期（微秒），0 表示普通进程
+	uint32_t env_rt_budget;		// 每个周期的 CPU 预算（微秒）
+	uint32_t env_rt_budget_left;	// 本周期剩余预算（计时器中断数）
+	uint64_t env_rt_deadline;	// 当前作业的截止时刻（TSC）
+	bool env_rt_done;		// 当前作业已经完成
+	bool env_rt_throttled;		// 预算用完，本周期内不再运行
+	uint32_t env_rt_jobs;		// 已释放的作业数
+	uint32_t env_rt_misses;		// 错过截止时刻的作业数
+
+	// 最终项目：延迟 FPU 切换
+	void *env_fpu;			// FXSAVE 保存区（一个页面），第一次使用 FPU 时分配
+	int env_fpu_cpu;		// 寄存器里保存着最新状态的 CPU，-1 表示保存区最新
+
+	// 最终项目：共享内存系统调用环
+	void *env_ring;			// 注册的环（内核虚拟地址），NULL 表示没有
+	bool env_ring_cancel;		// 下一个提交项要被取消（SQE_LINK）
+
+	// 最终项目：阻塞 IPC 发送
+	// 接收方还没有进入 sys_ipc_recv 时，发送方带着消息排进接收方的
+	// 等待队列并阻塞，由接收方在 sys_ipc_recv 里取走消息并唤醒它
+	struct Env *env_ipc_senders;	// 等待向本进程发送的进程（先进先出）
+	struct Env *env_ipc_senders_tail;
+	struct Env *env_ipc_send_next;	// 同一等待队列中的下一个发送方
+	struct Env *env_ipc_sendto;	// 正在等待的接收方，NULL 表示没有
+	uint32_t env_ipc_send_value;	// 等待发送的消息
+	// 最终项目：多页 IPC 消息
+	struct IpcSeg env_ipc_send_segs[IPC_SEG_MAX];
+	uint32_t env_ipc_send_nsegs;
+	uint32_t env_ipc_dst_npages;	// 接收窗口（从 env_ipc_dstva 开始）的页数
+	uint32_t env_ipc_npages;	// 收到的页数
+
+	// 最终项目：调用/回复 IPC
+	envid_t env_ipc_recv_from;	// 只接收这个进程的消息（sys_ipc_call），0 表示不限
+
+	// 最终项目：异步消息队列
+	// 收到的消息和 sys_ipc_recv 一样放在 env_ipc_value/from/perm；
+	// 下面的统计用户可以直接从 UENVS 读
+	struct MsgQueue *env_msgq;	// 消息队列（内核里的一个页面），NULL 表示没有
+	uint32_t env_msg_depth;		// 队列深度（sys_msg_setup）
+	uint32_t env_msg_count;		// 队列里的消息数
+	uint32_t env_msg_peak;		// 队列里同时有过的最多消息数
+	uint32_t env_msg_received;	// 收到的消息总数
+	uint32_t env_msg_overflows;	// 队列满时被拒绝的发送数
+	uint32_t env_msg_full_waits;	// 队列满时阻塞等待的发送数
+	uint32_t env_msg_waiters;	// 正在等待队列空位的发送方数
+	bool env_msg_recving;		// 阻塞在 sys_msg_recv 里
+	// 队列满时阻塞的发送方把消息记在自己这里，由接收方腾出空位时取走
+	envid_t env_msg_sendto;		// 正在等待哪个进程的队列，0 表示没有
+	uint32_t env_msg_send_value;
+	struct PageInfo *env_msg_send_page;
+	int env_msg_send_perm;
+
+	// 最终项目：futex
+	physaddr_t env_futex_pa;	// 正在等待的字的物理地址，0 表示没有在等待
+	struct Env *env_futex_next;	// 同一个哈希桶里的下一个等待者
+	uint64_t env_futex_deadline;	// 等待超时的时刻（TSC），0 表示不超时
+	// 这个槽位上的进程退出的次数，只增不减；wait() 在这个字上等待子进程退出
+	uint32_t env_exit_count;
+
+#ifdef SYSSTAT_PER_ENV
+	// 最终项目：系统调用统计：统计打开期间本进程每个槽的调用次数
+	uint32_t env_syscalls[SYSSTAT_NSLOTS];
+#endif
 };
 
 #endif // !JOS_INC_ENV_H
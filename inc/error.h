@@ -26,6 +26,14 @@ enum {
 	E_NOT_EXEC	,	// File not a valid executable
 	E_NOT_SUPP	,	// Operation not supported
 
+	// Kernel error codes added later -- appended after the file system
+	// codes so existing values stay stable
+	E_NO_CAPACITY	,	// Real-time admission would overload the CPU
+	E_CANCELED	,	// Linked ring entry skipped after a failure
+	E_MSGQ_FULL	,	// Message queue of the target env is full
+	E_AGAIN		,	// Futex word no longer holds the expected value
+	E_TIMEOUT	,	// Wait timed out
+
 	MAXERROR
 };
 
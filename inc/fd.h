@@ -8,6 +8,9 @@
 #include <inc/types.h>
 #include <inc/fs.h>
 
+// Bottom of file descriptor area (see lib/fd.c)
+#define FDTABLE		0xD0000000
+
 struct Fd;
 struct Stat;
 struct Dev;
@@ -75,9 +75,18 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// 最终项目：多页 IPC 消息
+	// 请求格式同 FSREQ_READ：回复时把块缓存的页面映射进客户端的窗口，
+	// 数据从窗口里偏移 (原读写位置 % BLKSIZE) 处开始
+	FSREQ_READ_MAP,
+	// 请求格式同 FSREQ_WRITE 的头部：数据放在请求页之后的页面里
+	FSREQ_WRITE_MAP
 };
 
+// FSREQ_READ_MAP 和 FSREQ_WRITE_MAP 一次最多传送的数据页数
+#define FSIPC_MAXPAGES	16
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -0,0 +1,33 @@
+#ifndef JOS_INC_KINFO_H
+#define JOS_INC_KINFO_H
+
+#include <inc/types.h>
+
+// 最终项目：内核信息页
+// 内核把这个结构映射到每个进程的 UKINFO 处（只读），在计时器中断里更新，
+// 用户程序不必陷入内核就能读取时间和 CPU 负载（见 lib/kinfo.c）
+
+#define KINFO_NCPU		8	// 不少于内核的 NCPU
+#define KINFO_LOAD_SHIFT	4	// 负载按 1/16 的权重做指数平均
+
+struct KernCpuInfo {
+	volatile uint32_t kc_load;	// 近期忙碌程度（千分比），停机时趋向 0
+	volatile uint32_t kc_ticks;	// 这个 CPU 收到的计时器中断数
+};
+
+struct KernInfo {
+	// ki_ticks 在 32 位机器上不能一次读完：更新期间 ki_seq 为奇数，
+	// 读者在 ki_seq 前后一致且为偶数时才采用读到的值
+	volatile uint32_t ki_seq;
+	volatile uint64_t ki_ticks;	// 启动以来 BSP 收到的计时器中断数
+
+	// 启动后不再改变
+	uint32_t ki_tick_us;		// 计时器中断周期（微秒）
+	uint32_t ki_tsc_per_us;		// 校准得到的 TSC 每微秒计数
+	uint64_t ki_tsc_boot;		// 开始计时的 TSC，uptime 从这里算起
+	uint32_t ki_ncpu;		// CPU 数
+
+	struct KernCpuInfo ki_cpu[KINFO_NCPU];
+};
+
+#endif /* !JOS_INC_KINFO_H */
@@ -20,6 +20,8 @@
 #include <inc/fs.h>
 #include <inc/fd.h>
 #include <inc/args.h>
+#include <inc/kinfo.h>
+#include <inc/sysstat.h>
 
 #define USED(x)		(void)(x)
 #define dbg_cprintf(...) // cprintf(__VA_ARGS__)
@@ -29,6 +31,9 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
+extern envid_t start_envid;	// 最终项目：内核信息页：进程开始运行时 %edx 里的 envid
+extern const volatile struct KernInfo kinfo;
+extern const volatile struct Sysstat sysstat;	// 最终项目：系统调用统计
 
 // Lab 4 挑战 6：实现共享内存的 fork
 // 对 thisenv 的 hack
@@ -67,6 +72,7 @@ envid_t	sys_getenvid(void);
 int sys_set_pte_pafield(void *va, physaddr_t pa, int perm);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
+void	sys_yield_to(envid_t env);
 static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
@@ -77,26 +83,44 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_msg_setup(uint32_t depth);
+int	sys_msg_send(envid_t to_env, uint32_t value, void *pg, int perm, int flags);
+int	sys_msg_recv(void *rcv_pg);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint32_t timeout_us);
+int	sys_futex_wake(volatile uint32_t *addr, uint32_t n);
+int	sys_env_set_quantum(envid_t env, uint32_t us);
+int	sys_env_set_rt(envid_t env, uint32_t period_us, uint32_t budget_us);
 int	sys_capture_state(envid_t);
 int	sys_restore_state(envid_t);
 int	sys_env_set_other_exception_upcall(envid_t env, void *upcall);
-int begin_batchcall();
-int end_batchcall();
-
-extern bool in_batch_state;
-extern uint32_t *batch_argu[5];
-uint32_t batch_begin_pgnum, batch_end_pgnum;
+int	sys_ring_setup(void *va);
+int	sys_enter_ring(uint32_t n_submit, uint32_t min_complete);
+int	sys_page_alloc_range(envid_t env, void *va, size_t npages, int perm);
+int	sys_page_map_range(envid_t src_env, void *src_va, envid_t dst_env,
+			   void *dst_va, size_t npages, int perm);
+int	sys_page_unmap_range(envid_t env, void *va, size_t npages);
+int	sys_page_map_list(envid_t src_env, envid_t dst_env, const uint32_t *list, size_t n);
+int	sys_page_unmap_list(envid_t env, const uint32_t *list, size_t n);
+int	sys_sysstat_ctl(int op);
 
 // This must be inlined.  Exercise for reader: why?
+// 最终项目：内核信息页
+// 子进程返回时 %edx 是它自己的 envid，直接设置 thisenv，不必调用 sys_getenvid
 static __inline envid_t __attribute__((always_inline))
 sys_exofork(void)
 {
-	envid_t ret;
-	__asm __volatile("int %2"
-		: "=a" (ret)
+	envid_t ret, self;
+	__asm __volatile("int %3"
+		: "=a" (ret),
+		  "=d" (self)
 		: "a" (SYS_exofork),
 		  "i" (T_SYSCALL)
 	);
+	if (ret == 0)
+		thisenv = envs + ENVX(self);
 	return ret;
 }
 
@@ -104,12 +128,57 @@ sys_exofork(void)
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
+int32_t	ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg, int *perm_store);
+int32_t	ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       void *rcv_pg, envid_t *from_env_store, int *perm_store);
+int	msg_send(envid_t to_env, uint32_t value, void *pg, int perm, int flags);
+int32_t	msg_recv(envid_t *from_env_store, void *pg, int *perm_store);
+
+// 最终项目：共享内存系统调用环
+// ring.c
+int	ring_queue(int num, uint32_t a1, uint32_t a2, uint32_t a3,
+		   uint32_t a4, uint32_t a5, int flags);
+int	ring_flush(void);
+
+// 最终项目：内核信息页
+// kinfo.c
+uint64_t	kinfo_ticks(void);
+uint64_t	uptime_ns(void);
+uint64_t	uptime_us(void);
+uint32_t	kinfo_ncpu(void);
+uint32_t	kinfo_cpu_load(int cpu);
+
+// 最终项目：futex
+// sync.c
+struct Mutex {
+	volatile uint32_t m_state;
+};
+
+struct Cond {
+	volatile uint32_t c_seq;
+};
+
+void	mutex_init(struct Mutex *m);
+void	mutex_lock(struct Mutex *m);
+bool	mutex_trylock(struct Mutex *m);
+void	mutex_unlock(struct Mutex *m);
+void	cond_init(struct Cond *c);
+void	cond_wait(struct Cond *c, struct Mutex *m);
+void	cond_signal(struct Cond *c);
+void	cond_broadcast(struct Cond *c);
+
+// 最终项目：IPC 基准测试
+// bench.c
+uint64_t	bench_start(void);
+uint64_t	bench_elapsed_ns(uint64_t start);
+uint64_t	bench_cycles_ns(uint64_t cycles);
+uint64_t	bench_rate(uint64_t n, uint64_t ns);
+void	bench_result(const char *prog, const char *item, uint64_t value, const char *unit);
 
 // fork.c
 
-// PTE_COW marks copy-on-write page table entries.
+// PTE_COW (inc/mmu.h) marks copy-on-write page table entries.
 // It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
 #define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
@@ -17,6 +17,7 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_CPU0   0x68     // Per-CPU data segment for CPU 0 (after NCPU TSSs)
 
 /*
  * Virtual memory map:                                Permissions
@@ -114,6 +115,10 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// 最终项目：内核信息页：struct KernInfo（inc/kinfo.h），占 UENVS 区域的最后一页
+#define UKINFO		(UPAGES - PGSIZE)
+// 最终项目：系统调用统计：struct Sysstat（inc/sysstat.h），在 UKINFO 下面
+#define USYSSTAT	(UKINFO - 16 * PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -135,6 +140,8 @@
 // Used for temporary page mappings for the user page-fault handler
 // (should not conflict with other temporary page mappings)
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
+// 最终项目：共享内存系统调用环：用户库注册的环所在的页面（见 lib/ring.c）
+#define URING		(PFTEMP - PGSIZE)
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)
 
@@ -69,6 +69,11 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// 最终项目：内核处理写时复制
+// PTE_COW marks copy-on-write page table entries (see lib/fork.c).
+// The kernel resolves write faults on them itself (see page_fault_handler).
+#define PTE_COW		0x800
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -88,6 +93,8 @@
 #define CR0_CD		0x40000000	// Cache Disable
 #define CR0_PG		0x80000000	// Paging
 
+#define CR4_OSXMMEXCPT	0x00000400	// OS supports unmasked SIMD FP exceptions
+#define CR4_OSFXSR	0x00000200	// OS supports FXSAVE/FXRSTOR
 #define CR4_PCE		0x00000100	// Performance counter enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
@@ -1,7 +1,9 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
-// #define USE_SYSENTER // 决定是否使用 sysenter 指令（Lab3 Challenge3）
+#include <inc/types.h>
+
+#define USE_SYSENTER // 决定是否使用 sysenter 指令（Lab3 Challenge3）
 
 /* system call numbers */
 enum {
@@ -19,7 +21,95 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_env_set_quantum,
+	SYS_yield_to,
+	SYS_env_set_rt,
+	SYS_ring_setup,
+	SYS_enter_ring,
+	SYS_page_alloc_range,
+	SYS_page_map_range,
+	SYS_page_unmap_range,
+	SYS_page_map_list,
+	SYS_page_unmap_list,
+	SYS_sysstat_ctl,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_msg_setup,
+	SYS_msg_send,
+	SYS_msg_recv,
+	SYS_futex_wait,
+	SYS_futex_wake,
 	NSYSCALLS
 };
 
+// 最终项目：按范围操作页面的系统调用
+// sys_page_map_list 和 sys_page_unmap_list 一次最多处理的页面数
+#define PAGE_LIST_MAX		256
+// sys_page_*_range 一次最多处理的页面数（一个页表的范围），
+// 限制一次调用持有进程锁的时间；用户库的包装函数按这个大小分批
+#define PAGE_RANGE_MAX		1024
+
+// 最终项目：多页 IPC 消息
+// 一条消息可以带一个段向量：perm 参数带 IPC_SEGV、低 8 位是段数时，
+// srcva 参数指向 struct IpcSeg 数组。各段的页面按顺序连续映射进接收方
+// 的窗口；接收方在 dstva 参数的低 12 位写窗口页数减一（IPC_WINDOW），
+// 普通的页对齐地址就是一页的窗口。整条消息要么全部映射，要么都不映射
+#define IPC_SEG_MAX		16
+#define IPC_WINDOW_MAX		256
+#define IPC_SEGV		0x80000000
+#define IPC_SEGV_COUNT(perm)	((perm) & 0xff)
+#define IPC_WINDOW(va, npages)	((void *) ((uint32_t) (va) | ((npages) - 1)))
+
+struct IpcSeg {
+	uint32_t seg_va;	// 页对齐
+	uint32_t seg_npages;
+	uint32_t seg_perm;	// 同 sys_page_map 的 perm
+};
+
+// 最终项目：异步消息队列
+// 进程用 sys_msg_setup 打开一个内核里的有界消息队列，sys_msg_send
+// 不等接收方就把消息（一个值和可选的一个页面）排进队列，
+// sys_msg_recv 按先后顺序取出。队列满时发送返回 -E_MSGQ_FULL，
+// 带 MSG_BLOCK 时改为阻塞，直到接收方腾出空位
+#define MSGQ_DEPTH_MAX		255
+#define MSGQ_DEPTH_DEFAULT	16
+#define MSG_BLOCK		0x1
+
+// 最终项目：futex
+// sys_futex_wake 唤醒所有等待者
+#define FUTEX_WAKE_ALL		0xffffffff
+
+// 最终项目：共享内存系统调用环
+// 进程用 sys_ring_setup 注册一个页面，里面是一对环：用户在提交队列里
+// 填写系统调用，sys_enter_ring 按顺序执行它们，把结果写进完成队列。
+// 下标只增不减，用时对队列长度取模；只有用户写 sq_tail 和 cq_head，
+// 只有内核写 sq_head 和 cq_tail
+#define SRING_SQ_ENTRIES	64
+#define SRING_CQ_ENTRIES	128
+
+// 提交项标志
+#define SQE_LINK	0x1	// 这一项失败时取消紧跟其后的一项（可以连成一串）
+
+struct SyscallSqe {
+	uint32_t sqe_num;	// 系统调用号
+	uint32_t sqe_args[5];
+	uint32_t sqe_flags;
+	uint32_t sqe_data;	// 原样复制到完成项
+};
+
+struct SyscallCqe {
+	uint32_t cqe_data;
+	int32_t cqe_result;	// 系统调用的返回值，被取消时为 -E_CANCELED
+};
+
+struct SyscallRing {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	struct SyscallSqe sq[SRING_SQ_ENTRIES];
+	struct SyscallCqe cq[SRING_CQ_ENTRIES];
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
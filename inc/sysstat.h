@@ -0,0 +1,126 @@
+#ifndef JOS_INC_SYSSTAT_H
+#define JOS_INC_SYSSTAT_H
+
+#include <inc/types.h>
+#include <inc/syscall.h>
+#include <inc/kinfo.h>
+
+// 最终项目：系统调用统计
+// 每个 CPU 按系统调用号统计调用次数和耗时（TSC 周期）的 log2 直方图。
+// 内核把统计映射到每个进程的 USYSSTAT 处（只读），见 user/sysstat.c；
+// 统计默认关闭，关闭时 syscall() 只多一次判断
+
+// #define SYSSTAT_PER_ENV	// 另外在每个 Env 里按槽计数（env_syscalls）
+
+// 编号小于 NSYSCALLS 的系统调用各占一个同号的槽，
+// 用数字编号的挑战系统调用放在紧跟其后的几个槽里，
+// 槽数随 NSYSCALLS 增长，两者不会重叠
+#define SYSSTAT_NSLOTS		(NSYSCALLS + 5)
+#define SYSSTAT_SLOT_128	(SYSSTAT_NSLOTS - 5)	// sys_capture_state
+#define SYSSTAT_SLOT_129	(SYSSTAT_NSLOTS - 4)	// sys_restore_state
+#define SYSSTAT_SLOT_130	(SYSSTAT_NSLOTS - 3)	// sys_env_set_other_exception_upcall
+#define SYSSTAT_SLOT_233	(SYSSTAT_NSLOTS - 2)	// sys_set_pte_pafield
+#define SYSSTAT_SLOT_OTHER	(SYSSTAT_NSLOTS - 1)	// 不存在的编号
+
+// 第 b 个桶统计 [2^b, 2^(b+1)) 个周期，最后一个桶也包括更长的
+#define SYSSTAT_BUCKETS		24
+
+// sys_sysstat_ctl 的操作
+enum {
+	SYSSTAT_OFF = 0,
+	SYSSTAT_ON,
+	SYSSTAT_RESET,
+};
+
+struct SysstatCpu {
+	uint32_t ss_count[SYSSTAT_NSLOTS];	// 进入次数，包括不返回的调用（sys_yield 等）
+	uint64_t ss_cycles[SYSSTAT_NSLOTS];	// 返回了的调用的总周期数
+	uint32_t ss_hist[SYSSTAT_NSLOTS][SYSSTAT_BUCKETS];
+};
+
+struct Sysstat {
+	volatile uint32_t ss_enabled;
+	struct SysstatCpu ss_cpu[KINFO_NCPU];
+};
+
+static inline int
+sysstat_slot(uint32_t num)
+{
+	if (num < NSYSCALLS)
+		return num;
+	switch (num) {
+	case 128: return SYSSTAT_SLOT_128;
+	case 129: return SYSSTAT_SLOT_129;
+	case 130: return SYSSTAT_SLOT_130;
+	case 233: return SYSSTAT_SLOT_233;
+	default: return SYSSTAT_SLOT_OTHER;
+	}
+}
+
+static inline const char *
+sysstat_name(int slot)
+{
+	static const char *const names[SYSSTAT_NSLOTS] = {
+		[SYS_cputs] = "cputs",
+		[SYS_cgetc] = "cgetc",
+		[SYS_getenvid] = "getenvid",
+		[SYS_env_destroy] = "env_destroy",
+		[SYS_page_alloc] = "page_alloc",
+		[SYS_page_map] = "page_map",
+		[SYS_page_unmap] = "page_unmap",
+		[SYS_exofork] = "exofork",
+		[SYS_env_set_status] = "env_set_status",
+		[SYS_env_set_trapframe] = "env_set_trapframe",
+		[SYS_env_set_pgfault_upcall] = "env_set_pgfault_upcall",
+		[SYS_yield] = "yield",
+		[SYS_ipc_try_send] = "ipc_try_send",
+		[SYS_ipc_recv] = "ipc_recv",
+		[SYS_env_set_quantum] = "env_set_quantum",
+		[SYS_yield_to] = "yield_to",
+		[SYS_env_set_rt] = "env_set_rt",
+		[SYS_ring_setup] = "ring_setup",
+		[SYS_enter_ring] = "enter_ring",
+		[SYS_page_alloc_range] = "page_alloc_range",
+		[SYS_page_map_range] = "page_map_range",
+		[SYS_page_unmap_range] = "page_unmap_range",
+		[SYS_page_map_list] = "page_map_list",
+		[SYS_page_unmap_list] = "page_unmap_list",
+		[SYS_sysstat_ctl] = "sysstat_ctl",
+		[SYS_ipc_send] = "ipc_send",
+		[SYS_ipc_call] = "ipc_call",
+		[SYS_ipc_reply_wait] = "ipc_reply_wait",
+		[SYS_msg_setup] = "msg_setup",
+		[SYS_msg_send] = "msg_send",
+		[SYS_msg_recv] = "msg_recv",
+		[SYS_futex_wait] = "futex_wait",
+		[SYS_futex_wake] = "futex_wake",
+		[SYSSTAT_SLOT_128] = "capture_state",
+		[SYSSTAT_SLOT_129] = "restore_state",
+		[SYSSTAT_SLOT_130] = "env_set_other_exception_upcall",
+		[SYSSTAT_SLOT_233] = "set_pte_pafield",
+		[SYSSTAT_SLOT_OTHER] = "(invalid)",
+	};
+
+	if (slot < 0 || slot >= SYSSTAT_NSLOTS || !names[slot])
+		return "?";
+	return names[slot];
+}
+
+// 直方图 hist 中第 pct 百分位所在桶的上界（周期）
+static inline uint32_t
+sysstat_percentile(const uint32_t *hist, uint32_t pct)
+{
+	uint32_t total = 0, sum = 0;
+	int b;
+
+	for (b = 0; b < SYSSTAT_BUCKETS; b++)
+		total += hist[b];
+	for (b = 0; b < SYSSTAT_BUCKETS - 1; b++) {
+		sum += hist[b];
+		if ((uint64_t) sum * 100 >= (uint64_t) total * pct)
+			break;
+	}
+	return 2U << b;
+}
+
+#endif /* !JOS_INC_SYSSTAT_H */
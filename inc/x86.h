@@ -5,6 +5,9 @@
 
 #define CPUID_EDX_MSR_BIT	5 // MSR 寄存器是否启用
 #define CPUID_EDX_PSE_BIT	3 // 页大小扩展是否支持
+#define CPUID_EDX_SEP_BIT	11 // sysenter/sysexit 是否支持
+#define CPUID_EDX_FXSR_BIT	24 // FXSAVE/FXRSTOR 是否支持
+#define CPUID_EDX_SSE_BIT	25 // SSE 是否支持
 
 #define MSR_IA32_SYSENTER_CS	0x174
 #define MSR_IA32_SYSENTER_ESP	0x175
@@ -305,4 +308,48 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// 最终项目：排队自旋锁
+// 原子地把 *addr 加上 v，返回原来的值
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t v)
+{
+	asm volatile("lock; xaddl %0, %1" :
+			"+r" (v), "+m" (*addr) : :
+			"cc");
+	return v;
+}
+
+// 如果 *addr 等于 oldval 就把它换成 newval，返回 *addr 原来的值
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (oldval) :
+			"cc");
+	return result;
+}
+
+// 最终项目：延迟 FPU 切换
+static inline void
+clts(void)
+{
+	asm volatile("clts");
+}
+
+// area 必须 16 字节对齐，大小 512 字节
+static inline void
+fxsave(void *area)
+{
+	asm volatile("fxsave %0" : "=m" (*(uint8_t (*)[512]) area));
+}
+
+static inline void
+fxrstor(const void *area)
+{
+	asm volatile("fxrstor %0" : : "m" (*(const uint8_t (*)[512]) area));
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -9,10 +9,38 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
+#include <kern/cpu.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// 最终项目：细粒度锁
+// 控制台锁。cprintf 在整条输出期间持有它，其中每个字符的 cputchar
+// 以及输出过程中的 panic 会重入，所以要记录持有者，同一 CPU 重入时不再加锁
+static struct spinlock cons_lock = SPINLOCK_INIT("cons_lock", SPIN_TICKET, LOCK_RANK_CONS);
+static volatile int cons_owner = -1;
+
+// 返回是否真的获取了锁，传给 cons_lock_release
+bool
+cons_lock_acquire(void)
+{
+	if (cons_owner == cpunum())
+		return false;
+	spin_lock(&cons_lock);
+	cons_owner = cpunum();
+	return true;
+}
+
+void
+cons_lock_release(bool taken)
+{
+	if (!taken)
+		return;
+	cons_owner = -1;
+	spin_unlock(&cons_lock);
+}
+
 // ANSI 转义序列用宏
 
 #define ANSI_ESCAPE_STATE_NONE			0
@@ -69,8 +97,13 @@ serial_proc_data(void)
 void
 serial_intr(void)
 {
-	if (serial_exists)
+	bool taken;
+
+	if (serial_exists) {
+		taken = cons_lock_acquire();
 		cons_intr(serial_proc_data);
+		cons_lock_release(taken);
+	}
 }
 
 static void
@@ -377,7 +410,10 @@ kbd_proc_data(void)
 void
 kbd_intr(void)
 {
+	bool taken = cons_lock_acquire();
+
 	cons_intr(kbd_proc_data);
+	cons_lock_release(taken);
 }
 
 static void
@@ -423,7 +459,8 @@ cons_intr(int (*proc)(void))
 int
 cons_getc(void)
 {
-	int c;
+	int c = 0;
+	bool taken = cons_lock_acquire();
 
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
@@ -436,9 +473,9 @@ cons_getc(void)
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	cons_lock_release(taken);
+	return c;
 }
 
 // output a character to the console
@@ -472,6 +509,7 @@ cputchar(int c)
 	static char ansi_escape_state = ANSI_ESCAPE_STATE_NONE,
 		ansi_escape_last_char = 0,
 		ansi_escape_last_format = 0;
+	bool taken = cons_lock_acquire();
 
 	if (ansi_escape_state == ANSI_ESCAPE_STATE_AFTER_ESC)
 	{
@@ -514,6 +552,8 @@ cputchar(int c)
 	else
 		// 加入格式输出
 		cons_putc((ansi_escape_last_format << 8) | c);
+
+	cons_lock_release(taken);
 }
 
 int
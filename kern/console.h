@@ -20,6 +20,10 @@
 void cons_init(void);
 int cons_getc(void);
 
+// 最终项目：细粒度锁
+bool cons_lock_acquire(void);
+void cons_lock_release(bool taken);
+
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
 
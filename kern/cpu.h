@@ -19,10 +19,20 @@ enum {
 
 // Per-CPU state
 struct CpuInfo {
+	struct CpuInfo *cpu_self;       // Points to itself; must be first (see thiscpu)
+	uintptr_t cpu_kstacktop;        // Top of this CPU's kernel stack (see _alltraps)
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	uint64_t cpu_tsc_mark;          // TSC of the last user/kernel transition
+	volatile uint32_t cpu_epoch;    // env_epoch at the last quiescent point
+	bool cpu_in_window;             // Inside a preemption point's sti window
+	uint32_t cpu_ticks_pending;     // Timer ticks taken inside such windows
+	uint64_t cpu_preempt_mark;      // TSC of the last preemption point
+	uint64_t cpu_irqoff_start;      // TSC when interrupts were last disabled
+	struct Trapframe *cpu_syscall_tf; // Trapframe of an int $T_SYSCALL in progress
+	struct Env *cpu_fpu_owner;      // Env whose state is in this CPU's FPU
 };
 
 // Initialized in mpconfig.c
@@ -30,17 +40,41 @@ extern struct CpuInfo cpus[NCPU];
 extern int ncpu;                    // Total number of CPUs in the system
 extern struct CpuInfo *bootcpu;     // The boot-strap processor (BSP)
 extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
+extern uint32_t lapic_ticks_per_us; // LAPIC timer ticks per microsecond
+extern uint32_t tsc_per_us;         // TSC cycles per microsecond
 
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
-int cpunum(void);
-#define thiscpu (&cpus[cpunum()])
+// 最终项目：%gs 每 CPU 数据
+// 每个 CPU 的 %gs 指向一个以自己的 CpuInfo 为基址的段（见 env_init_percpu），
+// 所以访问本 CPU 的数据只需要一条 %gs 相对的访存指令，
+// 不必每次都通过 MMIO 读取 LAPIC ID
+#ifdef __SEG_GS
+#define percpu(field)	(((struct CpuInfo __seg_gs *) 0)->field)
+#define thiscpu		percpu(cpu_self)
+#else
+static inline struct CpuInfo *
+percpu_self(void)
+{
+	struct CpuInfo *c;
+
+	asm("movl %%gs:0, %0" : "=r" (c));
+	return c;
+}
+#define thiscpu		(percpu_self())
+#define percpu(field)	(thiscpu->field)
+#endif
+#define cpunum()	((int) percpu(cpu_id))
+
+// Local APIC ID of this CPU, read over MMIO. Only needed before %gs is set up.
+int lapic_id(void);
 
 void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
 
 #endif
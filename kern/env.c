@@ -14,11 +14,31 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+// 最终项目：细粒度锁
+// 锁的含义和获取顺序见 kern/spinlock.h
+struct spinlock env_locks[NENV];
+struct spinlock env_table_lock = SPINLOCK_INIT("env_table_lock", SPIN_TICKET, LOCK_RANK_ENV_TABLE);
+
+// 最终项目：RCU 式进程回收
+// envid2env 不加锁，查找到的 Env 在本次陷入内核期间可能被其他 CPU 销毁。
+// 为了让这样的指针至少不会指向一个重新分配出去的新进程，
+// env_free 释放的槽位先进入等待链表，并记下当时的 env_epoch；
+// 每个 CPU 经过静止点（返回用户态或停机）时记录最新的 env_epoch，
+// 等所有运行中的 CPU 都经过了释放之后的静止点，槽位才回到 env_free_list。
+// 于是读者只需检查 env_status 和 env_id，不需要任何锁。
+static struct Env *env_pending_head, *env_pending_tail;
+static volatile uint32_t env_epoch = 1;	// 只在持有 env_table_lock 时修改
+
+// 最终项目：延迟 FPU 切换
+// 刚执行过 fninit 的 FPU/SSE 状态，进程第一次使用 FPU 时从这里开始
+static uint8_t env_fpu_init_state[512] __attribute__((aligned(16)));
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
 // Global descriptor table.
@@ -36,7 +56,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -55,7 +75,12 @@ struct Segdesc gdt[NCPU + 5] =
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
-	[GD_TSS0 >> 3] = SEG_NULL
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// 最终项目：%gs 每 CPU 数据
+	// Per-CPU data segments (starting from GD_CPU0) are initialized
+	// in env_init_percpu()
+	[GD_CPU0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -108,6 +133,216 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// 最终项目：细粒度锁
+
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+// 按下标从小到大锁住两个进程（可以是同一个）
+void
+env_lock_pair(struct Env *a, struct Env *b)
+{
+	if (a > b)
+		env_lock(b);
+	env_lock(a);
+	if (a < b)
+		env_lock(b);
+}
+
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+	env_unlock(a);
+	if (a != b)
+		env_unlock(b);
+}
+
+// envid2env 的查找不加锁，进程在查找之后、加锁之前可能已被销毁，
+// 所以加锁之后要用这个函数再确认一次（槽位不会在本次陷入期间被重新分配，
+// 见 env_reclaim，检查 env_id 只是多一层保险）。
+// 正在销毁的进程的页目录随时会被 env_free 释放，也视为无效
+bool
+env_still_valid(struct Env *e, envid_t envid)
+{
+	return e->env_status != ENV_FREE && e->env_status != ENV_DYING &&
+		(envid == 0 || e->env_id == envid);
+}
+
+// 查找 envid 并锁住它，成功时由调用者负责 env_unlock
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	int r;
+
+	if ((r = envid2env(envid, env_store, checkperm)) < 0)
+		return r;
+	env_lock(*env_store);
+	if (!env_still_valid(*env_store, envid)) {
+		env_unlock(*env_store);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	return 0;
+}
+
+// 最终项目：阻塞 IPC 发送
+// 发送方 s 排到接收方 dst 的等待队列末尾（调用者持有双方的锁）
+void
+env_ipc_enqueue(struct Env *dst, struct Env *s)
+{
+	s->env_ipc_sendto = dst;
+	s->env_ipc_send_next = NULL;
+	if (dst->env_ipc_senders_tail)
+		dst->env_ipc_senders_tail->env_ipc_send_next = s;
+	else
+		dst->env_ipc_senders = s;
+	dst->env_ipc_senders_tail = s;
+}
+
+// 取出 dst 等待队列里的第一个发送方，返回时它也被锁住；队列为空时返回 NULL。
+// 调用者持有 dst 的锁，为了按下标顺序加锁，中间可能短暂放开它
+struct Env *
+env_ipc_dequeue(struct Env *dst)
+{
+	struct Env *s;
+
+	while ((s = dst->env_ipc_senders)) {
+		if (s > dst)
+			env_lock(s);
+		else {
+			env_unlock(dst);
+			env_lock_pair(dst, s);
+			// 放开锁期间 s 可能已经因为被销毁而离开了队列
+			if (dst->env_ipc_senders != s) {
+				env_unlock(s);
+				continue;
+			}
+		}
+		dst->env_ipc_senders = s->env_ipc_send_next;
+		if (!dst->env_ipc_senders)
+			dst->env_ipc_senders_tail = NULL;
+		s->env_ipc_send_next = NULL;
+		s->env_ipc_sendto = NULL;
+		return s;
+	}
+	return NULL;
+}
+
+// 进程被回收前：把它从它正在等待的接收方的队列里摘下来，
+// 并让所有等待向它发送的进程以 -E_BAD_ENV 返回
+// 最终项目：调用/回复 IPC：在 sys_ipc_call 里等待它回复的进程也一样
+static void
+env_ipc_cleanup(struct Env *e)
+{
+	struct Env *dst, **pp, *prev, *s;
+	int i;
+
+	while ((dst = e->env_ipc_sendto)) {
+		env_lock_pair(e, dst);
+		if (e->env_ipc_sendto == dst) {
+			prev = NULL;
+			for (pp = &dst->env_ipc_senders; *pp != e; pp = &(*pp)->env_ipc_send_next)
+				prev = *pp;
+			*pp = e->env_ipc_send_next;
+			if (dst->env_ipc_senders_tail == e)
+				dst->env_ipc_senders_tail = prev;
+			e->env_ipc_send_next = NULL;
+			e->env_ipc_sendto = NULL;
+		}
+		env_unlock_pair(e, dst);
+	}
+
+	// e 已经是 ENV_DYING，不会再有新的发送方排进来
+	env_lock(e);
+	while ((s = env_ipc_dequeue(e))) {
+		s->env_ipc_recving = false;
+		s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		env_set_runnable(s);
+		env_unlock(s);
+	}
+	env_unlock(e);
+
+	for (i = 0; i < NENV; i++) {
+		s = &envs[i];
+		if (s == e || s->env_ipc_recv_from != e->env_id)
+			continue;
+		env_lock(s);
+		if (s->env_ipc_recving && s->env_ipc_recv_from == e->env_id) {
+			s->env_ipc_recving = false;
+			s->env_ipc_recv_from = 0;
+			s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			env_set_runnable(s);
+		}
+		env_unlock(s);
+	}
+}
+
+// 最终项目：异步消息队列
+// 进程被回收前：如果它在等待别的进程的队列空位，退出等待；
+// 丢弃它队列里的消息，让等待它的队列空位的发送方以 -E_BAD_ENV 返回
+static void
+env_msg_cleanup(struct Env *e)
+{
+	struct Env *dst, *s;
+	struct Msg *m;
+	int i;
+
+	if (e->env_msg_sendto) {
+		dst = &envs[ENVX(e->env_msg_sendto)];
+		env_lock_pair(e, dst);
+		if (e->env_msg_sendto == dst->env_id) {
+			dst->env_msg_waiters--;
+			e->env_msg_sendto = 0;
+			if (e->env_msg_send_page)
+				page_decref(e->env_msg_send_page);
+			e->env_msg_send_page = NULL;
+		}
+		env_unlock_pair(e, dst);
+	}
+
+	if (!e->env_msgq)
+		return;
+
+	// e 已经是 ENV_DYING，不会再有新的消息或者等待的发送方
+	env_lock(e);
+	for (; e->env_msg_count; e->env_msg_count--) {
+		m = &e->env_msgq->mq_msgs[e->env_msgq->mq_head];
+		if (m->msg_page)
+			page_decref(m->msg_page);
+		e->env_msgq->mq_head = (e->env_msgq->mq_head + 1) % MSGQ_DEPTH_MAX;
+	}
+	env_unlock(e);
+
+	for (i = 0; i < NENV && e->env_msg_waiters; i++) {
+		s = &envs[i];
+		if (s == e || s->env_msg_sendto != e->env_id)
+			continue;
+		env_lock_pair(e, s);
+		if (s->env_msg_sendto == e->env_id) {
+			e->env_msg_waiters--;
+			s->env_msg_sendto = 0;
+			if (s->env_msg_send_page)
+				page_decref(s->env_msg_send_page);
+			s->env_msg_send_page = NULL;
+			s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			env_set_runnable(s);
+		}
+		env_unlock_pair(e, s);
+	}
+
+	page_decref(pa2page(PADDR(e->env_msgq)));
+	e->env_msgq = NULL;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -126,6 +361,7 @@ env_init(void)
 		// 假设之前的memset是成功的，这里不需要进行各个域的初始化
 		envs[i].env_link = env_free_list;
 		env_free_list = envs + i;
+		__spin_initlock(&env_locks[i], "env_lock", SPIN_TICKET, LOCK_RANK_ENV, i);
 	}
 
 	// Per-CPU part of the initialization
@@ -133,13 +369,25 @@ env_init(void)
 }
 
 // Load GDT and segment descriptors.
+// 最终项目：%gs 每 CPU 数据
+// 这是每个 CPU 最先调用的初始化函数，之后才能使用 thiscpu 和 curenv
 void
 env_init_percpu(void)
 {
+	int id = lapic_id();
+
+	static_assert(GD_CPU0 == GD_TSS0 + (NCPU << 3));
+
 	lgdt(&gdt_pd);
-	// The kernel never uses GS or FS, so we leave those set to
+	// The kernel uses GS for per-CPU data: its base is this CPU's
+	// struct CpuInfo. The trap entry code reloads it (see _alltraps),
+	// and env_pop_tf gives the user data segment back to user mode.
+	cpus[id].cpu_self = &cpus[id];
+	gdt[(GD_CPU0 >> 3) + id] = SEG16(STA_W, (uint32_t) &cpus[id],
+					 sizeof(struct CpuInfo) - 1, 0);
+	asm volatile("movw %%ax,%%gs" :: "a" (GD_CPU0 + (id << 3)));
+	// The kernel never uses FS, so we leave it set to
 	// the user data segment.
-	asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
 	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
@@ -190,7 +438,7 @@ env_setup_vm(struct Env *e)
 	//    - The functions in kern/pmap.h are handy.
 
 	// LAB 3: Your code here.
-	p->pp_ref++;
+	page_incref(p);
 	e->env_pgdir = page2kva(p);
 
 	// 直接复制内核页目录
@@ -219,12 +467,19 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_table_lock);
+	if (env_pending_head)
+		env_reclaim();
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_table_lock);
 		return -E_NO_FREE_ENV;
+	}
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_unlock(&env_table_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -235,9 +490,29 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
 	e->lottery_count = 1;
+	e->env_quantum = ENV_QUANTUM_DEFAULT;
+	e->env_slice_left = 0;
+	e->env_preempts = 0;
+	e->env_utime = e->env_stime = e->env_wait_time = 0;
+	e->env_nvcsw = 0;
+	e->env_ring = NULL;
+	e->env_ring_cancel = false;
+	e->env_msgq = NULL;
+	e->env_msg_depth = e->env_msg_count = e->env_msg_peak = 0;
+	e->env_msg_received = e->env_msg_overflows = e->env_msg_full_waits = 0;
+	e->env_msg_waiters = 0;
+	e->env_msg_recving = false;
+	e->env_msg_sendto = 0;
+	e->env_msg_send_page = NULL;
+	e->env_futex_pa = 0;
+	e->env_futex_next = NULL;
+#ifdef SYSSTAT_PER_ENV
+	memset(e->env_syscalls, 0, sizeof(e->env_syscalls));
+#endif
+	e->env_fpu = NULL;
+	e->env_fpu_cpu = -1;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -260,6 +535,11 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_tf.tf_cs = GD_UT | 3;
 	// You will set e->env_tf.tf_eip later.
 
+	// 最终项目：内核信息页
+	// 进程开始运行时 %edx 是自己的 envid，libmain 用它设置 thisenv，
+	// 不必再调用 sys_getenvid（见 lib/entry.S）
+	e->env_tf.tf_regs.reg_edx = e->env_id;
+
 	// Enable interrupts while in user mode.
 	// LAB 4: Your code here.
 	e->env_tf.tf_eflags |= FL_IF;
@@ -269,9 +549,20 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_senders = e->env_ipc_senders_tail = NULL;
+	e->env_ipc_send_next = e->env_ipc_sendto = NULL;
+	e->env_ipc_recv_from = 0;
+	e->env_ipc_npages = 0;
 
 	// commit the allocation
+	// 最终项目：细粒度锁
+	// 新进程先是不可运行的，由调用者准备好之后再让它可运行，
+	// 否则别的 CPU 可能在它初始化完成之前就开始运行它
 	env_free_list = e->env_link;
+	spin_lock(&sched_lock);
+	e->env_status = ENV_NOT_RUNNABLE;
+	spin_unlock(&sched_lock);
+	spin_unlock(&env_table_lock);
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -302,7 +593,7 @@ region_alloc(struct Env *e, void *va, size_t len)
 	{
 		if ((pte = pgdir_walk(e->env_pgdir, (void *)i, true)) && (p = page_alloc(0)))
 		{
-			p->pp_ref++;
+			page_incref(p);
 			*pte = page2pa(p) | PTE_U | PTE_W | PTE_P;
 		}
 		else
@@ -433,6 +724,8 @@ env_create(uint8_t *binary, enum EnvType type)
 
 	if (type == ENV_TYPE_FS)
 		env->env_tf.tf_eflags |= FL_IOPL_3;
+
+	env_set_runnable(env);
 }
 
 //
@@ -454,6 +747,21 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// 最终项目：EDF 实时调度
+	// 退出实时类，释放它占用的利用率
+	sched_set_rt(e, 0, 0);
+
+	// 最终项目：阻塞 IPC 发送
+	env_ipc_cleanup(e);
+	// 最终项目：异步消息队列
+	env_msg_cleanup(e);
+	// 最终项目：futex
+	futex_cleanup(e);
+
+	// 最终项目：细粒度锁
+	// 等正在操作这个进程地址空间的其他 CPU 完成
+	env_lock(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -475,6 +783,15 @@ env_free(struct Env *e)
 		// free the page table itself
 		e->env_pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
+
+		// 最终项目：可抢占的内核操作
+		// 大进程的释放可能很久，每释放一个页表检查一次是否该放开锁和中断。
+		// 进程已经是 ENV_DYING，放开锁期间其他 CPU 不会再操作它的地址空间
+		if (preempt_due()) {
+			env_unlock(e);
+			preempt_point();
+			env_lock(e);
+		}
 	}
 
 	// free the page directory
@@ -482,10 +799,156 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
+	// 最终项目：延迟 FPU 切换
+	// 进程只会在它最后运行的 CPU 上被回收，别的 CPU 上留下的
+	// cpu_fpu_owner 不会再被使用（见 env_fpu_trap）
+	if (e->env_fpu) {
+		if (percpu(cpu_fpu_owner) == e)
+			percpu(cpu_fpu_owner) = NULL;
+		page_decref(pa2page(PADDR(e->env_fpu)));
+		e->env_fpu = NULL;
+	}
+
+	// 最终项目：共享内存系统调用环
+	if (e->env_ring) {
+		page_decref(pa2page(PADDR(e->env_ring)));
+		e->env_ring = NULL;
+	}
+	env_unlock(e);
+
 	// return the environment to the free list
+	spin_lock(&env_table_lock);
+	spin_lock(&sched_lock);
 	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+	spin_unlock(&sched_lock);
+	// 最终项目：RCU 式进程回收
+	// 其他 CPU 可能还拿着指向它的指针，等宽限期结束后才能重新分配
+	e->env_free_epoch = env_epoch++;
+	e->env_link = NULL;
+	if (env_pending_tail)
+		env_pending_tail->env_link = e;
+	else
+		env_pending_head = e;
+	env_pending_tail = e;
+	spin_unlock(&env_table_lock);
+
+	// 最终项目：futex：叫醒在 wait() 里等它的进程
+	e->env_exit_count++;
+	futex_wake_pa(PADDR(&e->env_exit_count), FUTEX_WAKE_ALL);
+}
+
+// 最终项目：RCU 式进程回收
+// 把宽限期已经结束的槽位放回 env_free_list（调用者持有 env_table_lock）
+void
+env_reclaim(void)
+{
+	uint32_t min = env_epoch;
+	struct Env *e;
+	int i;
+
+	// 停机的 CPU 不持有任何 Env 指针，停机本身也是静止点
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_status == CPU_STARTED && cpus[i].cpu_epoch < min)
+			min = cpus[i].cpu_epoch;
+
+	// 等待链表按释放顺序排列，env_free_epoch 单调递增
+	while ((e = env_pending_head) && e->env_free_epoch < min) {
+		env_pending_head = e->env_link;
+		if (!env_pending_head)
+			env_pending_tail = NULL;
+		e->env_link = env_free_list;
+		env_free_list = e;
+	}
+}
+
+// 最终项目：RCU 式进程回收
+// 静止点：这个 CPU 不再持有任何在内核中查找到的 Env 指针
+void
+env_quiescent(void)
+{
+	percpu(cpu_epoch) = env_epoch;
+}
+
+// 最终项目：延迟 FPU 切换
+// 进程的 FPU/SSE 状态只在它真正使用 FPU 时才恢复（CR0.TS 引发的
+// #NM，见 env_fpu_trap），从不使用 FPU 的进程没有任何额外开销。
+// 不变式：一个进程不在某个 CPU 上运行时，它的保存区总是最新的，
+// 所以另一个 CPU 可以直接从保存区恢复，不需要向原来的 CPU 发 IPI
+
+// 打开 FXSAVE 和 SSE，并记下初始的 FPU 状态
+void
+env_fpu_init_percpu(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (!((edx >> CPUID_EDX_FXSR_BIT) & 1) || !((edx >> CPUID_EDX_SSE_BIT) & 1))
+		panic("CPU %d lacks FXSAVE/SSE support", cpunum());
+
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	lcr0((rcr0() | CR0_MP | CR0_NE) & ~(CR0_EM | CR0_TS));
+	asm volatile("fninit");
+	if (thiscpu == bootcpu)
+		fxsave(env_fpu_init_state);
+	percpu(cpu_fpu_owner) = NULL;
+
+	// 内核自己不使用 FPU，在第一个进程使用之前一直保持 TS
+	lcr0(rcr0() | CR0_TS);
+}
+
+// 当前进程在 CR0.TS 置位时使用了 FPU（#NM）：把它的状态装进 FPU。
+// 原来的主人离开这个 CPU 时已经保存过（见 env_fpu_save），这里不用再保存
+int
+env_fpu_trap(void)
+{
+	struct Env *e = curenv;
+	struct PageInfo *pp;
+
+	clts();
+	if (percpu(cpu_fpu_owner) == e && e->env_fpu_cpu == cpunum())
+		return 0;
+
+	if (!e->env_fpu) {
+		if (!(pp = page_alloc(0)))
+			return -E_NO_MEM;
+		page_incref(pp);
+		e->env_fpu = page2kva(pp);
+		memcpy(e->env_fpu, env_fpu_init_state, sizeof(env_fpu_init_state));
+	}
+
+	fxrstor(e->env_fpu);
+	percpu(cpu_fpu_owner) = e;
+	e->env_fpu_cpu = cpunum();
+	return 0;
+}
+
+// 如果 curenv 在这次运行中用过 FPU，把状态写回保存区。
+// 调度器在 curenv 离开这个 CPU 之前调用，之后它可以在任何 CPU 上恢复；
+// FPU 里的内容仍然有效，它回到这个 CPU 时不需要重新装载
+void
+env_fpu_save(void)
+{
+	struct Env *e = curenv;
+
+	if (e && percpu(cpu_fpu_owner) == e && !(rcr0() & CR0_TS))
+		fxsave(e->env_fpu);
+}
+
+// 子进程 child 继承 curenv 的 FPU 状态
+int
+env_fpu_fork(struct Env *child)
+{
+	struct PageInfo *pp;
+
+	if (!curenv->env_fpu)
+		return 0;
+	if (!(pp = page_alloc(0)))
+		return -E_NO_MEM;
+	page_incref(pp);
+	child->env_fpu = page2kva(pp);
+	env_fpu_save();
+	memcpy(child->env_fpu, curenv->env_fpu, sizeof(env_fpu_init_state));
+	return 0;
 }
 
 //
@@ -496,13 +959,25 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
+	bool busy;
+
+	spin_lock(&sched_lock);
+	if (e->env_status == ENV_FREE || (e->env_status == ENV_DYING && e != curenv)) {
+		spin_unlock(&sched_lock);
+		return;
+	}
+
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	// 最终项目：细粒度锁
+	// 标记为 DYING 之后调度器不会再选中它；
+	// 在其他 CPU 上的进程由那个 CPU 在下次进入内核或调度时回收
+	busy = e != curenv && env_on_cpu(e);
+	e->env_status = ENV_DYING;
+	spin_unlock(&sched_lock);
+	if (busy)
 		return;
-	}
 
 	env_free(e);
 
@@ -512,6 +987,14 @@ env_destroy(struct Env *e)
 	}
 }
 
+// 最终项目：细粒度锁
+// 进程是否是某个 CPU 的 curenv（调用者持有 sched_lock）
+bool
+env_on_cpu(struct Env *e)
+{
+	return cpus[e->env_cpunum].cpu_env == e;
+}
+
 
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
@@ -525,20 +1008,87 @@ env_pop_tf(struct Trapframe *tf)
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
 
+	// 返回用户态是一个静止点
+	env_quiescent();
+	// 阻塞的系统调用不会回到 trap_dispatch 清除它
+	percpu(cpu_syscall_tf) = NULL;
+	irqoff_end();
+
 	__asm __volatile("movl %0,%%esp\n"
+		"\tmovw %w1,%%gs\n"	/* 最终项目：%gs 每 CPU 数据 */
 		"\tpopal\n"
 		"\tpopl %%es\n"
 		"\tpopl %%ds\n"
 		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
 		"\tiret"
-		: : "g" (tf) : "memory");
+		: : "g" (tf), "r" (GD_UD | 3) : "memory");
 	panic("iret failed");  /* mostly to placate the compiler */
 }
 
+// 最终项目：CPU 时间统计
+
+// 把进程标记为可运行，并记下开始等待调度的时刻
+// 最终项目：唤醒空闲 CPU
+// 如果有 CPU 正停在 sched_halt 里，用 IPI 叫醒一个来运行它，
+// 而不是等到那个 CPU 的下一次计时器中断
+// 最终项目：细粒度锁
+// 调用者持有 sched_lock；已经被销毁的进程不会被复活
+void
+env_set_runnable_locked(struct Env *e)
+{
+	int i;
+
+	if (e->env_status == ENV_FREE || e->env_status == ENV_DYING)
+		return;
+	e->env_runnable_since = read_tsc();
+	e->env_status = ENV_RUNNABLE;
+
+	for (i = 0; i < ncpu; i++)
+		if (&cpus[i] != thiscpu && cpus[i].cpu_status == CPU_HALTED)
+		{
+			lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+			break;
+		}
+}
+
+void
+env_set_runnable(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	env_set_runnable_locked(e);
+	spin_unlock(&sched_lock);
+}
+
+// 从用户态陷入内核时调用：上次标记以来的时间算作 curenv 的用户态时间
+void
+env_charge_user(void)
+{
+	uint64_t now = read_tsc();
+
+	curenv->env_utime += now - thiscpu->cpu_tsc_mark;
+	thiscpu->cpu_tsc_mark = now;
+}
+
+// 离开内核（回到用户态或者停机）时调用：
+// 上次标记以来的时间算作 curenv 的内核态时间
+void
+env_charge_system(void)
+{
+	uint64_t now = read_tsc();
+
+	if (curenv)
+		curenv->env_stime += now - thiscpu->cpu_tsc_mark;
+	thiscpu->cpu_tsc_mark = now;
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
 //
+// 最终项目：细粒度锁
+// 状态切换、curenv 和地址空间的切换已经由调度器在 sched_lock 内
+// 完成（见 sched_claim），这里只负责进入 curenv（== e）。
+//
 // This function does not return.
 //
 void
@@ -563,16 +1113,23 @@ env_run(struct Env *e)
 
 	// LAB 3: Your code here.
 
-	if (curenv && curenv->env_status == ENV_RUNNING)
-		curenv->env_status = ENV_RUNNABLE;
+	assert(e == curenv);
 
-	e->env_status = ENV_RUNNING;
+	env_charge_system();
 	e->env_runs++;
-	curenv = e;
-
-	lcr3(PADDR(e->env_pgdir));
 
-	unlock_kernel();
+	// 最终项目：陷入时不再复制 Trapframe
+	// 下一次从用户态陷入时，CPU 把陷入帧直接压进 e->env_tf
+	thiscpu->cpu_ts.ts_esp0 = (uintptr_t) (&e->env_tf + 1);
+
+	// 最终项目：延迟 FPU 切换
+	// FPU 里已经是 e 的状态就直接放行，否则设置 CR0.TS，
+	// 等 e 真正使用 FPU 时在 env_fpu_trap 里恢复
+	if (percpu(cpu_fpu_owner) == e && e->env_fpu_cpu == cpunum()) {
+		if (rcr0() & CR0_TS)
+			clts();
+	} else if (!(rcr0() & CR0_TS))
+		lcr0(rcr0() | CR0_TS);
 
 	env_pop_tf(&e->env_tf);
 
@@ -4,10 +4,12 @@
 #define JOS_KERN_ENV_H
 
 #include <inc/env.h>
+#include <inc/syscall.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 extern struct Env *envs;		// All environments
-#define curenv (thiscpu->cpu_env)		// Current environment
+#define curenv percpu(cpu_env)			// Current environment
 extern struct Segdesc gdt[];
 
 void	env_init(void);
@@ -16,8 +18,50 @@ int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_set_runnable(struct Env *e);
+void	env_set_runnable_locked(struct Env *e);
+bool	env_on_cpu(struct Env *e);
+void	env_charge_user(void);
+void	env_charge_system(void);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+
+// 最终项目：细粒度锁
+extern struct spinlock env_table_lock;
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_lock_pair(struct Env *a, struct Env *b);
+void	env_unlock_pair(struct Env *a, struct Env *b);
+bool	env_still_valid(struct Env *e, envid_t envid);
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+// 最终项目：阻塞 IPC 发送
+void	env_ipc_enqueue(struct Env *dst, struct Env *s);
+struct Env *env_ipc_dequeue(struct Env *dst);
+
+// 最终项目：异步消息队列
+// 队列是一个环，放在 env_msgq 指向的页面里；排队的页面由队列持有一个引用
+struct Msg {
+	envid_t msg_from;
+	uint32_t msg_value;
+	struct PageInfo *msg_page;	// NULL 表示没有页面
+	int msg_perm;
+};
+
+struct MsgQueue {
+	uint32_t mq_head;		// 第一条消息的下标（消息数见 env_msg_count）
+	uint32_t mq_scan;		// 下次从这里开始找等待空位的发送方
+	struct Msg mq_msgs[MSGQ_DEPTH_MAX];
+};
+
+// 最终项目：RCU 式进程回收
+void	env_reclaim(void);
+void	env_quiescent(void);
+// 最终项目：延迟 FPU 切换
+void	env_fpu_init_percpu(void);
+int	env_fpu_trap(void);
+void	env_fpu_save(void);
+int	env_fpu_fork(struct Env *child);
+
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
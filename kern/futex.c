@@ -0,0 +1,213 @@
+// 最终项目：futex
+// 用户态同步原语的等待和唤醒。等待者按所等待的字的物理地址挂在哈希桶里，
+// 所以不同进程通过共享页面（PTE_SHARE、sfork）或者 UENVS 看到的同一个字
+// 会找到同一个队列。每个桶有自己的锁，位于进程锁和 sched_lock 之间：
+// 等待者持有自己的锁查页表，再锁住桶比较字的值并挂进队列，
+// 唤醒方锁住桶摘下等待者，两者互斥，不会错过唤醒
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/syscall.h>
+#include <inc/x86.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/futex.h>
+
+#define FUTEX_HASH_BITS		6
+#define FUTEX_NBUCKETS		(1 << FUTEX_HASH_BITS)
+
+struct FutexBucket {
+	struct spinlock fb_lock;
+	struct Env *fb_head;		// 等待者，先进先出
+	struct Env *fb_tail;
+	uint32_t fb_ntimed;		// 其中带超时的等待者数，为 0 时 futex_tick 跳过这个桶
+};
+
+static struct FutexBucket futex_table[FUTEX_NBUCKETS];
+
+static struct FutexBucket *
+futex_bucket(physaddr_t pa)
+{
+	return &futex_table[((pa >> 2) * 0x9e3779b1) >> (32 - FUTEX_HASH_BITS)];
+}
+
+void
+futex_init(void)
+{
+	int i;
+
+	for (i = 0; i < FUTEX_NBUCKETS; i++)
+		__spin_initlock(&futex_table[i].fb_lock, "futex_lock", SPIN_TICKET, LOCK_RANK_FUTEX, 0);
+}
+
+// 把 e 从桶里摘下来，交给调用者唤醒（调用者持有桶的锁）
+static void
+futex_unlink(struct FutexBucket *b, struct Env *e)
+{
+	struct Env **pp, *prev = NULL;
+
+	for (pp = &b->fb_head; *pp != e; pp = &(*pp)->env_futex_next)
+		prev = *pp;
+	*pp = e->env_futex_next;
+	if (b->fb_tail == e)
+		b->fb_tail = prev;
+	e->env_futex_next = NULL;
+	e->env_futex_pa = 0;
+	if (e->env_futex_deadline)
+		b->fb_ntimed--;
+}
+
+// 如果 *addr（调用者的用户地址，可以在 UTOP 之上，例如 UENVS）
+// 仍然等于 expected，就睡眠到被 futex_wake 唤醒（返回 0），
+// 或者超过 timeout_us 微秒（返回 -E_TIMEOUT，0 表示不超时）。
+// 等待成功时不返回。
+//
+// Returns < 0 on error.  Errors are:
+//	-E_INVAL if addr is not 4-byte aligned or not mapped user-readable.
+//	-E_AGAIN if *addr != expected.
+int
+futex_wait(uint32_t *addr, uint32_t expected, uint32_t timeout_us)
+{
+	struct FutexBucket *b;
+	struct PageInfo *pp;
+	physaddr_t pa;
+	pte_t *pte;
+
+	if ((uintptr_t) addr % sizeof(uint32_t) || (uintptr_t) addr >= ULIM)
+		return -E_INVAL;
+
+	env_lock(curenv);
+	if (!(pp = page_lookup(curenv->env_pgdir, addr, &pte)) || !(*pte & PTE_U))
+	{
+		env_unlock(curenv);
+		return -E_INVAL;
+	}
+	pa = page2pa(pp) + PGOFF(addr);
+	b = futex_bucket(pa);
+
+	spin_lock(&b->fb_lock);
+	if (*(volatile uint32_t *) KADDR(pa) != expected)
+	{
+		spin_unlock(&b->fb_lock);
+		env_unlock(curenv);
+		return -E_AGAIN;
+	}
+
+	curenv->env_futex_pa = pa;
+	curenv->env_futex_next = NULL;
+	curenv->env_futex_deadline = 0;
+	if (timeout_us)
+	{
+		curenv->env_futex_deadline = read_tsc() + (uint64_t) timeout_us * tsc_per_us;
+		b->fb_ntimed++;
+	}
+	if (b->fb_tail)
+		b->fb_tail->env_futex_next = curenv;
+	else
+		b->fb_head = curenv;
+	b->fb_tail = curenv;
+
+	// 唤醒方改写返回值；先改掉状态再放开桶的锁，不会错过唤醒。
+	// 和 ipc_sleep 一样只改 ENV_RUNNING：别的 CPU 上的 env_destroy 只在
+	// sched_lock 下把它标成 ENV_DYING，不能被覆盖，否则它永远不会被回收。
+	// 标成 ENV_DYING 时照样让出 CPU，回收时 futex_cleanup 把它从桶里摘掉
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	spin_lock(&sched_lock);
+	if (curenv->env_status == ENV_RUNNING)
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	spin_unlock(&sched_lock);
+	spin_unlock(&b->fb_lock);
+	env_unlock(curenv);
+
+	curenv->env_nvcsw++;
+	sched_detach();
+	sched_yield();
+}
+
+// 唤醒最多 n 个在物理地址 pa 上等待的进程，返回唤醒的个数
+int
+futex_wake_pa(physaddr_t pa, uint32_t n)
+{
+	struct FutexBucket *b = futex_bucket(pa);
+	struct Env *e, *next;
+	int woken = 0;
+
+	spin_lock(&b->fb_lock);
+	for (e = b->fb_head; e && woken < n; e = next)
+	{
+		next = e->env_futex_next;
+		if (e->env_futex_pa != pa)
+			continue;
+		futex_unlink(b, e);
+		env_set_runnable(e);
+		woken++;
+	}
+	spin_unlock(&b->fb_lock);
+	return woken;
+}
+
+// 唤醒最多 n 个在 addr（调用者的用户地址，要求同 futex_wait）上等待的进程，
+// 返回唤醒的个数，或者 -E_INVAL
+int
+futex_wake(uint32_t *addr, uint32_t n)
+{
+	struct PageInfo *pp;
+	physaddr_t pa;
+	pte_t *pte;
+	int r;
+
+	if ((uintptr_t) addr % sizeof(uint32_t) || (uintptr_t) addr >= ULIM)
+		return -E_INVAL;
+
+	// 持有自己的锁，查到的页面在唤醒期间不会被换掉
+	env_lock(curenv);
+	if (!(pp = page_lookup(curenv->env_pgdir, addr, &pte)) || !(*pte & PTE_U))
+		r = -E_INVAL;
+	else
+		r = futex_wake_pa(page2pa(pp) + PGOFF(addr), n);
+	env_unlock(curenv);
+	return r;
+}
+
+// 计时器中断（只在 BSP 上）：唤醒超时的等待者，它们从 futex_wait 返回 -E_TIMEOUT
+void
+futex_tick(uint64_t now)
+{
+	struct FutexBucket *b;
+	struct Env *e, *next;
+
+	for (b = futex_table; b < futex_table + FUTEX_NBUCKETS; b++)
+	{
+		if (!b->fb_ntimed)
+			continue;
+		spin_lock(&b->fb_lock);
+		for (e = b->fb_head; e; e = next)
+		{
+			next = e->env_futex_next;
+			if (!e->env_futex_deadline || now < e->env_futex_deadline)
+				continue;
+			futex_unlink(b, e);
+			e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+			env_set_runnable(e);
+		}
+		spin_unlock(&b->fb_lock);
+	}
+}
+
+// 进程被回收前把它从等待队列里摘下来
+void
+futex_cleanup(struct Env *e)
+{
+	struct FutexBucket *b;
+	physaddr_t pa = e->env_futex_pa;
+
+	if (!pa)
+		return;
+	b = futex_bucket(pa);
+	spin_lock(&b->fb_lock);
+	if (e->env_futex_pa == pa)
+		futex_unlink(b, e);
+	spin_unlock(&b->fb_lock);
+}
@@ -0,0 +1,21 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// 最终项目：futex
+void futex_init(void);
+int futex_wait(uint32_t *addr, uint32_t expected, uint32_t timeout_us);
+int futex_wake(uint32_t *addr, uint32_t n);
+int futex_wake_pa(physaddr_t pa, uint32_t n);
+void futex_tick(uint64_t now);
+void futex_cleanup(struct Env *e);
+
+#endif	// !JOS_KERN_FUTEX_H
@@ -14,9 +14,14 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
 
 static void boot_aps(void);
 
+// 最终项目：细粒度锁
+// 初始进程创建完成后置 1，在此之前 APs 不进入调度器
+static volatile uint32_t boot_envs_ready;
+
 
 void
 i386_init(void)
@@ -28,6 +33,10 @@ i386_init(void)
 	// This ensures that all static/global variables start out zero.
 	memset(edata, 0, end - edata);
 
+	// 最终项目：%gs 每 CPU 数据
+	// 加载 GDT 和本 CPU 的 %gs，之后才能使用 thiscpu（加锁时会用到）
+	env_init_percpu();
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -45,16 +54,24 @@ i386_init(void)
 	mp_init();
 	lapic_init();
 
+	// 最终项目：内核信息页：需要 CPU 数和 TSC 频率
+	kinfo_init();
+	// 最终项目：futex
+	futex_init();
+
 	// Lab 4 multitasking initialization functions
 	pic_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
+	// 最终项目：细粒度锁
+	// 不再有大内核锁，APs 等到初始进程创建完成后才进入调度器（见 mp_main）
 
 	// Starting non-boot CPUs
 	boot_aps();
 
+#ifdef SPINLOCK_BENCH
+	spin_bench();
+#endif
+
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -69,6 +86,8 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	xchg(&boot_envs_ready, 1);
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -111,19 +130,27 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(PADDR(kern_pgdir));
+	// 最终项目：%gs 每 CPU 数据：先加载 %gs 再使用 cprintf
+	env_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
-	env_init_percpu();
 	trap_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
+#ifdef SPINLOCK_BENCH
+	spin_bench();
+#endif
+
 	// Now that we have finished some basic setup, call sched_yield()
 	// to start running processes on this CPU.  But make sure that
 	// only one CPU can enter the scheduler at a time!
 	//
 	// Your code here:
-	lock_kernel();
+	// 最终项目：细粒度锁
+	// 调度器由 sched_lock 保护，这里只需等初始进程创建完成
+	while (!boot_envs_ready)
+		asm volatile("pause");
 
 	sched_yield();
 }
@@ -20,3 +20,27 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+// 最终项目：调度器时间片校准
+// 用 8253/8254 PIT 的 2 号通道做一个单次定时器，
+// 供 lapic_init 校准 LAPIC 计时器和 TSC 使用。
+// 2 号通道的门控和输出都在 0x61 端口上，不会产生中断。
+
+// 启动一个 count 个 PIT 周期的单次计时
+void
+pit_oneshot_start(uint16_t count)
+{
+	// 打开 2 号通道门控，关闭扬声器
+	outb(IO_PIT_GATE, (inb(IO_PIT_GATE) & ~0x02) | 0x01);
+	// 2 号通道，先低后高字节，模式 0（计数结束时输出变高）
+	outb(IO_PIT_MODE, 0xb0);
+	outb(IO_PIT_CH2, count & 0xff);
+	outb(IO_PIT_CH2, count >> 8);
+}
+
+// 单次计时是否已经结束
+bool
+pit_oneshot_done(void)
+{
+	return (inb(IO_PIT_GATE) & 0x20) != 0;
+}
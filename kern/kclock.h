@@ -6,6 +6,8 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define	IO_RTC		0x070		/* RTC port */
 
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
@@ -26,7 +28,15 @@
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY	(MC_NVRAM_START + 36)	/* RTC offset 0x32 */
 
+/* 8253/8254 PIT, used only to calibrate the LAPIC timer and the TSC */
+#define	IO_PIT_CH2	0x042		/* channel 2 counter */
+#define	IO_PIT_MODE	0x043		/* mode/command register */
+#define	IO_PIT_GATE	0x061		/* bit 0: ch2 gate, bit 5: ch2 output */
+#define	PIT_HZ		1193182
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
+void pit_oneshot_start(uint16_t count);
+bool pit_oneshot_done(void);
 
 #endif	// !JOS_KERN_KCLOCK_H
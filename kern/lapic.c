@@ -9,6 +9,8 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/kclock.h>
+#include <kern/sched.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -45,6 +47,11 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// 最终项目：调度器时间片校准
+// 由 BSP 在启动时对照 PIT 测得，AP 直接沿用
+uint32_t lapic_ticks_per_us;	// LAPIC 计时器每微秒的计数（分频 1）
+uint32_t tsc_per_us;		// TSC 每微秒的计数
+
 static void
 lapicw(int index, int value)
 {
@@ -52,6 +59,44 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// 最终项目：调度器时间片校准
+// 让 LAPIC 计时器和 TSC 同时跑 CALIBRATE_MS 毫秒的 PIT 单次计时，
+// 得出它们每微秒的计数，之后时间片就可以用微秒来表示了
+#define CALIBRATE_MS	10
+
+static void
+lapic_calibrate(void)
+{
+	uint32_t lapic_elapsed, tsc_begin, tsc_end;
+
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED);
+	pit_oneshot_start(PIT_HZ / 1000 * CALIBRATE_MS);
+	lapicw(TICR, 0xffffffff);
+	tsc_begin = read_tsc();
+
+	while (!pit_oneshot_done() && lapic[TCCR] != 0)
+		;
+
+	tsc_end = read_tsc();
+	lapic_elapsed = 0xffffffff - lapic[TCCR];
+	lapicw(TICR, 0);
+
+	lapic_ticks_per_us = lapic_elapsed / (CALIBRATE_MS * 1000);
+	tsc_per_us = (tsc_end - tsc_begin) / (CALIBRATE_MS * 1000);
+
+	if (lapic_ticks_per_us == 0) {
+		// PIT 不可用或者计时器太慢，退回到假定 1GHz 总线
+		cprintf("lapic: timer calibration failed, assuming 1000 ticks/us\n");
+		lapic_ticks_per_us = 1000;
+	}
+	if (tsc_per_us == 0)
+		tsc_per_us = 1000;
+
+	cprintf("lapic: timer %u ticks/us, tsc %u MHz, tick %u us\n",
+		lapic_ticks_per_us, tsc_per_us, SCHED_TICK_US);
+}
+
 void
 lapic_init(void)
 {
@@ -66,12 +111,14 @@ lapic_init(void)
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
 	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// from lapic[TICR] and then issues an interrupt.
+	// TICR is calibrated against the PIT once, on the BSP, so that
+	// the scheduler tick is SCHED_TICK_US microseconds long.
+	if (!lapic_ticks_per_us)
+		lapic_calibrate();
 	lapicw(TDCR, X1);
 	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TICR, lapic_ticks_per_us * SCHED_TICK_US);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -112,7 +159,7 @@ lapic_init(void)
 }
 
 int
-cpunum(void)
+lapic_id(void)
 {
 	if (lapic)
 		return lapic[ID] >> 24;
@@ -134,8 +181,6 @@ microdelay(int us)
 {
 }
 
-#define IO_RTC  0x70
-
 // Start additional processor running entry code at addr.
 // See Appendix B of MultiProcessor Specification.
 void
@@ -173,6 +218,17 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// 最终项目：唤醒空闲 CPU
+// 向指定 APIC ID 的 CPU 发送 IPI
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
 void
 lapic_ipi(int vector)
 {
@@ -13,6 +13,8 @@
 #include <kern/trap.h>
 #include <kern/pmap.h>
 #include <kern/env.h>
+#include <kern/spinlock.h>
+#include <kern/syscall.h>
 #include <kern/libdisasm/libdis.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
@@ -34,7 +36,11 @@ static struct Command commands[] = {
 	{ "memdump", "Dump the contents of a range of memory", mon_memdump },
 	{ "testint", "Run an instruction 'int $<arg>'", mon_testint },
 	{ "si", "Run the next instruction of current environment and stop", mon_si },
-	{ "exit", "Switch back to the current environment", mon_exit }
+	{ "exit", "Switch back to the current environment", mon_exit },
+	{ "envstat", "Display scheduling statistics of environments", mon_envstat },
+	{ "lockstat", "Display and reset lock contention statistics", mon_lockstat },
+	{ "irqoff", "Display and reset the interrupts-off latency histogram", mon_irqoff },
+	{ "syscallstat", "Display or control per-syscall statistics (on|off|reset)", mon_syscallstat }
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -669,6 +675,76 @@ mon_exit(int argc, char **argv, struct Trapframe *tf)
 	return -1;
 }
 
+// 最终项目：调度器时间片、CPU 时间统计
+// 列出所有进程的调度统计，时间单位为毫秒
+int
+mon_envstat(int argc, char **argv, struct Trapframe *tf)
+{
+	static const char *status_name[] = { "free", "dying", "runnable", "running", "blocked" };
+	uint32_t tsc_per_ms = tsc_per_us * 1000;
+	struct Env *e;
+	int i;
+
+	cprintf("envid     status    runs      quantum(us) user(ms)  sys(ms)   wait(ms)  vcsw      ivcsw\n");
+	for (i = 0; i < NENV; i++)
+	{
+		e = &envs[i];
+		if (e->env_status == ENV_FREE)
+			continue;
+		cprintf("%08x  %-8s  %-8u  %-11u %-8u  %-8u  %-8u  %-8u  %u\n", e->env_id,
+			e->env_status <= ENV_NOT_RUNNABLE ? status_name[e->env_status] : "?",
+			e->env_runs, e->env_quantum,
+			(uint32_t)(e->env_utime / tsc_per_ms),
+			(uint32_t)(e->env_stime / tsc_per_ms),
+			(uint32_t)(e->env_wait_time / tsc_per_ms),
+			e->env_nvcsw, e->env_preempts);
+	}
+	return 0;
+}
+
+// 最终项目：锁争用统计
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+#ifdef LOCK_PROFILE
+	lockstat_print();
+	lockstat_reset();
+#else
+	cprintf("Lock profiling is disabled; define LOCK_PROFILE in kern/spinlock.h\n");
+#endif
+	return 0;
+}
+
+// 最终项目：可抢占的内核操作
+int
+mon_irqoff(int argc, char **argv, struct Trapframe *tf)
+{
+#ifdef IRQOFF_PROFILE
+	irqoff_print();
+	irqoff_reset();
+#else
+	cprintf("Interrupts-off profiling is disabled; define IRQOFF_PROFILE in kern/trap.h\n");
+#endif
+	return 0;
+}
+
+// 最终项目：系统调用统计
+int
+mon_syscallstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc < 2)
+		sysstat_print();
+	else if (strcmp(argv[1], "on") == 0)
+		sysstat_control(SYSSTAT_ON);
+	else if (strcmp(argv[1], "off") == 0)
+		sysstat_control(SYSSTAT_OFF);
+	else if (strcmp(argv[1], "reset") == 0)
+		sysstat_control(SYSSTAT_RESET);
+	else
+		cprintf("Usage: syscallstat [on|off|reset]\n");
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -21,6 +21,10 @@ int mon_memdump(int argc, char **argv, struct Trapframe *tf);
 int mon_testint(int argc, char **argv, struct Trapframe *tf);
 int mon_si(int argc, char **argv, struct Trapframe *tf);
 int mon_exit(int argc, char **argv, struct Trapframe *tf);
+int mon_envstat(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_irqoff(int argc, char **argv, struct Trapframe *tf);
+int mon_syscallstat(int argc, char **argv, struct Trapframe *tf);
 
 int parse_hexaddr(const char *str, uint32_t *result);
 void show_nextinstr(struct Trapframe *tf);
@@ -5,11 +5,14 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/kinfo.h>
+#include <inc/sysstat.h>
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 #define dbgprintf(...) cprintf(__VA_ARGS__)
 
@@ -25,6 +28,12 @@ int support_pse;			// 处理器是否支持 PSE
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
+struct KernInfo *kinfo;		// 最终项目：内核信息页，用户在 UKINFO 处只读
+struct Sysstat *sysstat;	// 最终项目：系统调用统计，用户在 USYSSTAT 处只读
+
+// 最终项目：细粒度锁
+// 保护 page_free_list、allocated_pages 和所有页的 pp_ref
+static struct spinlock page_lock = SPINLOCK_INIT("page_lock", SPIN_MCS, LOCK_RANK_PAGE);
 
 
 // --------------------------------------------------------------
@@ -173,6 +182,18 @@ mem_init(void)
     envs = boot_alloc(sizeof(struct Env) * NENV);
     memset(envs, 0, sizeof(struct Env) * NENV);
 
+    // 最终项目：内核信息页
+    // 用户在 UKINFO 处只读，UKINFO 是 UENVS 区域的最后一页
+    static_assert(sizeof(struct Env) * NENV <= USYSSTAT - UENVS);
+    static_assert(sizeof(struct KernInfo) <= PGSIZE);
+    kinfo = boot_alloc(PGSIZE);
+    memset(kinfo, 0, PGSIZE);
+
+    // 最终项目：系统调用统计：用户在 USYSSTAT 处只读
+    static_assert(sizeof(struct Sysstat) <= UKINFO - USYSSTAT);
+    sysstat = boot_alloc(sizeof(struct Sysstat));
+    memset(sysstat, 0, ROUNDUP(sizeof(struct Sysstat), PGSIZE));
+
     //////////////////////////////////////////////////////////////////////
     // Now that we've allocated the initial kernel data structures, we set
     // up the list of free physical pages. Once we've done so, all further
@@ -208,6 +229,10 @@ mem_init(void)
     boot_map_region(kern_pgdir, UENVS, ROUNDUP(sizeof(struct Env) * NENV, PGSIZE), PADDR(envs), PTE_U | PTE_P);
     boot_map_region(kern_pgdir, (uintptr_t) envs, ROUNDUP(sizeof(struct Env) * NENV, PGSIZE), PADDR(envs), PTE_W | PTE_P);
 
+    // 最终项目：内核信息页
+    boot_map_region(kern_pgdir, UKINFO, PGSIZE, PADDR(kinfo), PTE_U | PTE_P);
+    boot_map_region(kern_pgdir, USYSSTAT, ROUNDUP(sizeof(struct Sysstat), PGSIZE), PADDR(sysstat), PTE_U | PTE_P);
+
     //////////////////////////////////////////////////////////////////////
     // Use the physical memory that 'bootstack' refers to as the kernel
     // stack.  The kernel stack grows down from virtual address KSTACKTOP.
@@ -379,23 +404,28 @@ page_init(void)
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-    struct PageInfo *result = page_free_list;
-    if (!result)
+    struct PageInfo *result;
+
+    spin_lock(&page_lock);
+    result = page_free_list;
+    if (!result) {
+        spin_unlock(&page_lock);
         return NULL;
+    }
     page_free_list = page_free_list->pp_link;
     result->pp_link = NULL;
+    allocated_pages++;
+    spin_unlock(&page_lock);
+
+    // 清零在锁外进行
     if (alloc_flags & ALLOC_ZERO)
         memset(page2kva(result), 0, PGSIZE);
-    allocated_pages++;
     return result;
 }
 
-//
-// Return a page to the free list.
-// (This function should only be called when pp->pp_ref reaches 0.)
-//
-void
-page_free(struct PageInfo *pp)
+// 调用者持有 page_lock
+static void
+__page_free(struct PageInfo *pp)
 {
     if (pp->pp_link)
         panic("page_free panics because it received a freed page\n");
@@ -407,6 +437,18 @@ page_free(struct PageInfo *pp)
     allocated_pages--;
 }
 
+//
+// Return a page to the free list.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free(struct PageInfo *pp)
+{
+    spin_lock(&page_lock);
+    __page_free(pp);
+    spin_unlock(&page_lock);
+}
+
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
@@ -414,8 +456,20 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
+    spin_lock(&page_lock);
     if (--pp->pp_ref == 0)
-        page_free(pp);
+        __page_free(pp);
+    spin_unlock(&page_lock);
+}
+
+// 最终项目：细粒度锁
+// Increment the reference count on a page.
+void
+page_incref(struct PageInfo *pp)
+{
+    spin_lock(&page_lock);
+    pp->pp_ref++;
+    spin_unlock(&page_lock);
 }
 
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
@@ -452,7 +506,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
         pte_table_page = page_alloc(ALLOC_ZERO);
         if (!pte_table_page)
             return NULL;
-        pte_table_page->pp_ref++;
+        page_incref(pte_table_page);
         pte_table = page2pa(pte_table_page);
         pgdir[PDX(va)] = pte_table | PTE_P | PTE_W | PTE_U;
     }
@@ -511,7 +565,7 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
     pte_t *pte = pgdir_walk(pgdir, va, true);
     if (!pte)
         return -E_NO_MEM;
-    pp->pp_ref++;
+    page_incref(pp);
 	page_remove(pgdir, va);
     *pte = page2pa(pp) | perm | PTE_P;
     return 0;
@@ -558,18 +612,42 @@ extern int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 void
 page_remove(pde_t *pgdir, void *va)
 {
-    pte_t *pte;
-    struct PageInfo *page = page_lookup(pgdir, va, &pte);
-    if (!page)
-        return;
+    if (page_remove_noflush(pgdir, va))
+        tlb_invalidate(pgdir, va);
+}
+
+// 最终项目：按范围操作页面的系统调用
+// 与 page_insert 和 page_remove 相同，但不使 TLB 失效。
+// 调用者改完一批页面后用 tlb_invalidate_range 或 tlb_flush 一起处理
+int
+page_insert_noflush(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+    pte_t *pte = pgdir_walk(pgdir, va, true);
+    if (!pte)
+        return -E_NO_MEM;
+    page_incref(pp);
+    page_remove_noflush(pgdir, va);
+    *pte = page2pa(pp) | perm | PTE_P;
+    return 0;
+}
+
+// 返回 va 处原来是否映射了页面
+bool
+page_remove_noflush(pde_t *pgdir, void *va)
+{
+    pte_t *pte = pgdir_walk(pgdir, va, false);
+    struct PageInfo *page;
+    if (!pte || !(*pte & PTE_P))
+        return false;
+    page = pa2page(PTE_ADDR(*pte));
 	if (page2pa(page) == 0x9f000)
 	{
 		cprintf("0x9f000 is freed here with va = %x\n", va);
 	}
-	
+
     page_decref(page);
-    tlb_invalidate(pgdir, va);
     *pte = 0;
+    return true;
 }
 
 //
@@ -584,6 +662,31 @@ tlb_invalidate(pde_t *pgdir, void *va)
         invlpg(va);
 }
 
+// 最终项目：按范围操作页面的系统调用
+// 使整个地址空间的 TLB 失效（全局页除外）
+void
+tlb_flush(pde_t *pgdir)
+{
+    if (!curenv || curenv->env_pgdir == pgdir)
+        lcr3(rcr3());
+}
+
+// 使从 va 开始的 npages 个页面的 TLB 失效。
+// 页面多时重新加载 %cr3 比逐页 invlpg 便宜
+void
+tlb_invalidate_range(pde_t *pgdir, void *va, size_t npages)
+{
+    size_t i;
+
+    if (npages > TLB_FLUSH_PAGES)
+    {
+        tlb_flush(pgdir);
+        return;
+    }
+    for (i = 0; i < npages; i++)
+        tlb_invalidate(pgdir, va + i * PGSIZE);
+}
+
 //
 // Reserve size bytes in the MMIO region and map [pa,pa+size) at this
 // location.  Return the base of the reserved region.  size does *not*
@@ -859,6 +962,12 @@ check_kern_pgdir(void)
     for (i = 0; i < n; i += PGSIZE)
         assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+    // 最终项目：内核信息页
+    assert(check_va2pa(pgdir, UKINFO) == PADDR(kinfo));
+    n = ROUNDUP(sizeof(struct Sysstat), PGSIZE);
+    for (i = 0; i < n; i += PGSIZE)
+        assert(check_va2pa(pgdir, USYSSTAT + i) == PADDR(sysstat) + i);
+
     // check phys mem
     for (i = 0; i < npages * PGSIZE; i += PGSIZE)
         assert(check_va2pa(pgdir, KERNBASE + i) == i);
@@ -17,6 +17,11 @@ extern size_t npages;
 
 extern pde_t *kern_pgdir;
 
+// 最终项目：内核信息页（inc/kinfo.h）
+extern struct KernInfo *kinfo;
+// 最终项目：系统调用统计（inc/sysstat.h）
+extern struct Sysstat *sysstat;
+
 extern int support_pse;
 
 
@@ -62,9 +67,19 @@ int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+void	page_incref(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
 
+// 最终项目：按范围操作页面的系统调用
+// 一次改动超过这么多页时整个刷新 TLB
+#define TLB_FLUSH_PAGES	32
+
+int	page_insert_noflush(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+bool	page_remove_noflush(pde_t *pgdir, void *va);
+void	tlb_flush(pde_t *pgdir);
+void	tlb_invalidate_range(pde_t *pgdir, void *va, size_t npages);
+
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
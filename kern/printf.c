@@ -5,6 +5,8 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+
 
 static void
 putch(int ch, int *cnt)
@@ -17,8 +19,11 @@ int
 vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
+	// 整条输出持有控制台锁，多个 CPU 的输出不会交错
+	bool taken = cons_lock_acquire();
 
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	cons_lock_release(taken);
 	return cnt;
 }
 
@@ -1,14 +1,24 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/kinfo.h>
 #include <kern/spinlock.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
 #include <kern/kclock.h>
+#include <kern/sched.h>
+#include <kern/trap.h>
+#include <kern/futex.h>
 
 // #define LOTTERY_SCHEDULER
 
-void sched_halt(void);
+// 最终项目：细粒度锁
+// 保护所有进程的 env_status 与调度相关字段，以及各 CPU 的 curenv
+// 每次调度都要获取，争用最多，所以使用 MCS 队列锁
+struct spinlock sched_lock = SPINLOCK_INIT("sched_lock", SPIN_MCS, LOCK_RANK_SCHED);
+
+void sched_halt(void) __attribute__((noreturn));
 
 // Lab 4 挑战 2：实现另一种调度机制
 
@@ -54,6 +64,279 @@ rand()
 	return y;
 }
 
+// 最终项目：细粒度锁
+// 进程可以被这个 CPU 选中：可运行，且不是别的 CPU 的 curenv
+// （被其他 CPU 改为可运行的进程，原来的 CPU 可能还停留在它的内核态中）
+static bool
+sched_can_run(struct Env *e)
+{
+	return e->env_status == ENV_RUNNABLE &&
+		(e->env_cpunum == cpunum() || !env_on_cpu(e));
+}
+
+// 在 sched_lock 内把 e 设为这个 CPU 的 curenv 并切换到它的地址空间，
+// 原来的 curenv 如果还在运行则放回可运行状态
+static void
+sched_claim(struct Env *e)
+{
+	struct Env *cur = curenv;
+
+	// 原来的 curenv 刚刚在别的 CPU 上被销毁，要先由这个 CPU 回收
+	if (cur && cur != e && cur->env_status == ENV_DYING)
+	{
+		spin_unlock(&sched_lock);
+		sched_yield();
+	}
+
+	env_charge_system();
+
+	// 最终项目：延迟 FPU 切换
+	if (cur != e)
+		env_fpu_save();
+
+	if (cur && cur != e && cur->env_status == ENV_RUNNING)
+		env_set_runnable_locked(cur);
+
+	if (e->env_status == ENV_RUNNABLE)
+		e->env_wait_time += thiscpu->cpu_tsc_mark - e->env_runnable_since;
+	e->env_status = ENV_RUNNING;
+	e->env_cpunum = cpunum();
+	curenv = e;
+
+	lcr3(PADDR(e->env_pgdir));
+}
+
+// 让出这个 CPU 但不选择新进程：当前进程即将阻塞时使用，
+// 之后别的 CPU 可以马上把它重新调度起来
+// （已经被销毁的进程留给 sched_yield 回收）
+void
+sched_detach(void)
+{
+	spin_lock(&sched_lock);
+	if (curenv->env_status != ENV_DYING)
+	{
+		env_charge_system();
+		env_fpu_save();
+		curenv = NULL;
+		lcr3(PADDR(kern_pgdir));
+	}
+	spin_unlock(&sched_lock);
+}
+
+// 最终项目：调度器时间片
+// 选中一个进程时给它装满时间片再运行；
+// 从陷阱返回同一个进程（env_run）则不会重新装填
+// 调用者持有 sched_lock
+static void __attribute__((noreturn))
+sched_run(struct Env *e)
+{
+	e->env_slice_left = e->env_quantum / SCHED_TICK_US;
+	sched_claim(e);
+	spin_unlock(&sched_lock);
+	env_run(e);
+}
+
+// 最终项目：EDF 实时调度
+// 实时进程按周期释放作业，总是优先运行截止时刻最早的作业；
+// 作业用完本周期预算后被节流，直到下一个周期才能再次运行
+// 实时相关的字段都由 sched_lock 保护
+
+static int sched_nrt;		// 实时进程数
+
+// 一个实时进程的利用率（千分比，向上取整）
+static uint32_t
+rt_util(uint32_t period_us, uint32_t budget_us)
+{
+	return ROUNDUP(budget_us * 1000ULL, period_us) / period_us;
+}
+
+// 设置（period_us 为 0 时取消）进程的实时参数，并做接纳控制
+int
+sched_set_rt(struct Env *e, uint32_t period_us, uint32_t budget_us)
+{
+	uint32_t util = 0;
+	int i, r = 0;
+
+	spin_lock(&sched_lock);
+	if (period_us == 0)
+	{
+		if (e->env_rt_period)
+			sched_nrt--;
+		e->env_rt_period = 0;
+		goto out;
+	}
+
+	budget_us = ROUNDUP(budget_us, SCHED_TICK_US);
+	if (budget_us == 0 || budget_us > period_us)
+	{
+		r = -E_INVAL;
+		goto out;
+	}
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_status != ENV_FREE && envs[i].env_rt_period && &envs[i] != e)
+			util += rt_util(envs[i].env_rt_period, envs[i].env_rt_budget);
+	if (util + rt_util(period_us, budget_us) > SCHED_RT_UTIL_MAX)
+	{
+		r = -E_NO_CAPACITY;
+		goto out;
+	}
+
+	if (!e->env_rt_period)
+		sched_nrt++;
+	e->env_rt_period = period_us;
+	e->env_rt_budget = budget_us;
+	e->env_rt_budget_left = budget_us / SCHED_TICK_US;
+	e->env_rt_deadline = read_tsc() + (uint64_t) period_us * tsc_per_us;
+	e->env_rt_done = e->env_rt_throttled = false;
+	e->env_rt_jobs = 1;
+	e->env_rt_misses = 0;
+
+out:
+	spin_unlock(&sched_lock);
+	return r;
+}
+
+// 到了截止时刻的实时进程：统计是否错过，并释放下一个作业
+static void
+sched_rt_release(uint64_t now)
+{
+	struct Env *e;
+	uint64_t period;
+	int i;
+
+	for (i = 0; i < NENV; i++)
+	{
+		e = &envs[i];
+		if (!e->env_rt_period || e->env_status == ENV_FREE || now < e->env_rt_deadline)
+			continue;
+
+		if (!e->env_rt_done)
+			e->env_rt_misses++;
+
+		period = (uint64_t) e->env_rt_period * tsc_per_us;
+		e->env_rt_deadline += period;
+		if (e->env_rt_deadline <= now)	// 落后了不止一个周期，从现在重新开始
+			e->env_rt_deadline = now + period;
+		e->env_rt_budget_left = e->env_rt_budget / SCHED_TICK_US;
+		e->env_rt_done = e->env_rt_throttled = false;
+		e->env_rt_jobs++;
+	}
+}
+
+// 选出截止时刻最早、可以运行的实时进程，没有则返回 NULL
+static struct Env *
+sched_rt_pick(struct Env *cur)
+{
+	struct Env *e, *best = NULL;
+	int i;
+
+	for (i = 0; i < NENV; i++)
+	{
+		e = &envs[i];
+		if (!e->env_rt_period || e->env_rt_done || e->env_rt_throttled)
+			continue;
+		if (!sched_can_run(e) && !(e == cur && e->env_status == ENV_RUNNING))
+			continue;
+		if (!best || e->env_rt_deadline < best->env_rt_deadline)
+			best = e;
+	}
+	return best;
+}
+
+// 普通进程才参与轮转/彩票调度
+#define BEST_EFFORT(e)	(sched_can_run(e) && !(e)->env_rt_period)
+
+// 最终项目：内核信息页
+// 填写启动后不再改变的字段，在 LAPIC 校准和找到所有 CPU 之后调用
+void
+kinfo_init(void)
+{
+	static_assert(NCPU <= KINFO_NCPU);
+
+	kinfo->ki_tick_us = SCHED_TICK_US;
+	kinfo->ki_tsc_per_us = tsc_per_us;
+	kinfo->ki_ncpu = ncpu;
+	kinfo->ki_tsc_boot = read_tsc();
+}
+
+// 负载的指数平均在内核里多保留 KINFO_LOAD_FRAC 位小数，
+// 否则每步的截断会让一直忙碌的 CPU 停在 985‰，到不了 1000‰
+#define KINFO_LOAD_FRAC		8
+
+static int32_t kinfo_load[NCPU];
+
+// 每个计时器中断更新本 CPU 的负载，BSP 还负责推进全局的中断计数
+static void
+kinfo_tick(void)
+{
+	struct KernCpuInfo *kc = &kinfo->ki_cpu[cpunum()];
+	int32_t *load = &kinfo_load[cpunum()];
+
+	kc->kc_ticks++;
+	*load += (((curenv ? 1000 : 0) << KINFO_LOAD_FRAC) - *load) >> KINFO_LOAD_SHIFT;
+	kc->kc_load = (*load + (1 << (KINFO_LOAD_FRAC - 1))) >> KINFO_LOAD_FRAC;
+
+	if (thiscpu == bootcpu)
+	{
+		kinfo->ki_seq++;
+		kinfo->ki_ticks++;
+		kinfo->ki_seq++;
+	}
+}
+
+// 计时器中断：扣减当前进程的时间片（实时进程扣减预算），
+// 用完或者有更早截止的实时作业就绪时才重新调度
+// 普通进程的时间片只有本 CPU 会修改，不需要加锁
+void
+sched_tick(void)
+{
+	struct Env *cur = curenv, *rt;
+
+	kinfo_tick();
+	// 最终项目：futex：超时的等待由 BSP 统一处理
+	if (thiscpu == bootcpu)
+		futex_tick(read_tsc());
+
+	if (sched_nrt)
+	{
+		spin_lock(&sched_lock);
+		sched_rt_release(read_tsc());
+		rt = sched_rt_pick(cur);
+		if (rt && rt != cur)
+		{
+			if (cur && cur->env_status == ENV_RUNNING)
+				cur->env_preempts++;
+			spin_unlock(&sched_lock);
+			sched_yield();
+		}
+
+		if (cur && cur->env_status == ENV_RUNNING && cur->env_rt_period) {
+			if (cur->env_rt_budget_left > 1) {
+				cur->env_rt_budget_left--;
+				spin_unlock(&sched_lock);
+				return;
+			}
+			// 预算超支，节流到下一个周期
+			cur->env_rt_budget_left = 0;
+			cur->env_rt_throttled = true;
+			cur->env_preempts++;
+			spin_unlock(&sched_lock);
+			sched_yield();
+		}
+		spin_unlock(&sched_lock);
+	}
+
+	if (cur && cur->env_status == ENV_RUNNING) {
+		if (cur->env_slice_left > 1) {
+			cur->env_slice_left--;
+			return;
+		}
+		cur->env_preempts++;
+	}
+	sched_yield();
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
@@ -78,18 +361,39 @@ sched_yield(void)
 
 	// LAB 4: Your code here.
 
+	// 最终项目：细粒度锁
+	// 在别的 CPU 上被销毁的当前进程由这个 CPU 回收
+	if (cur && cur->env_status == ENV_DYING)
+	{
+		env_free(cur);
+		curenv = cur = NULL;
+	}
+
+	spin_lock(&sched_lock);
+
 	if (cur)
 		base = ENVX(cur->env_id);
 
+	// 最终项目：EDF 实时调度
+	// 实时作业优先于所有普通进程
+	if (sched_nrt)
+	{
+		struct Env *rt;
+
+		sched_rt_release(read_tsc());
+		if ((rt = sched_rt_pick(cur)))
+			sched_run(rt);
+	}
+
 #ifdef LOTTERY_SCHEDULER
 	for (i = 0; i < NENV; i++)
-		if (envs[i].env_status == ENV_RUNNABLE)
+		if (BEST_EFFORT(&envs[i]))
 			x += envs[i].lottery_count;
 
 	if (x == 0)
 	{
-		if (cur && cur->env_status == ENV_RUNNING)
-			return env_run(cur);
+		if (cur && cur->env_status == ENV_RUNNING && !cur->env_rt_period)
+			return sched_run(cur);
 		else
 			goto sched_notfound;
 	}
@@ -98,7 +402,7 @@ sched_yield(void)
 
 	while (true)
 		for (i = 0; i < NENV; i++)
-			if (envs[i].env_status == ENV_RUNNABLE)
+			if (BEST_EFFORT(&envs[i]))
 			{
 				x -= envs[i].lottery_count;
 				if (x < 0)
@@ -106,24 +410,77 @@ sched_yield(void)
 			}
 
 	sched_found:
-	env_run(envs + i);
+	sched_run(envs + i);
 
 	sched_notfound:
 #else
 	for (i = 0; i < NENV; i++)
-		if (envs[(i + base) % NENV].env_status == ENV_RUNNABLE)
-			env_run(&envs[(i + base) % NENV]);
+		if (BEST_EFFORT(&envs[(i + base) % NENV]))
+			sched_run(&envs[(i + base) % NENV]);
 
-	if (i == NENV && cur && cur->env_status == ENV_RUNNING)
-		env_run(cur);
+	if (i == NENV && cur && cur->env_status == ENV_RUNNING && !cur->env_rt_period)
+		sched_run(cur);
 #endif
 
+	// 被节流或者作业已完成的实时进程留在可运行状态，等下一个周期
+	if (cur && cur->env_status == ENV_RUNNING)
+		env_set_runnable_locked(cur);
+
 	// sched_halt never returns
 	sched_halt();
 }
 
+// 最终项目：定向让出 CPU
+// 把 CPU 直接交给 e，e 不能马上运行时退化为普通的 sched_yield
+void
+sched_yield_to(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	if (e != curenv && sched_can_run(e))
+	{
+		// 把剩下的时间片转交给目标进程，避免借此延长自己的时间片
+		e->env_slice_left = MAX(curenv->env_slice_left, 1);
+		sched_claim(e);
+		spin_unlock(&sched_lock);
+		env_run(e);
+	}
+	spin_unlock(&sched_lock);
+	sched_yield();
+}
+
+// 最终项目：阻塞 IPC 发送
+// e 刚刚收到消息、还没有被唤醒。它能马上在这个 CPU 上运行时直接切换过去
+// （L4 式的直接切换，不经过调度器的扫描），把剩下的时间片转交给它，
+// 当前进程回到可运行状态；否则只把它设为可运行并返回
+// 最终项目：调用/回复 IPC
+// 当前进程也可能正要阻塞（已经是 ENV_NOT_RUNNABLE），那就保持阻塞
+void
+sched_handoff(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	// 已经被销毁，或者已经被别人唤醒
+	if (e->env_status != ENV_NOT_RUNNABLE)
+	{
+		spin_unlock(&sched_lock);
+		return;
+	}
+	// 还没有离开原来的 CPU（见 sys_ipc_recv），或者当前进程正在被销毁
+	if (env_on_cpu(e) || curenv->env_status == ENV_DYING)
+	{
+		env_set_runnable_locked(e);
+		spin_unlock(&sched_lock);
+		return;
+	}
+	e->env_slice_left = MAX(curenv->env_slice_left, 1);
+	sched_claim(e);
+	spin_unlock(&sched_lock);
+	env_run(e);
+}
+
 // Halt this CPU when there is nothing to do. Wait until the
 // timer interrupt wakes it up. This function never returns.
+// 最终项目：细粒度锁
+// 调用者持有 sched_lock
 //
 void
 sched_halt(void)
@@ -139,22 +496,37 @@ sched_halt(void)
 			break;
 	}
 	if (i == NENV) {
+		spin_unlock(&sched_lock);
+		env_quiescent();
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
+	if (curenv && curenv->env_status == ENV_DYING)
+	{
+		spin_unlock(&sched_lock);
+		sched_yield();
+	}
+
+	// 停机前把内核态时间记到刚离开的进程上
+	env_charge_system();
+	env_fpu_save();
+
 	// Mark that no environment is running on this CPU
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
+	// 最终项目：RCU 式进程回收：停机是一个静止点
+	env_quiescent();
+
 	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// timer interupts come in, we know we should re-enter
+	// the scheduler
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	spin_unlock(&sched_lock);
+	irqoff_end();
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -166,6 +538,6 @@ sched_halt(void)
 		"1:\n"
 		"hlt\n"
 		"jmp 1b\n"
-	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	: : "a" (thiscpu->cpu_kstacktop));
+	__builtin_unreachable();
 }
-
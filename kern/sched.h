@@ -6,7 +6,32 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+// 最终项目：调度器时间片校准
+// LAPIC 计时器中断周期（微秒），时间片以此为单位
+#define SCHED_TICK_US		1000
+
+// 最终项目：EDF 实时调度
+// 实时进程的总利用率上限（千分比）
+#define SCHED_RT_UTIL_MAX	900
+
+struct Env;
+struct spinlock;
+
+// 最终项目：细粒度锁
+extern struct spinlock sched_lock;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+// Called on every timer tick; returns unless the time slice ran out.
+void sched_tick(void);
+int sched_set_rt(struct Env *e, uint32_t period_us, uint32_t budget_us);
+// Hand the CPU directly to e if it can run right away; does not return.
+void sched_yield_to(struct Env *e) __attribute__((noreturn));
+// Give up this CPU without picking a new env (curenv is about to block).
+void sched_detach(void);
+// Wake e (blocked in sys_ipc_recv) and run it here if it can run right away.
+void sched_handoff(struct Env *e);
+// 最终项目：内核信息页
+void kinfo_init(void);
 
 #endif	// !JOS_KERN_SCHED_H
@@ -9,14 +9,26 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+// 最终项目：排队自旋锁
+// MCS 锁的等待节点。每个 CPU 有一组，按需分配给它正在获取或持有的
+// MCS 锁；每个节点独占一条缓存行，等待者只在自己的节点上自旋
+#define MCS_NODES_PER_CPU	8
+
+struct mcs_node {
+	struct mcs_node *volatile next;
+	volatile uint32_t wait;
+} __attribute__((aligned(64)));
+
+static struct mcs_node mcs_nodes[NCPU][MCS_NODES_PER_CPU];
+static uint32_t mcs_used[NCPU];		// 每个 CPU 已分配节点的位图
 
 #ifdef DEBUG_SPINLOCK
+// 最终项目：细粒度锁
+// 每个 CPU 当前持有的带等级的锁，用于检查加锁顺序
+#define MAXHELD 16
+static struct spinlock *held_locks[NCPU][MAXHELD];
+static int nheld[NCPU];
+
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
 get_caller_pcs(uint32_t pcs[])
@@ -41,18 +53,243 @@ holding(struct spinlock *lock)
 {
 	return lock->locked && lock->cpu == thiscpu;
 }
+
+// 检查获取 lk 是否违反了 kern/spinlock.h 中规定的加锁顺序
+static void
+check_lock_order(struct spinlock *lk)
+{
+	struct spinlock *h;
+	int i, cpu = cpunum();
+
+	if (lk->rank == LOCK_RANK_NONE)
+		return;
+	for (i = 0; i < nheld[cpu]; i++) {
+		h = held_locks[cpu][i];
+		if (h->rank > lk->rank ||
+		    (h->rank == lk->rank && h->subrank >= lk->subrank))
+			panic("CPU %d: lock order violation: acquiring %s (%d.%d) while holding %s (%d.%d)",
+			      cpu, lk->name, lk->rank, lk->subrank,
+			      h->name, h->rank, h->subrank);
+	}
+}
+
+static void
+push_held(struct spinlock *lk)
+{
+	int cpu = cpunum();
+
+	if (lk->rank == LOCK_RANK_NONE)
+		return;
+	if (nheld[cpu] == MAXHELD)
+		panic("CPU %d: holding too many locks", cpu);
+	held_locks[cpu][nheld[cpu]++] = lk;
+}
+
+static void
+pop_held(struct spinlock *lk)
+{
+	int i, cpu = cpunum();
+
+	for (i = nheld[cpu] - 1; i >= 0; i--)
+		if (held_locks[cpu][i] == lk) {
+			held_locks[cpu][i] = held_locks[cpu][--nheld[cpu]];
+			return;
+		}
+}
 #endif
 
 void
-__spin_initlock(struct spinlock *lk, char *name)
+__spin_initlock(struct spinlock *lk, char *name, int type, int rank, int subrank)
 {
 	lk->locked = 0;
+	lk->type = type;
+	lk->ticket_next = lk->ticket_owner = 0;
+	lk->mcs_tail = lk->mcs_self = NULL;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
 	lk->cpu = 0;
+	lk->rank = rank;
+	lk->subrank = subrank;
 #endif
 }
 
+// 最终项目：排队自旋锁
+// 排号锁和 MCS 锁获取后同样置位 locked，供 holding() 和调试使用
+
+// 返回是否需要等待
+static bool
+ticket_lock(struct spinlock *lk)
+{
+	uint32_t me = xadd(&lk->ticket_next, 1);
+	bool contended = lk->ticket_owner != me;
+
+	while (lk->ticket_owner != me)
+		asm volatile ("pause");
+	lk->locked = 1;
+	return contended;
+}
+
+static void
+ticket_unlock(struct spinlock *lk)
+{
+	lk->locked = 0;
+	// 只有持有者会修改 ticket_owner，xadd 在这里起的是内存屏障的作用
+	xadd(&lk->ticket_owner, 1);
+}
+
+static bool
+mcs_lock(struct spinlock *lk)
+{
+	struct mcs_node *node, *pred;
+	int cpu = cpunum(), i;
+
+	for (i = 0; i < MCS_NODES_PER_CPU; i++)
+		if (!(mcs_used[cpu] & (1 << i)))
+			break;
+	if (i == MCS_NODES_PER_CPU)
+		panic("CPU %d: out of MCS lock nodes", cpu);
+	mcs_used[cpu] |= 1 << i;
+	node = &mcs_nodes[cpu][i];
+
+	node->next = NULL;
+	node->wait = 1;
+	pred = (struct mcs_node *) xchg((volatile uint32_t *) &lk->mcs_tail, (uint32_t) node);
+	if (pred) {
+		pred->next = node;
+		while (node->wait)
+			asm volatile ("pause");
+	}
+	lk->mcs_self = node;
+	lk->locked = 1;
+	return pred != NULL;
+}
+
+static void
+mcs_unlock(struct spinlock *lk)
+{
+	struct mcs_node *node = lk->mcs_self;
+	int cpu = cpunum();
+
+	lk->locked = 0;
+	if (!node->next) {
+		// 没有后继者时把队尾清空；失败说明有人正在排队，等它链接上来
+		if (cmpxchg((volatile uint32_t *) &lk->mcs_tail, (uint32_t) node, 0) == (uint32_t) node)
+			goto out;
+		while (!node->next)
+			asm volatile ("pause");
+	}
+	xchg(&node->next->wait, 0);
+out:
+	mcs_used[cpu] &= ~(1 << (node - mcs_nodes[cpu]));
+}
+
+#ifdef LOCK_PROFILE
+// 最终项目：锁争用统计
+// 每把锁的统计直接放在 struct spinlock 里，只在持有锁时更新；
+// 按调用点的统计放在每个 CPU 自己的表里，也不需要加锁。
+// 调用点用 spin_lock 的调用者及其调用者两层返回地址表示，
+// 这样 env_lock 之类的包装函数不会把所有调用点混在一起。
+
+#define LOCKPROF_SITES	64
+
+struct lock_site {
+	const char *name;		// 锁名，0 表示空项
+	uintptr_t pc[2];
+	uint32_t acquires, contended;
+	uint64_t spin, spin_max, hold;
+};
+
+static struct lock_site lock_sites[NCPU][LOCKPROF_SITES];
+static uint32_t lock_sites_dropped;		// 调用点表满而没有记录的次数
+static struct spinlock *volatile prof_locks;	// 获取过的锁的链表
+
+static const char *
+lockprof_name(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	if (lk->name)
+		return lk->name;
+#endif
+	return "?";
+}
+
+// 找到（或者新建）调用点对应的表项，表满时返回 -1
+static int
+lockprof_site(const char *name, uintptr_t pc0, uintptr_t pc1)
+{
+	struct lock_site *tab = lock_sites[cpunum()];
+	int i, n;
+
+	i = (pc0 ^ (pc1 >> 4) ^ (uintptr_t) name) % LOCKPROF_SITES;
+	for (n = 0; n < LOCKPROF_SITES; n++, i = (i + 1) % LOCKPROF_SITES) {
+		if (!tab[i].name) {
+			memset(&tab[i], 0, sizeof(tab[i]));
+			tab[i].name = name;
+			tab[i].pc[0] = pc0;
+			tab[i].pc[1] = pc1;
+			return i;
+		}
+		if (tab[i].name == name && tab[i].pc[0] == pc0 && tab[i].pc[1] == pc1)
+			return i;
+	}
+	lock_sites_dropped++;
+	return -1;
+}
+
+// 刚获得锁 lk 时调用；ebp 是 spin_lock 的栈帧
+static void
+lockprof_acquired(struct spinlock *lk, uint32_t ebp, uint64_t spin, bool contended)
+{
+	uint32_t *frame = (uint32_t *) ebp, *up;
+	uintptr_t pc0 = frame[1], pc1 = 0;
+	struct lock_site *site;
+	struct spinlock *head;
+
+	up = (uint32_t *) frame[0];
+	if (up && up >= (uint32_t *) ULIM)
+		pc1 = up[1];
+
+	if (!lk->prof_registered) {
+		lk->prof_registered = 1;
+		do {
+			head = prof_locks;
+			lk->prof_next = head;
+		} while (cmpxchg((volatile uint32_t *) &prof_locks,
+				 (uint32_t) head, (uint32_t) lk) != (uint32_t) head);
+	}
+
+	lk->prof_acquires++;
+	if (contended)
+		lk->prof_contended++;
+	lk->prof_spin += spin;
+	if (spin > lk->prof_spin_max)
+		lk->prof_spin_max = spin;
+
+	lk->prof_site = lockprof_site(lockprof_name(lk), pc0, pc1);
+	if (lk->prof_site >= 0) {
+		site = &lock_sites[cpunum()][lk->prof_site];
+		site->acquires++;
+		if (contended)
+			site->contended++;
+		site->spin += spin;
+		if (spin > site->spin_max)
+			site->spin_max = spin;
+	}
+	lk->prof_hold_start = read_tsc();
+}
+
+// 即将释放锁 lk 时调用（仍然持有）
+static void
+lockprof_release(struct spinlock *lk)
+{
+	uint64_t hold = read_tsc() - lk->prof_hold_start;
+
+	lk->prof_hold += hold;
+	if (lk->prof_site >= 0)
+		lock_sites[cpunum()][lk->prof_site].hold += hold;
+}
+#endif
+
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 // Holding a lock for a long time may cause
@@ -60,21 +297,43 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	bool contended = false;
+#ifdef LOCK_PROFILE
+	uint64_t t0 = read_tsc();
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+	check_lock_order(lk);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	switch (lk->type) {
+	case SPIN_TICKET:
+		contended = ticket_lock(lk);
+		break;
+	case SPIN_MCS:
+		contended = mcs_lock(lk);
+		break;
+	default:
+		// The xchg is atomic.
+		// It also serializes, so that reads after acquire are not
+		// reordered before it. 
+		while (xchg(&lk->locked, 1) != 0) {
+			contended = true;
+			asm volatile ("pause");
+		}
+	}
+
+#ifdef LOCK_PROFILE
+	lockprof_acquired(lk, read_ebp(), read_tsc() - t0, contended);
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
 	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
+	push_held(lk);
 #endif
 }
 
@@ -105,6 +364,11 @@ spin_unlock(struct spinlock *lk)
 
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
+	pop_held(lk);
+#endif
+
+#ifdef LOCK_PROFILE
+	lockprof_release(lk);
 #endif
 
 	// The xchg serializes, so that reads before release are 
@@ -116,5 +380,251 @@ spin_unlock(struct spinlock *lk)
 	// after a store. So lock->locked = 0 would work here.
 	// The xchg being asm volatile ensures gcc emits it after
 	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+	switch (lk->type) {
+	case SPIN_TICKET:
+		ticket_unlock(lk);
+		break;
+	case SPIN_MCS:
+		mcs_unlock(lk);
+		break;
+	default:
+		xchg(&lk->locked, 0);
+	}
 }
+
+#ifdef SPINLOCK_BENCH
+// 最终项目：排队自旋锁
+// 启动时的锁争用基准测试：对每种锁、每个参与的 CPU 数，让这些 CPU
+// 反复获取同一把锁，统计从开始获取到获得锁的周期数分布（按 2 的幂分桶）
+// 所有 CPU 都调用 spin_bench()，由 BSP 指挥，APs 跟随
+
+#define BENCH_ITERS	2000
+#define BENCH_BUCKETS	32
+
+static struct spinlock bench_lock;
+static volatile uint32_t bench_round;		// BSP 每开始一轮加 1
+static volatile uint32_t bench_done;		// 完成本轮的 CPU 数
+static volatile int bench_ncpu;		// 参与的 CPU 数，为 0 表示结束
+static uint32_t bench_hist[NCPU][BENCH_BUCKETS];
+static uint64_t bench_max[NCPU];
+static volatile uint32_t bench_counter;
+
+static const char *spin_type_name[NSPINTYPES] = { "tas", "ticket", "mcs" };
+
+static void
+bench_run(int cpu)
+{
+	uint64_t t0, t;
+	int i, b;
+
+	memset(bench_hist[cpu], 0, sizeof(bench_hist[cpu]));
+	bench_max[cpu] = 0;
+	for (i = 0; i < BENCH_ITERS; i++) {
+		t0 = read_tsc();
+		spin_lock(&bench_lock);
+		t = read_tsc() - t0;
+		// 很短的临界区
+		bench_counter++;
+		spin_unlock(&bench_lock);
+
+		for (b = 0; b < BENCH_BUCKETS - 1 && (t >> (b + 1)); b++)
+			;
+		bench_hist[cpu][b]++;
+		if (t > bench_max[cpu])
+			bench_max[cpu] = t;
+		// 锁外的一点工作，让其他 CPU 有机会拿到锁
+		for (b = 0; b < 50; b++)
+			asm volatile ("pause");
+	}
+}
+
+// 合并各 CPU 的直方图，返回百分位 pct 所在的桶的上界
+static uint32_t
+bench_percentile(int n, int pct)
+{
+	uint32_t total = 0, want = (uint32_t) n * BENCH_ITERS * pct / 100;
+	int b, c;
+
+	for (b = 0; b < BENCH_BUCKETS; b++) {
+		for (c = 0; c < n; c++)
+			total += bench_hist[c][b];
+		if (total >= want)
+			return 2u << b;
+	}
+	return ~0u;
+}
+
+void
+spin_bench(void)
+{
+	uint32_t round = 0;
+	uint64_t max;
+	int type, n, c, cpu = cpunum();
+
+	if (thiscpu != bootcpu) {
+		while (1) {
+			while (bench_round == round)
+				asm volatile ("pause");
+			round = bench_round;
+			if (!bench_ncpu)
+				return;
+			if (cpu < bench_ncpu)
+				bench_run(cpu);
+			xadd(&bench_done, 1);
+		}
+	}
+
+	cprintf("spinlock bench: %d iterations per CPU, cycles to acquire\n", BENCH_ITERS);
+	for (type = 0; type < NSPINTYPES; type++)
+		for (n = 1; n <= ncpu; n++) {
+			__spin_initlock(&bench_lock, "bench_lock", type, LOCK_RANK_NONE, 0);
+			bench_ncpu = n;
+			bench_done = 0;
+			xadd(&bench_round, 1);
+			if (cpu < n)
+				bench_run(cpu);
+			xadd(&bench_done, 1);
+			while (bench_done != ncpu)
+				asm volatile ("pause");
+
+			for (max = 0, c = 0; c < n; c++)
+				if (bench_max[c] > max)
+					max = bench_max[c];
+			cprintf("  %-6s %d cpus: p50 <%u p90 <%u p99 <%u max %u\n",
+				spin_type_name[type], n, bench_percentile(n, 50),
+				bench_percentile(n, 90), bench_percentile(n, 99),
+				(uint32_t) max);
+		}
+
+	bench_ncpu = 0;
+	xadd(&bench_round, 1);
+}
+#endif
+
+#ifdef LOCK_PROFILE
+// 最终项目：锁争用统计
+// 输出统计。同名的锁（例如所有 env_lock）合并为一行；
+// 调用点按总等待周期数列出前 LOCKSTAT_TOP 个，并解析成函数名和行号
+
+#define LOCKSTAT_CLASSES	16
+#define LOCKSTAT_TOP		10
+
+static void
+print_pc(uintptr_t pc)
+{
+	struct Eipdebuginfo info;
+
+	if (pc && debuginfo_eip(pc, &info) >= 0)
+		cprintf("%.*s+%x (%s:%d)", info.eip_fn_namelen, info.eip_fn_name,
+			pc - info.eip_fn_addr, info.eip_file, info.eip_line);
+	else
+		cprintf("%08x", pc);
+}
+
+void
+lockstat_print(void)
+{
+	struct {
+		const char *name;
+		uint32_t nlocks, acquires, contended;
+		uint64_t spin, spin_max, hold;
+	} cls[LOCKSTAT_CLASSES], *c;
+	struct lock_site *top[LOCKSTAT_TOP], *s, *t, sum;
+	struct spinlock *lk;
+	uint64_t best;
+	int ncls = 0, ntop, i, j, k, cpu, cpu2;
+
+	memset(cls, 0, sizeof(cls));
+	for (lk = prof_locks; lk; lk = lk->prof_next) {
+		for (i = 0; i < ncls; i++)
+			if (!strcmp(cls[i].name, lockprof_name(lk)))
+				break;
+		if (i == ncls) {
+			if (ncls == LOCKSTAT_CLASSES)
+				continue;
+			cls[ncls++].name = lockprof_name(lk);
+		}
+		c = &cls[i];
+		c->nlocks++;
+		c->acquires += lk->prof_acquires;
+		c->contended += lk->prof_contended;
+		c->spin += lk->prof_spin;
+		c->hold += lk->prof_hold;
+		if (lk->prof_spin_max > c->spin_max)
+			c->spin_max = lk->prof_spin_max;
+	}
+
+	cprintf("lock            locks  acquires  contended  spin(kcyc)  max spin  hold(kcyc)\n");
+	for (i = 0; i < ncls; i++)
+		cprintf("%-15s %-6u %-9u %-10u %-11u %-9u %u\n", cls[i].name,
+			cls[i].nlocks, cls[i].acquires, cls[i].contended,
+			(uint32_t) (cls[i].spin / 1000), (uint32_t) cls[i].spin_max,
+			(uint32_t) (cls[i].hold / 1000));
+
+	// 选出等待最多的调用点，各 CPU 上相同的调用点合并计算
+	for (ntop = 0; ntop < LOCKSTAT_TOP; ntop++) {
+		best = 0;
+		top[ntop] = NULL;
+		for (cpu = 0; cpu < ncpu; cpu++)
+			for (i = 0; i < LOCKPROF_SITES; i++) {
+				s = &lock_sites[cpu][i];
+				if (!s->name)
+					continue;
+				for (k = 0; k < ntop; k++)
+					if (top[k]->name == s->name && top[k]->pc[0] == s->pc[0] &&
+					    top[k]->pc[1] == s->pc[1])
+						break;
+				if (k < ntop)
+					continue;
+				if (s->spin >= best) {
+					best = s->spin;
+					top[ntop] = s;
+				}
+			}
+		if (!top[ntop])
+			break;
+	}
+
+	cprintf("top call sites by spin cycles:\n");
+	for (k = 0; k < ntop; k++) {
+		memset(&sum, 0, sizeof(sum));
+		for (cpu2 = 0; cpu2 < ncpu; cpu2++)
+			for (j = 0; j < LOCKPROF_SITES; j++) {
+				t = &lock_sites[cpu2][j];
+				if (t->name != top[k]->name || t->pc[0] != top[k]->pc[0] ||
+				    t->pc[1] != top[k]->pc[1])
+					continue;
+				sum.acquires += t->acquires;
+				sum.contended += t->contended;
+				sum.spin += t->spin;
+				sum.hold += t->hold;
+				if (t->spin_max > sum.spin_max)
+					sum.spin_max = t->spin_max;
+			}
+		cprintf("  %s: %u acquires, %u contended, spin %u kcyc (max %u), hold %u kcyc\n    ",
+			top[k]->name, sum.acquires, sum.contended,
+			(uint32_t) (sum.spin / 1000), (uint32_t) sum.spin_max,
+			(uint32_t) (sum.hold / 1000));
+		print_pc(top[k]->pc[0]);
+		cprintf(" <- ");
+		print_pc(top[k]->pc[1]);
+		cprintf("\n");
+	}
+	if (lock_sites_dropped)
+		cprintf("(%u acquisitions from untracked call sites)\n", lock_sites_dropped);
+}
+
+// 清零所有统计。其他 CPU 此时可能正在更新，个别计数会有误差
+void
+lockstat_reset(void)
+{
+	struct spinlock *lk;
+
+	for (lk = prof_locks; lk; lk = lk->prof_next) {
+		lk->prof_acquires = lk->prof_contended = 0;
+		lk->prof_spin = lk->prof_spin_max = lk->prof_hold = 0;
+	}
+	memset(lock_sites, 0, sizeof(lock_sites));
+	lock_sites_dropped = 0;
+}
+#endif
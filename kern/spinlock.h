@@ -6,9 +6,60 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// 最终项目：排队自旋锁
+// Uncomment this to run the lock contention benchmark at boot
+// #define SPINLOCK_BENCH
+
+// 最终项目：锁争用统计
+// Uncomment this to profile lock contention (see the lockstat monitor command)
+// #define LOCK_PROFILE
+
+// 最终项目：细粒度锁
+// 大内核锁被拆成下面几把锁。需要同时持有多把时必须按等级从小到大获取：
+//
+//   env_locks[]      每个进程的地址空间、IPC 接收状态和杂项字段；
+//                    同时锁两个进程时按下标从小到大
+//   env_table_lock   空闲进程链表、env_id 分配，以及进程状态保存区
+//   futex 桶的锁     各个 futex 等待队列（kern/futex.c），一次只持有一把
+//   sched_lock       所有进程的 env_status、调度字段和各 CPU 的 curenv
+//   page_lock        物理页分配器和 pp_ref
+//   cons_lock        控制台输入输出
+//
+// 定义了 DEBUG_SPINLOCK 时，spin_lock 会检查是否违反了这个顺序。
+enum {
+	LOCK_RANK_NONE = 0,	// 不参与顺序检查
+	LOCK_RANK_ENV,
+	LOCK_RANK_ENV_TABLE,
+	LOCK_RANK_FUTEX,
+	LOCK_RANK_SCHED,
+	LOCK_RANK_PAGE,
+	LOCK_RANK_CONS,
+};
+
+// 最终项目：排队自旋锁
+// 每把锁可以选择自己的实现：
+//   SPIN_TAS     原来的 xchg 测试并设置锁，不公平，等待者都在同一条缓存行上自旋
+//   SPIN_TICKET  排号锁，按到达顺序获取，但等待者仍然在同一条缓存行上自旋
+//   SPIN_MCS     MCS 队列锁，按到达顺序获取，每个等待者在自己的节点上自旋
+enum {
+	SPIN_TAS = 0,
+	SPIN_TICKET,
+	SPIN_MCS,
+	NSPINTYPES
+};
+
+struct mcs_node;
+
 // Mutual exclusion lock.
 struct spinlock {
 	unsigned locked;       // Is the lock held?
+	int type;              // SPIN_TAS, SPIN_TICKET or SPIN_MCS
+
+	// SPIN_TICKET: 下一个要发出的号和当前持有者的号
+	volatile uint32_t ticket_next, ticket_owner;
+	// SPIN_MCS: 队尾，以及持有者自己的节点（释放时使用）
+	struct mcs_node *volatile mcs_tail;
+	struct mcs_node *mcs_self;
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
@@ -16,33 +67,42 @@ struct spinlock {
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
+	int rank;              // Lock ordering rank (LOCK_RANK_*)
+	int subrank;           // Ordering among locks of the same rank
+#endif
+
+#ifdef LOCK_PROFILE
+	// 最终项目：锁争用统计，只在持有锁时更新
+	uint32_t prof_acquires;        // 获取次数
+	uint32_t prof_contended;       // 其中需要等待的次数
+	uint64_t prof_spin;            // 等待的总周期数
+	uint64_t prof_spin_max;        // 单次等待的最大周期数
+	uint64_t prof_hold;            // 持有的总周期数
+	uint64_t prof_hold_start;      // 本次获得锁的时刻
+	int prof_site;                 // 本次获取的调用点（持有者 CPU 的调用点表下标）
+	int prof_registered;           // 是否已加入 lockstat 的锁链表
+	struct spinlock *prof_next;
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+void __spin_initlock(struct spinlock *lk, char *name, int type, int rank, int subrank);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+#ifdef SPINLOCK_BENCH
+void spin_bench(void);
+#endif
+#ifdef LOCK_PROFILE
+void lockstat_print(void);
+void lockstat_reset(void);
+#endif
 
-#define spin_initlock(lock)   __spin_initlock(lock, #lock)
-
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
+#define spin_initlock(lock)   __spin_initlock(lock, #lock, SPIN_TAS, LOCK_RANK_NONE, 0)
 
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+// Static initializer for a named, ranked lock of the given type
+#ifdef DEBUG_SPINLOCK
+#define SPINLOCK_INIT(lkname, lktype, lkrank)	{ .type = lktype, .name = lkname, .rank = lkrank }
+#else
+#define SPINLOCK_INIT(lkname, lktype, lkrank)	{ .type = lktype }
+#endif
 
 #endif
@@ -11,6 +11,7 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/futex.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -33,11 +34,14 @@ sys_cputs(const char *s, size_t len)
 static int
 sys_set_pte_pafield(void *va, physaddr_t pa, int perm)
 {
-	pte_t *pte = pgdir_walk(curenv->env_pgdir, va, true);
-	if (!pte)
-		return -E_NO_MEM;
-	*pte = pa | perm;
-	return 0;
+	pte_t *pte;
+
+	env_lock(curenv);
+	pte = pgdir_walk(curenv->env_pgdir, va, true);
+	if (pte)
+		*pte = pa | perm;
+	env_unlock(curenv);
+	return pte ? 0 : -E_NO_MEM;
 }
 
 // Read a character from the system console without blocking.
@@ -76,6 +80,27 @@ sys_env_destroy(envid_t envid)
 static void
 sys_yield(void)
 {
+	// 最终项目：EDF 实时调度
+	// 实时进程调用 sys_yield 表示本周期的作业已经完成
+	spin_lock(&sched_lock);
+	if (curenv->env_rt_period)
+		curenv->env_rt_done = true;
+	spin_unlock(&sched_lock);
+	curenv->env_nvcsw++;
+	sched_yield();
+}
+
+// 最终项目：定向让出
+// 把当前时间片的剩余部分让给 envid，如果它可运行就直接在本 CPU 上
+// 运行它，不经过调度器的扫描；否则退化为 sys_yield
+static void
+sys_yield_to(envid_t envid)
+{
+	struct Env *e;
+
+	curenv->env_nvcsw++;
+	if (envid2env(envid, &e, false) == 0)
+		sched_yield_to(e);
 	sched_yield();
 }
 
@@ -101,9 +126,18 @@ sys_exofork(void)
 	if (error)
 		return error;
 
-	e->env_status = ENV_NOT_RUNNABLE;
+	// env_alloc 返回的进程已经是 ENV_NOT_RUNNABLE
 	e->env_tf = curenv->env_tf;
 	e->env_tf.tf_regs.reg_eax = 0;
+	// 最终项目：内核信息页：子进程从这里返回时 %edx 是自己的 envid
+	e->env_tf.tf_regs.reg_edx = e->env_id;
+	e->env_quantum = curenv->env_quantum;
+
+	// 最终项目：延迟 FPU 切换
+	if ((error = env_fpu_fork(e)) < 0) {
+		env_free(e);
+		return error;
+	}
 
 	return e->env_id;
 	// panic("sys_exofork not implemented");
@@ -137,7 +171,17 @@ sys_env_set_status(envid_t envid, int status)
 	if (error)
 		return error;
 
-	env->env_status = status;
+	if (status == ENV_RUNNABLE)
+		env_set_runnable(env);
+	else
+	{
+		// 最终项目：细粒度锁
+		// 已经被销毁的进程保持 ENV_DYING，由调度器回收
+		spin_lock(&sched_lock);
+		if (env->env_status != ENV_DYING && env->env_status != ENV_FREE)
+			env->env_status = status;
+		spin_unlock(&sched_lock);
+	}
 	return 0;
 	// panic("sys_env_set_status not implemented");
 }
@@ -159,18 +203,20 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	struct Env *env;
 	int error;
 
-	error = envid2env(envid, &env, true);
+	// user_mem_assert 可能销毁 curenv，必须在加锁之前检查
+	user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_U);
+
+	error = envid2env_lock(envid, &env, true);
 	if (error)
 		return error;
 
-	user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_U);
-
 	env->env_tf = *tf;
 	env->env_tf.tf_eflags = (env->env_tf.tf_eflags & ~FL_IOPL_3) | FL_IF;
 	env->env_tf.tf_ds = GD_UD | 3;
 	env->env_tf.tf_es = GD_UD | 3;
 	env->env_tf.tf_ss = GD_UD | 3;
 	env->env_tf.tf_cs = GD_UT | 3;
+	env_unlock(env);
 
 	return 0;
 	// panic("sys_env_set_trapframe not implemented");
@@ -192,11 +238,12 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	struct Env *env;
 	int error;
 
-	error = envid2env(envid, &env, true);
+	error = envid2env_lock(envid, &env, true);
 	if (error)
 		return error;
 
 	env->env_pgfault_upcall = func;
+	env_unlock(env);
 	return 0;
 	// panic("sys_env_set_pgfault_upcall not implemented");
 }
@@ -239,18 +286,24 @@ sys_page_alloc(envid_t envid, void *va, int perm, bool urgent)
 		(perm & ~PTE_SYSCALL) || (uint32_t) va >= UTOP || (uint32_t)(va) % PGSIZE != 0)
 		return -E_INVAL;
 
-	error = envid2env(envid, &env, true);
-	if (error)
-		return error;
-
-	if (!urgent && allocated_pages > npages * 0.1)
+	// 最终项目：延迟 FPU 切换：内核里不能有浮点运算
+	if (!urgent && allocated_pages > npages / 10)
 		return -E_NO_MEM;
 
+	// 在锁外分配并清零页面
 	p = page_alloc(ALLOC_ZERO);
 	if (!p)
 		return -E_NO_MEM;
 
+	error = envid2env_lock(envid, &env, true);
+	if (error)
+	{
+		page_free(p);
+		return error;
+	}
+
 	error = page_insert(env->env_pgdir, p, va, perm);
+	env_unlock(env);
 
 	if (error)
 	{
@@ -312,12 +365,17 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	if (error)
 		return error;
 
-	p = page_lookup(srcenv->env_pgdir, srcva, &pte);
-
-	if (!p || (perm & PTE_W && !(*pte & PTE_W)))
-		return -E_INVAL;
+	env_lock_pair(srcenv, dstenv);
+	if (!env_still_valid(srcenv, srcenvid) || !env_still_valid(dstenv, dstenvid))
+		error = -E_BAD_ENV;
+	else if (!(p = page_lookup(srcenv->env_pgdir, srcva, &pte)) ||
+		(perm & PTE_W && !(*pte & PTE_W)))
+		error = -E_INVAL;
+	else
+		error = page_insert(dstenv->env_pgdir, p, dstva, perm);
+	env_unlock_pair(srcenv, dstenv);
 
-	return page_insert(dstenv->env_pgdir, p, dstva, perm);
+	return error;
 	// panic("sys_page_map not implemented");
 }
 
@@ -342,15 +400,462 @@ sys_page_unmap(envid_t envid, void *va)
 	if ((uint32_t) va >= UTOP || (uint32_t)(va) % PGSIZE != 0)
 		return -E_INVAL;
 
-	error = envid2env(envid, &env, true);
+	error = envid2env_lock(envid, &env, true);
 	if (error)
 		return error;
 
 	page_remove(env->env_pgdir, va);
+	env_unlock(env);
 	return 0;
 	// panic("sys_page_unmap not implemented");
 }
 
+// 最终项目：按范围操作页面的系统调用
+// 下面的系统调用一次处理多个页面：先检查全部参数并建好所有页表，
+// 然后再修改映射，所以出错时什么都不会改变；TLB 最后一起失效
+
+// 系统调用允许的页面权限（见 sys_page_alloc）
+static bool
+page_perm_ok(int perm)
+{
+	return (perm & (PTE_U | PTE_P)) == (PTE_U | PTE_P) && !(perm & ~PTE_SYSCALL);
+}
+
+// [va, va + n * PGSIZE) 是否是 UTOP 以下按页对齐的范围，
+// 并且不超过 PAGE_RANGE_MAX 个页面
+static bool
+page_range_ok(uintptr_t va, size_t n)
+{
+	return va % PGSIZE == 0 && va < UTOP && n <= PAGE_RANGE_MAX &&
+		n <= (UTOP - va) / PGSIZE;
+}
+
+// 建好 [va, va + n * PGSIZE) 需要的所有页表
+static int
+page_range_walk(pde_t *pgdir, uintptr_t va, size_t n)
+{
+	uintptr_t end = va + n * PGSIZE;
+
+	for (; va < end; va = ROUNDDOWN(va, PTSIZE) + PTSIZE)
+		if (!pgdir_walk(pgdir, (void *) va, true))
+			return -E_NO_MEM;
+	return 0;
+}
+
+// 检查 envid 的 va 处映射了页面，而且 perm 要求可写时页面可写
+static struct PageInfo *
+page_range_src(struct Env *env, uintptr_t va, int perm)
+{
+	pte_t *pte = pgdir_walk(env->env_pgdir, (void *) va, false);
+
+	if (!pte || !(*pte & PTE_P) || (perm & PTE_W && !(*pte & PTE_W)))
+		return NULL;
+	return pa2page(PTE_ADDR(*pte));
+}
+
+// 在 envid 的 va 开始分配 n 个清零的页面，权限为 perm
+// 参数和错误同 sys_page_alloc
+static int
+sys_page_alloc_range(envid_t envid, uintptr_t va, size_t n, int perm, bool urgent)
+{
+	struct Env *env;
+	struct PageInfo *p, *list = NULL;
+	size_t i;
+	int error;
+
+	if (!page_perm_ok(perm) || !page_range_ok(va, n))
+		return -E_INVAL;
+	if (!urgent && allocated_pages + n > npages / 10)
+		return -E_NO_MEM;
+
+	// 在锁外分配并清零所有页面，用 pp_link 串起来
+	for (i = 0; i < n; i++)
+	{
+		if (!(p = page_alloc(ALLOC_ZERO)))
+		{
+			error = -E_NO_MEM;
+			goto free;
+		}
+		p->pp_link = list;
+		list = p;
+	}
+
+	error = envid2env_lock(envid, &env, true);
+	if (error)
+		goto free;
+
+	error = page_range_walk(env->env_pgdir, va, n);
+	if (!error)
+	{
+		for (i = 0; i < n; i++)
+		{
+			p = list;
+			list = p->pp_link;
+			p->pp_link = NULL;
+			page_insert_noflush(env->env_pgdir, p, (void *) (va + i * PGSIZE), perm);
+		}
+		tlb_invalidate_range(env->env_pgdir, (void *) va, n);
+	}
+	env_unlock(env);
+
+free:
+	while ((p = list))
+	{
+		list = p->pp_link;
+		p->pp_link = NULL;
+		page_free(p);
+	}
+	return error;
+}
+
+// 把 srcenvid 从 srcva 开始的 n 个页面映射到 dstenvid 的 dstva 开始，
+// 权限为 perm。参数和错误同 sys_page_map；另外同一个进程内
+// 源和目标范围重叠但起点不同时返回 -E_INVAL
+static int
+sys_page_map_range(envid_t srcenvid, uintptr_t srcva,
+		   envid_t dstenvid, uintptr_t dstva, size_t n, int perm)
+{
+	struct Env *srcenv, *dstenv;
+	size_t i;
+	int error;
+
+	if (!page_perm_ok(perm) || !page_range_ok(srcva, n) || !page_range_ok(dstva, n))
+		return -E_INVAL;
+
+	error = envid2env(srcenvid, &srcenv, true);
+	if (error)
+		return error;
+
+	error = envid2env(dstenvid, &dstenv, true);
+	if (error)
+		return error;
+
+	// 重叠的范围边读边改会读到刚改过的映射
+	if (srcenv == dstenv && srcva != dstva &&
+		srcva < dstva + n * PGSIZE && dstva < srcva + n * PGSIZE)
+		return -E_INVAL;
+
+	env_lock_pair(srcenv, dstenv);
+	if (!env_still_valid(srcenv, srcenvid) || !env_still_valid(dstenv, dstenvid))
+		error = -E_BAD_ENV;
+	else
+	{
+		for (i = 0; i < n; i++)
+			if (!page_range_src(srcenv, srcva + i * PGSIZE, perm))
+			{
+				error = -E_INVAL;
+				break;
+			}
+		if (!error)
+			error = page_range_walk(dstenv->env_pgdir, dstva, n);
+		if (!error)
+		{
+			for (i = 0; i < n; i++)
+				page_insert_noflush(dstenv->env_pgdir,
+					page_range_src(srcenv, srcva + i * PGSIZE, perm),
+					(void *) (dstva + i * PGSIZE), perm);
+			tlb_invalidate_range(dstenv->env_pgdir, (void *) dstva, n);
+		}
+	}
+	env_unlock_pair(srcenv, dstenv);
+
+	return error;
+}
+
+// 取消 envid 从 va 开始的 n 个页面的映射
+// 参数和错误同 sys_page_unmap
+static int
+sys_page_unmap_range(envid_t envid, uintptr_t va, size_t n)
+{
+	struct Env *env;
+	size_t i;
+	int error;
+
+	if (!page_range_ok(va, n))
+		return -E_INVAL;
+
+	error = envid2env_lock(envid, &env, true);
+	if (error)
+		return error;
+
+	for (i = 0; i < n; i++)
+		page_remove_noflush(env->env_pgdir, (void *) (va + i * PGSIZE));
+	tlb_invalidate_range(env->env_pgdir, (void *) va, n);
+	env_unlock(env);
+	return 0;
+}
+
+// 页面列表 list 中的每一项是按页对齐的地址，低 12 位是权限（像页表项一样）。
+// 先把列表复制到内核的 klist 里，之后只检查和使用这份副本：
+// 列表所在的内存可能被 sfork 出的兄弟进程在别的 CPU 上同时改写
+static int
+page_list_load(const uint32_t *list, size_t n, uint32_t *klist)
+{
+	int error;
+
+	if (n > PAGE_LIST_MAX)
+		return -E_INVAL;
+	error = user_mem_check(curenv, list, n * sizeof(uint32_t), PTE_U | PTE_P);
+	if (error < 0)
+		return error;
+	memcpy(klist, list, n * sizeof(uint32_t));
+	return 0;
+}
+
+// 把 srcenvid 中 list 列出的 n 个页面映射到 dstenvid 的相同地址，
+// 权限由每一项的低 12 位给出
+// 参数和错误同 sys_page_map
+static int
+sys_page_map_list(envid_t srcenvid, envid_t dstenvid, const uint32_t *ulist, size_t n)
+{
+	struct Env *srcenv, *dstenv;
+	uint32_t list[PAGE_LIST_MAX];
+	uintptr_t va;
+	size_t i;
+	int error;
+
+	if ((error = page_list_load(ulist, n, list)) < 0)
+		return error;
+
+	error = envid2env(srcenvid, &srcenv, true);
+	if (error)
+		return error;
+
+	error = envid2env(dstenvid, &dstenv, true);
+	if (error)
+		return error;
+
+	env_lock_pair(srcenv, dstenv);
+	if (!env_still_valid(srcenv, srcenvid) || !env_still_valid(dstenv, dstenvid))
+		error = -E_BAD_ENV;
+	else
+	{
+		for (i = 0; i < n && !error; i++)
+		{
+			va = PTE_ADDR(list[i]);
+			if (va >= UTOP || !page_perm_ok(PGOFF(list[i])) ||
+				!page_range_src(srcenv, va, PGOFF(list[i])))
+				error = -E_INVAL;
+			else
+				error = page_range_walk(dstenv->env_pgdir, va, 1);
+		}
+		if (!error)
+		{
+			for (i = 0; i < n; i++)
+				page_insert_noflush(dstenv->env_pgdir,
+					page_range_src(srcenv, PTE_ADDR(list[i]), PGOFF(list[i])),
+					(void *) PTE_ADDR(list[i]), PGOFF(list[i]));
+			if (n > TLB_FLUSH_PAGES)
+				tlb_flush(dstenv->env_pgdir);
+			else
+				for (i = 0; i < n; i++)
+					tlb_invalidate(dstenv->env_pgdir, (void *) PTE_ADDR(list[i]));
+		}
+	}
+	env_unlock_pair(srcenv, dstenv);
+
+	return error;
+}
+
+// 取消 envid 中 list 列出的 n 个页面的映射（忽略每一项的低 12 位）
+// 参数和错误同 sys_page_unmap
+static int
+sys_page_unmap_list(envid_t envid, const uint32_t *ulist, size_t n)
+{
+	struct Env *env;
+	uint32_t list[PAGE_LIST_MAX];
+	size_t i;
+	int error;
+
+	if ((error = page_list_load(ulist, n, list)) < 0)
+		return error;
+	for (i = 0; i < n; i++)
+		if (PTE_ADDR(list[i]) >= UTOP)
+			return -E_INVAL;
+
+	error = envid2env_lock(envid, &env, true);
+	if (error)
+		return error;
+
+	for (i = 0; i < n; i++)
+		page_remove_noflush(env->env_pgdir, (void *) PTE_ADDR(list[i]));
+	if (n > TLB_FLUSH_PAGES)
+		tlb_flush(env->env_pgdir);
+	else
+		for (i = 0; i < n; i++)
+			tlb_invalidate(env->env_pgdir, (void *) PTE_ADDR(list[i]));
+	env_unlock(env);
+	return 0;
+}
+
+// 最终项目：阻塞 IPC 发送
+// 当前进程进入等待状态。调用者持有自己的锁，唤醒方也要先拿到这把锁，
+// 所以放开锁之前改掉状态就不会错过唤醒
+static void
+ipc_sleep(void)
+{
+	spin_lock(&sched_lock);
+	if (curenv->env_status == ENV_RUNNING)
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	spin_unlock(&sched_lock);
+}
+
+// 已经放开所有锁之后让出 CPU。next 是刚刚收到消息、还没有被唤醒的进程，
+// 先尝试直接切换到它
+static void __attribute__((noreturn))
+ipc_block(struct Env *next)
+{
+	curenv->env_nvcsw++;
+	if (next)
+		sched_handoff(next);
+	sched_detach();
+	sched_yield();
+}
+
+// 最终项目：多页 IPC 消息
+// 把发送方给出的页面整理成段：srcva 和 perm 是一个页面，
+// perm 带 IPC_SEGV 时 srcva 指向 IPC_SEGV_COUNT(perm) 个 struct IpcSeg。
+// 检查对齐、权限和总页数，不检查页面是否存在（见 ipc_segs_mapped）
+static int
+ipc_load_segs(void *srcva, unsigned perm, struct IpcSeg *segs, uint32_t *nsegs)
+{
+	uint32_t i, total = 0;
+	int error;
+
+	if (perm & IPC_SEGV)
+	{
+		*nsegs = IPC_SEGV_COUNT(perm);
+		if (*nsegs > IPC_SEG_MAX)
+			return -E_INVAL;
+		error = user_mem_check(curenv, srcva, *nsegs * sizeof(struct IpcSeg), PTE_U | PTE_P);
+		if (error < 0)
+			return error;
+		memcpy(segs, srcva, *nsegs * sizeof(struct IpcSeg));
+	}
+	else if ((uint32_t)srcva < UTOP)
+	{
+		segs[0].seg_va = (uint32_t) srcva;
+		segs[0].seg_npages = 1;
+		segs[0].seg_perm = perm;
+		*nsegs = 1;
+	}
+	else
+		*nsegs = 0;
+
+	for (i = 0; i < *nsegs; i++)
+	{
+		if (!segs[i].seg_npages || !page_perm_ok(segs[i].seg_perm) ||
+			!page_range_ok(segs[i].seg_va, segs[i].seg_npages))
+			return -E_INVAL;
+		total += segs[i].seg_npages;
+		if (total > IPC_WINDOW_MAX)
+			return -E_INVAL;
+	}
+	return 0;
+}
+
+// 段里的每个页面都在 srcenv 中映射了，而且要求可写的段可写
+static bool
+ipc_segs_mapped(struct Env *srcenv, const struct IpcSeg *segs, uint32_t nsegs)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < nsegs; i++)
+		for (j = 0; j < segs[i].seg_npages; j++)
+			if (!page_range_src(srcenv, segs[i].seg_va + j * PGSIZE, segs[i].seg_perm))
+				return false;
+	return true;
+}
+
+// 接收方给出的窗口：dstva 的低 12 位是页数减一（见 IPC_WINDOW），
+// dstva 不低于 UTOP 表示不接收页面
+static int
+ipc_window(uint32_t dstva, void **va, uint32_t *npages)
+{
+	*va = (void *) ROUNDDOWN(dstva, PGSIZE);
+	*npages = 0;
+	if (dstva >= UTOP)
+		return 0;
+	*npages = PGOFF(dstva) + 1;
+	if (*npages > IPC_WINDOW_MAX || !page_range_ok((uintptr_t) *va, *npages))
+		return -E_INVAL;
+	return 0;
+}
+
+// 把所有段依次映射进接收方的窗口，返回映射的页数。
+// 先检查全部页面并建好页表，之后的映射不会失败：整条消息要么全部映射，
+// 要么什么都不改变；TLB 最后一起失效
+static int
+ipc_map_segs(struct Env *srcenv, struct Env *dstenv, const struct IpcSeg *segs, uint32_t nsegs)
+{
+	uintptr_t dva = (uintptr_t) dstenv->env_ipc_dstva;
+	uint32_t i, j, total = 0;
+	int error;
+
+	for (i = 0; i < nsegs; i++)
+		total += segs[i].seg_npages;
+	if (total > dstenv->env_ipc_dst_npages || !ipc_segs_mapped(srcenv, segs, nsegs))
+		return -E_INVAL;
+	if ((error = page_range_walk(dstenv->env_pgdir, dva, total)) < 0)
+		return error;
+
+	for (i = 0; i < nsegs; i++)
+		for (j = 0; j < segs[i].seg_npages; j++, dva += PGSIZE)
+			page_insert_noflush(dstenv->env_pgdir,
+				page_range_src(srcenv, segs[i].seg_va + j * PGSIZE, 0),
+				(void *) dva, segs[i].seg_perm);
+	tlb_invalidate_range(dstenv->env_pgdir, dstenv->env_ipc_dstva, total);
+	return total;
+}
+
+// 在双方都被锁住的情况下完成一次从 srcenv 到 dstenv 的发送。
+// 接收方从 sys_ipc_recv 返回 0，但仍由调用者负责唤醒它
+static int
+ipc_deliver(struct Env *srcenv, struct Env *dstenv, envid_t envid, uint32_t value,
+	    const struct IpcSeg *segs, uint32_t nsegs)
+{
+	int npages = 0;
+
+	if (!env_still_valid(dstenv, envid))
+		return -E_BAD_ENV;
+
+	if (!dstenv->env_ipc_recving)
+		return -E_IPC_NOT_RECV;
+
+	// 最终项目：调用/回复 IPC：在 sys_ipc_call 里等待回复的进程只接收被调用方的消息
+	if (dstenv->env_ipc_recv_from && dstenv->env_ipc_recv_from != srcenv->env_id)
+		return -E_IPC_NOT_RECV;
+
+	// 发送内存映射
+	if (nsegs && dstenv->env_ipc_dst_npages)
+	{
+		npages = ipc_map_segs(srcenv, dstenv, segs, nsegs);
+		if (npages < 0)
+			return npages;
+	}
+
+	dstenv->env_ipc_perm = npages ? segs[0].seg_perm : 0;
+	dstenv->env_ipc_npages = npages;
+	dstenv->env_ipc_from = srcenv->env_id;
+	dstenv->env_ipc_value = value;
+	dstenv->env_ipc_recving = false;
+
+	// 标记返回
+	dstenv->env_tf.tf_regs.reg_eax = 0;
+
+	return 0;
+}
+
+// 把消息记在发送方自己的 Env 里，排进 dstenv 的等待队列（调用者持有双方的锁）
+static void
+ipc_enqueue_msg(struct Env *dstenv, uint32_t value, const struct IpcSeg *segs, uint32_t nsegs)
+{
+	curenv->env_ipc_send_value = value;
+	memcpy(curenv->env_ipc_send_segs, segs, nsegs * sizeof(struct IpcSeg));
+	curenv->env_ipc_send_nsegs = nsegs;
+	env_ipc_enqueue(dstenv, curenv);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -389,55 +894,118 @@ sys_page_unmap(envid_t envid, void *va)
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+// 最终项目：多页 IPC 消息
+// perm 带 IPC_SEGV 时 srcva 是段向量，所有段依次映射进接收方的窗口；
+// 窗口放不下时返回 -E_INVAL
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 
 	struct Env *dstenv;
-	pte_t *pte;
-	struct PageInfo *p;
+	struct IpcSeg segs[IPC_SEG_MAX];
+	uint32_t nsegs;
 	int error;
 
+	if ((error = ipc_load_segs(srcva, perm, segs, &nsegs)) < 0)
+		return error;
 	error = envid2env(envid, &dstenv, false);
 	if (error)
 		return error;
 
-	if (!dstenv->env_ipc_recving)
-		return -E_IPC_NOT_RECV;
+	// 最终项目：细粒度锁
+	// 同时锁住双方：发送方的页表和接收方的 IPC 状态
+	env_lock_pair(curenv, dstenv);
+	error = ipc_deliver(curenv, dstenv, envid, value, segs, nsegs);
+	if (!error)
+		env_set_runnable(dstenv);
+	env_unlock_pair(curenv, dstenv);
 
-	if ((uint32_t)srcva < UTOP && (uint32_t)dstenv->env_ipc_dstva < UTOP)
-	{
-		// 发送内存映射
+	return error;
+	// panic("sys_ipc_try_send not implemented");
+}
 
-		if ((perm & PTE_U) != PTE_U || (perm & PTE_P) != PTE_P ||
-			(perm & ~PTE_SYSCALL) || (uint32_t)(srcva) % PGSIZE != 0)
-			return -E_INVAL;
+// 最终项目：阻塞 IPC 发送
+// 和 sys_ipc_try_send 一样发送，但接收方还没有进入 sys_ipc_recv 时
+// 不返回 -E_IPC_NOT_RECV，而是排进接收方的等待队列并阻塞，
+// 直到接收方取走消息（返回 0 或者页面映射的错误）或者被销毁（-E_BAD_ENV）。
+// 接收方正在等待时直接切换到它，发送方回到可运行状态。
+// 要发送的页面在排队之前就检查，但直到真正发送时才映射
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *dstenv;
+	struct IpcSeg segs[IPC_SEG_MAX];
+	uint32_t nsegs;
+	int error;
 
-		p = page_lookup(curenv->env_pgdir, srcva, &pte);
-
-		if (!p || (perm & PTE_W && !(*pte & PTE_W)))
-			return -E_INVAL;
-
-		error = page_insert(dstenv->env_pgdir, p, dstenv->env_ipc_dstva, perm);
-		if (error < 0)
-			return error;
+	if ((error = ipc_load_segs(srcva, perm, segs, &nsegs)) < 0)
+		return error;
+	error = envid2env(envid, &dstenv, false);
+	if (error)
+		return error;
+	// 发给自己会永远阻塞
+	if (dstenv == curenv)
+		return -E_INVAL;
 
-		dstenv->env_ipc_perm = perm;
+	env_lock_pair(curenv, dstenv);
+	error = ipc_deliver(curenv, dstenv, envid, value, segs, nsegs);
+	if (!error)
+	{
+		env_unlock_pair(curenv, dstenv);
+		// 先写好自己的返回值，sched_handoff 可能不再返回
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_handoff(dstenv);
+		return 0;
+	}
+	if (error == -E_IPC_NOT_RECV && !ipc_segs_mapped(curenv, segs, nsegs))
+		error = -E_INVAL;
+	if (error != -E_IPC_NOT_RECV)
+	{
+		env_unlock_pair(curenv, dstenv);
+		return error;
 	}
-	else
-		dstenv->env_ipc_perm = 0;
 
-	dstenv->env_ipc_from = curenv->env_id;
-	dstenv->env_ipc_value = value;
-	dstenv->env_ipc_recving = false;
+	ipc_enqueue_msg(dstenv, value, segs, nsegs);
+	ipc_sleep();
+	env_unlock_pair(curenv, dstenv);
+	ipc_block(NULL);
+}
 
-	// 标记返回
-	dstenv->env_tf.tf_regs.reg_eax = 0;
-	dstenv->env_status = ENV_RUNNABLE;
+// 最终项目：阻塞 IPC 发送
+// 接收方 curenv 已经锁住自己并设好了 env_ipc_dstva：取走等待队列里的
+// 第一条消息，成功时返回 true，接收方不用阻塞；页面映射失败的发送方
+// 带着错误返回，再试下一个。
+// 取队列时可能短暂放开 curenv 的锁，这期间 env_ipc_recving 保持为 false，
+// 直接发来的消息只会排进队列，不会和队列里的消息冲突
+static bool
+ipc_recv_queued(void)
+{
+	struct Env *s;
+	int error;
 
-	return 0;
-	// panic("sys_ipc_try_send not implemented");
+	curenv->env_ipc_recving = false;
+	while ((s = env_ipc_dequeue(curenv)))
+	{
+		error = -E_BAD_ENV;
+		curenv->env_ipc_recving = true;
+		if (env_still_valid(s, 0))
+			error = ipc_deliver(s, curenv, 0, s->env_ipc_send_value,
+				s->env_ipc_send_segs, s->env_ipc_send_nsegs);
+		curenv->env_ipc_recving = false;
+		// 最终项目：调用/回复 IPC
+		// sys_ipc_call 的请求送达以后，调用方继续阻塞，等待回复
+		if (error || !s->env_ipc_recving)
+		{
+			s->env_ipc_recving = false;
+			s->env_tf.tf_regs.reg_eax = error;
+			env_set_runnable(s);
+		}
+		env_unlock(s);
+		if (!error)
+			return true;
+	}
+	return false;
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -451,18 +1019,39 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+// 最终项目：多页 IPC 消息
+// dstva 的低 12 位是接收窗口的页数减一（见 IPC_WINDOW），窗口最多
+// IPC_WINDOW_MAX 页；收到的页数放在 env_ipc_npages
 static int
 sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
 	
-	if ((uint32_t)dstva < UTOP && (uint32_t)dstva % PGSIZE != 0)
+	void *va;
+	uint32_t npages;
+
+	if (ipc_window((uint32_t) dstva, &va, &npages) < 0)
 		return -E_INVAL;
 
-	curenv->env_ipc_dstva = dstva;
+	// 最终项目：细粒度锁
+	// 在自己的锁内同时进入接收状态并阻塞，发送方不会错过这次唤醒；
+	// 随后立即脱离这个 CPU，被唤醒时可以马上在别的 CPU 上运行
+	env_lock(curenv);
+	curenv->env_ipc_dstva = va;
+	curenv->env_ipc_dst_npages = npages;
+	curenv->env_ipc_recv_from = 0;
+
+	// 最终项目：阻塞 IPC 发送
+	// 已经有发送方在等待时直接取走它的消息，不阻塞
+	if (ipc_recv_queued())
+	{
+		env_unlock(curenv);
+		return 0;
+	}
 	curenv->env_ipc_recving = true;
-	curenv->env_status = ENV_NOT_RUNNABLE;
-	sched_yield();
+	ipc_sleep();
+	env_unlock(curenv);
+	ipc_block(NULL);
 
 	// panic("sys_ipc_recv not implemented");
 	
@@ -470,6 +1059,333 @@ sys_ipc_recv(void *dstva)
 	return 0;
 }
 
+// 最终项目：调用/回复 IPC
+// 客户端用一次陷入完成 RPC：向 envid 发送（同 sys_ipc_send），然后只等待
+// envid 的回复，回复映射在 dstva。进入接收状态和发送是原子的，
+// 服务端在别的 CPU 上马上回复也不会错过。
+// 服务端正在等待时直接切换过去，调用方阻塞；服务端没有准备好时
+// 请求排进它的等待队列，送达后调用方继续等待回复。
+// 和 sys_ipc_recv 一样通过 env_ipc_* 返回回复，返回 0；
+// 发送失败，或者服务端在回复之前被销毁时返回错误
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+	struct Env *dstenv;
+	struct IpcSeg segs[IPC_SEG_MAX];
+	uint32_t nsegs, npages;
+	void *va;
+	int error;
+
+	if (ipc_window((uint32_t) dstva, &va, &npages) < 0)
+		return -E_INVAL;
+	if ((error = ipc_load_segs(srcva, perm, segs, &nsegs)) < 0)
+		return error;
+	error = envid2env(envid, &dstenv, false);
+	if (error)
+		return error;
+	if (dstenv == curenv)
+		return -E_INVAL;
+
+	env_lock_pair(curenv, dstenv);
+	curenv->env_ipc_dstva = va;
+	curenv->env_ipc_dst_npages = npages;
+	curenv->env_ipc_recv_from = dstenv->env_id;
+	curenv->env_ipc_recving = true;
+	error = ipc_deliver(curenv, dstenv, envid, value, segs, nsegs);
+	if (error == -E_IPC_NOT_RECV && !ipc_segs_mapped(curenv, segs, nsegs))
+		error = -E_INVAL;
+	if (error && error != -E_IPC_NOT_RECV)
+	{
+		curenv->env_ipc_recving = false;
+		env_unlock_pair(curenv, dstenv);
+		return error;
+	}
+
+	if (error)
+		ipc_enqueue_msg(dstenv, value, segs, nsegs);
+	ipc_sleep();
+	env_unlock_pair(curenv, dstenv);
+	ipc_block(error ? NULL : dstenv);
+}
+
+// 最终项目：调用/回复 IPC
+// 服务端用一次陷入回复 envid 并等待下一个请求（接收同 sys_ipc_recv）。
+// 回复只发给正在 sys_ipc_call 里等待本进程的客户端，不会阻塞：
+// 客户端没有在等待时返回 -E_IPC_NOT_RECV（或其他发送错误），
+// 不进入接收状态，由调用者改用别的方式回复。
+// 回复送达以后，有请求在排队就直接取走它，否则阻塞并直接切换到客户端
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+	struct Env *client;
+	struct IpcSeg segs[IPC_SEG_MAX];
+	uint32_t nsegs, npages;
+	void *va;
+	int error;
+
+	if (ipc_window((uint32_t) dstva, &va, &npages) < 0)
+		return -E_INVAL;
+	if ((error = ipc_load_segs(srcva, perm, segs, &nsegs)) < 0)
+		return error;
+	error = envid2env(envid, &client, false);
+	if (error)
+		return error;
+	if (client == curenv)
+		return -E_INVAL;
+
+	env_lock_pair(curenv, client);
+	if (client->env_ipc_recv_from != curenv->env_id)
+		error = -E_IPC_NOT_RECV;
+	else
+		error = ipc_deliver(curenv, client, envid, value, segs, nsegs);
+	if (error)
+	{
+		env_unlock_pair(curenv, client);
+		return error;
+	}
+	// 客户端已经收到回复，只有这里会唤醒它，不用再锁住它
+	client->env_ipc_recv_from = 0;
+	env_unlock(client);
+
+	curenv->env_ipc_dstva = va;
+	curenv->env_ipc_dst_npages = npages;
+	curenv->env_ipc_recv_from = 0;
+	if (ipc_recv_queued())
+	{
+		env_unlock(curenv);
+		env_set_runnable(client);
+		return 0;
+	}
+	curenv->env_ipc_recving = true;
+	ipc_sleep();
+	env_unlock(curenv);
+	ipc_block(client);
+}
+
+// 最终项目：异步消息队列
+// 把消息交给正在 sys_msg_recv 里等待、已经被锁住的 dst：页面映射在它的窗口里，
+// 交出队列持有的引用。映射失败（没有内存建页表）时只丢掉页面，照样送达
+static void
+msg_deliver(struct Env *dst, envid_t from, uint32_t value, struct PageInfo *pp, int perm)
+{
+	dst->env_ipc_perm = 0;
+	dst->env_ipc_npages = 0;
+	if (pp)
+	{
+		if (dst->env_ipc_dst_npages &&
+			page_insert(dst->env_pgdir, pp, dst->env_ipc_dstva, perm) == 0)
+		{
+			dst->env_ipc_perm = perm;
+			dst->env_ipc_npages = 1;
+		}
+		page_decref(pp);
+	}
+	dst->env_ipc_from = from;
+	dst->env_ipc_value = value;
+	dst->env_msg_recving = false;
+	dst->env_msg_received++;
+	dst->env_tf.tf_regs.reg_eax = 0;
+}
+
+// 消息排到 dst 的队列末尾（调用者持有 dst 的锁，并且确认过队列没满）
+static void
+msg_push(struct Env *dst, envid_t from, uint32_t value, struct PageInfo *pp, int perm)
+{
+	struct MsgQueue *q = dst->env_msgq;
+	struct Msg *m = &q->mq_msgs[(q->mq_head + dst->env_msg_count) % MSGQ_DEPTH_MAX];
+
+	m->msg_from = from;
+	m->msg_value = value;
+	m->msg_page = pp;
+	m->msg_perm = perm;
+	if (++dst->env_msg_count > dst->env_msg_peak)
+		dst->env_msg_peak = dst->env_msg_count;
+}
+
+// 队列有空位以后，把等待空位的发送方的消息依次排进 curenv 的队列并唤醒它们。
+// 调用者不持有任何锁；从上次停下的下标开始找，轮流照顾各个发送方
+static void
+msg_refill(void)
+{
+	struct MsgQueue *q = curenv->env_msgq;
+	struct Env *s;
+	bool full = false;
+	uint32_t i;
+
+	for (i = 0; i < NENV && !full && curenv->env_msg_waiters; i++)
+	{
+		s = &envs[q->mq_scan];
+		q->mq_scan = (q->mq_scan + 1) % NENV;
+		if (s == curenv || s->env_msg_sendto != curenv->env_id)
+			continue;
+		env_lock_pair(curenv, s);
+		if (s->env_msg_sendto == curenv->env_id && env_still_valid(s, 0) &&
+			curenv->env_msg_count < curenv->env_msg_depth)
+		{
+			msg_push(curenv, s->env_id, s->env_msg_send_value,
+				s->env_msg_send_page, s->env_msg_send_perm);
+			curenv->env_msg_waiters--;
+			s->env_msg_sendto = 0;
+			s->env_msg_send_page = NULL;
+			s->env_tf.tf_regs.reg_eax = 0;
+			env_set_runnable(s);
+		}
+		full = curenv->env_msg_count >= curenv->env_msg_depth;
+		env_unlock_pair(curenv, s);
+	}
+}
+
+// 打开当前进程的消息队列，或者修改它的深度（1 到 MSGQ_DEPTH_MAX）。
+// 队列第一次打开时分配；深度改小时已经排队的消息不受影响，
+// 只是在消息数降到新深度以下之前，新的发送都会被当作队列满
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if depth is 0 or greater than MSGQ_DEPTH_MAX.
+//	-E_NO_MEM if there's no memory to allocate the queue.
+static int
+sys_msg_setup(uint32_t depth)
+{
+	struct PageInfo *p;
+
+	static_assert(sizeof(struct MsgQueue) <= PGSIZE);
+
+	if (depth == 0 || depth > MSGQ_DEPTH_MAX)
+		return -E_INVAL;
+
+	if (!curenv->env_msgq)
+	{
+		if (!(p = page_alloc(ALLOC_ZERO)))
+			return -E_NO_MEM;
+		page_incref(p);
+	}
+	else
+		p = NULL;
+
+	// 发送方只在持有 curenv 的锁时看 env_msgq 和深度
+	env_lock(curenv);
+	if (p)
+		curenv->env_msgq = page2kva(p);
+	curenv->env_msg_depth = depth;
+	env_unlock(curenv);
+	msg_refill();
+	return 0;
+}
+
+// 向 envid 的消息队列发送 value，srcva 低于 UTOP 时同时发送这个页面
+// （检查同 sys_ipc_try_send）。页面在排队时就被引用，之后发送方
+// 取消映射或者修改它都不影响接收方收到这个页面。
+// 接收方正在 sys_msg_recv 里等待时直接交给它；队列满时
+// flags 带 MSG_BLOCK 就阻塞到接收方腾出空位，否则返回 -E_MSGQ_FULL。
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or it is destroyed while we wait for room.
+//	-E_IPC_NOT_RECV if envid has not set up a message queue.
+//	-E_MSGQ_FULL if the queue is full and MSG_BLOCK is not set.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned or mapped,
+//		or perm is inappropriate (see sys_ipc_try_send).
+static int
+sys_msg_send(envid_t envid, uint32_t value, void *srcva, unsigned perm, uint32_t flags)
+{
+	struct Env *dstenv;
+	struct PageInfo *pp = NULL;
+	int error;
+
+	if ((uint32_t) srcva < UTOP && (!page_perm_ok(perm) || PGOFF(srcva)))
+		return -E_INVAL;
+	error = envid2env(envid, &dstenv, false);
+	if (error)
+		return error;
+
+	env_lock_pair(curenv, dstenv);
+	if (!env_still_valid(dstenv, envid))
+		error = -E_BAD_ENV;
+	else if (!dstenv->env_msgq)
+		error = -E_IPC_NOT_RECV;
+	else if ((uint32_t) srcva < UTOP && !(pp = page_range_src(curenv, (uintptr_t) srcva, perm)))
+		error = -E_INVAL;
+	if (error)
+	{
+		env_unlock_pair(curenv, dstenv);
+		return error;
+	}
+	if (pp)
+		page_incref(pp);
+	else
+		perm = 0;
+
+	if (dstenv->env_msg_recving)
+	{
+		msg_deliver(dstenv, curenv->env_id, value, pp, perm);
+		env_set_runnable(dstenv);
+	}
+	else if (dstenv->env_msg_count < dstenv->env_msg_depth)
+		msg_push(dstenv, curenv->env_id, value, pp, perm);
+	else if ((flags & MSG_BLOCK) && dstenv != curenv)
+	{
+		// 由接收方在 msg_refill 里取走消息，写好返回值并唤醒我们
+		curenv->env_msg_sendto = dstenv->env_id;
+		curenv->env_msg_send_value = value;
+		curenv->env_msg_send_page = pp;
+		curenv->env_msg_send_perm = perm;
+		dstenv->env_msg_waiters++;
+		dstenv->env_msg_full_waits++;
+		ipc_sleep();
+		env_unlock_pair(curenv, dstenv);
+		ipc_block(NULL);
+	}
+	else
+	{
+		dstenv->env_msg_overflows++;
+		error = -E_MSGQ_FULL;
+	}
+	env_unlock_pair(curenv, dstenv);
+
+	if (error && pp)
+		page_decref(pp);
+	return error;
+}
+
+// 从当前进程的消息队列取出最早的一条消息，队列为空时阻塞。
+// dstva 同 sys_ipc_recv（只映射一页），消息通过 env_ipc_value、
+// env_ipc_from 和 env_ipc_perm 返回。
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if dstva is invalid (see sys_ipc_recv),
+//		or the current environment has no message queue.
+static int
+sys_msg_recv(void *dstva)
+{
+	struct MsgQueue *q = curenv->env_msgq;
+	struct Msg m;
+	bool waiters;
+	void *va;
+	uint32_t npages;
+
+	if (ipc_window((uint32_t) dstva, &va, &npages) < 0 || !q)
+		return -E_INVAL;
+
+	env_lock(curenv);
+	curenv->env_ipc_dstva = va;
+	curenv->env_ipc_dst_npages = npages;
+	if (curenv->env_msg_count)
+	{
+		m = q->mq_msgs[q->mq_head];
+		q->mq_head = (q->mq_head + 1) % MSGQ_DEPTH_MAX;
+		curenv->env_msg_count--;
+		msg_deliver(curenv, m.msg_from, m.msg_value, m.msg_page, m.msg_perm);
+		waiters = curenv->env_msg_waiters;
+		env_unlock(curenv);
+		if (waiters)
+			msg_refill();
+		return 0;
+	}
+	curenv->env_msg_recving = true;
+	ipc_sleep();
+	env_unlock(curenv);
+	ipc_block(NULL);
+}
+
 // Lab 4 挑战 4：实现进程的时空穿越
 
 static struct Env saved_env;
@@ -481,6 +1397,13 @@ static pte_t *saved_pgtab[NPDENTRIES];
 // 注意整个系统中只有一个存储空间
 // 如果有进程调用过，那么在没有使用这个状态恢复原本进程之前
 // 不能再次分配
+//
+// 最终项目：可抢占的内核操作
+// 复制页面时的抢占点不放开 env 锁和 env_table_lock：放开期间进程可能
+// 改动地址空间，另一次保存/恢复也可能改写唯一的存储空间，快照就不一致了。
+// 持锁打开中断窗口是安全的：窗口里的中断（见 trap_in_window）只计数时钟、
+// 处理控制台，不获取这两把锁；积压的时钟直到系统调用返回、锁都放开以后
+// 才交给调度器。代价只是其他 CPU 等这两把锁的时间，和没有抢占点时相同
 static int
 sys_capture_state(envid_t envid)
 {
@@ -491,6 +1414,13 @@ sys_capture_state(envid_t envid)
 	uint32_t temp, va, offset, pgcount = 0;
 	int error;
 
+	// 最终项目：细粒度锁
+	// 保存区只有一份，由 env_table_lock 保护
+	error = envid2env_lock(envid, &env, true);
+	if (error)
+		return error;
+	spin_lock(&env_table_lock);
+
 	if (saved_pages[0])
 	{
 		if (envs[ENVX(saved_env.env_id)].env_status == ENV_DYING || envs[ENVX(saved_env.env_id)].env_status == ENV_FREE)
@@ -523,13 +1453,12 @@ sys_capture_state(envid_t envid)
 			pgcount = 0;
 		}
 		else
-			return -E_NO_MEM;
+		{
+			error = -E_NO_MEM;
+			goto out;
+		}
 	}
 
-	error = envid2env(envid, &env, true);
-	if (error)
-		return error;
-
 	saved_env = *env;
 
 	pgdir = env->env_pgdir;
@@ -558,13 +1487,19 @@ sys_capture_state(envid_t envid)
 					saved_pages[pgcount] = page_alloc(0);
 					memcpy(page2kva(saved_pages[pgcount]), KADDR(PTE_ADDR(*pte)), PGSIZE);
 					pgcount++;
+					// 最终项目：可抢占的内核操作
+					// 持锁打开中断窗口，见 sys_capture_state 前的说明
+					preempt_point();
 				}
 			}
 		}
 		va += PTSIZE;
 	}
 
-	return 0;
+out:
+	spin_unlock(&env_table_lock);
+	env_unlock(env);
+	return error;
 }
 
 // 恢复进程状态的系统调用
@@ -578,15 +1513,22 @@ sys_restore_state(envid_t envid)
 	uint32_t temp, va, offset, pgcount = 0;
 	int error;
 
-	if (!saved_pages[0])
-		return -E_INVAL;
-
-	error = envid2env(envid, &env, true);
+	error = envid2env_lock(envid, &env, true);
 	if (error)
 		return error;
+	spin_lock(&env_table_lock);
+
+	if (!saved_pages[0])
+	{
+		error = -E_INVAL;
+		goto out;
+	}
 
 	if (env->env_id != saved_env.env_id)
-		return -E_BAD_ENV;
+	{
+		error = -E_BAD_ENV;
+		goto out;
+	}
 
 	*env = saved_env;
 
@@ -615,6 +1557,8 @@ sys_restore_state(envid_t envid)
 					memcpy(KADDR(PTE_ADDR(*pte)), page2kva(saved_pages[pgcount]), PGSIZE);
 					page_free(saved_pages[pgcount]);
 					pgcount++;
+					// 同样持锁，见 sys_capture_state 前的说明
+					preempt_point();
 				}
 			}
 		}
@@ -623,7 +1567,10 @@ sys_restore_state(envid_t envid)
 
 	saved_pages[0] = NULL;
 
-	return 0;
+out:
+	spin_unlock(&env_table_lock);
+	env_unlock(env);
+	return error;
 }
 
 // Lab 4 挑战 5：允许用户处理更多异常
@@ -634,44 +1581,221 @@ sys_env_set_other_exception_upcall(envid_t envid, void *func)
 	struct Env *env;
 	int error;
 
-	error = envid2env(envid, &env, true);
+	error = envid2env_lock(envid, &env, true);
 	if (error)
 		return error;
 
 	env->env_other_exception_upcall = func;
+	env_unlock(env);
 	return 0;
 }
 
-// Lab 4 挑战 7：批量系统调用
-// 处理一批系统调用
-// 返回负值时中止
-// 注意第一个参数最后一项应该是 0xFFFFFFFF 用于表示结束
+// 最终项目：调度器时间片
+// 设置进程的时间片长度（微秒），按计时器中断周期取整并限制在
+// [ENV_QUANTUM_MIN, ENV_QUANTUM_MAX] 之内；us 为 0 时只做查询
+// 返回实际生效的时间片长度
+static int
+sys_env_set_quantum(envid_t envid, uint32_t us)
+{
+	struct Env *env;
+	int error;
+
+	error = envid2env_lock(envid, &env, true);
+	if (error)
+		return error;
+
+	if (us)
+	{
+		if (us < ENV_QUANTUM_MIN)
+			us = ENV_QUANTUM_MIN;
+		if (us > ENV_QUANTUM_MAX)
+			us = ENV_QUANTUM_MAX;
+		us = ROUNDUP(us, SCHED_TICK_US);
+		env->env_quantum = us;
+		// 缩短时间片时立即生效
+		if (env->env_slice_left > us / SCHED_TICK_US)
+			env->env_slice_left = us / SCHED_TICK_US;
+	}
+	us = env->env_quantum;
+	env_unlock(env);
+
+	return us;
+}
+
+// 最终项目：EDF 实时调度
+// 把进程设为周期 period_us、每周期预算 budget_us 的实时进程；
+// period_us 为 0 时退回普通进程
+// 如果加入后实时进程总利用率超过 SCHED_RT_UTIL_MAX，返回 -E_NO_CAPACITY
+static int
+sys_env_set_rt(envid_t envid, uint32_t period_us, uint32_t budget_us)
+{
+	struct Env *env;
+	int error;
+
+	error = envid2env(envid, &env, true);
+	if (error)
+		return error;
+
+	return sched_set_rt(env, period_us, budget_us);
+}
+
+static int32_t syscall_restart(void);
+
+// 最终项目：共享内存系统调用环
+// 把 va 处的页面注册为当前进程的系统调用环（见 inc/syscall.h），
+// 替换掉以前注册的环。内核另外持有页面的一个引用，
+// 所以进程之后取消映射这个页面也没有关系
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va >= UTOP, or va is not page-aligned,
+//		or va is not mapped user-writable.
+static int
+sys_ring_setup(void *va)
+{
+	struct PageInfo *p;
+	pte_t *pte;
+	void *old;
+	int error = 0;
+
+	if ((uint32_t) va >= UTOP || (uint32_t) va % PGSIZE != 0)
+		return -E_INVAL;
+
+	env_lock(curenv);
+	if (!(p = page_lookup(curenv->env_pgdir, va, &pte)) ||
+		(*pte & (PTE_U | PTE_W)) != (PTE_U | PTE_W))
+		error = -E_INVAL;
+	else
+	{
+		page_incref(p);
+		old = curenv->env_ring;
+		curenv->env_ring = page2kva(p);
+		curenv->env_ring_cancel = false;
+		if (old)
+			page_decref(pa2page(PADDR(old)));
+	}
+	env_unlock(curenv);
+
+	return error;
+}
+
+// 最终项目：共享内存系统调用环
+// 按顺序执行提交队列里最多 n_submit 项，把结果依次写进完成队列
+// 完成队列满了就提前停下。每一项都在这里同步完成，
+// 所以 min_complete 只用来检查参数
+// 会阻塞、让出 CPU 或者改写 curenv->env_tf 的系统调用不能放进环里，
+// 它们的完成项是 -E_INVAL
+//
+// Returns the number of entries consumed, < 0 on error.  Errors are:
+//	-E_INVAL if no ring is registered,
+//		or min_complete is larger than the completion queue.
 static int
-sys_run_batch_syscall(uint32_t *syscallno, uint32_t **arguarray)
+sys_enter_ring(uint32_t n_submit, uint32_t min_complete)
 {
-	int i, err;
+	struct SyscallRing *ring = curenv->env_ring;
+	struct SyscallSqe sqe;
+	struct SyscallCqe *cqe;
+	uint32_t head, done = 0;
+	int32_t ret;
 
-	if (user_mem_check(curenv, syscallno, 4, PTE_U | PTE_P) ||
-		user_mem_check(curenv, arguarray, 20, PTE_U | PTE_P) ||
-		user_mem_check(curenv, arguarray[0], 4, PTE_U | PTE_P) ||
-		user_mem_check(curenv, arguarray[1], 4, PTE_U | PTE_P) ||
-		user_mem_check(curenv, arguarray[2], 4, PTE_U | PTE_P) ||
-		user_mem_check(curenv, arguarray[3], 4, PTE_U | PTE_P) ||
-		user_mem_check(curenv, arguarray[4], 4, PTE_U | PTE_P))
+	if (!ring || min_complete > SRING_CQ_ENTRIES)
 		return -E_INVAL;
 
-	for (i = 0; i < 64 && syscallno[i] != 0xFFFFFFFF; i++)
+	for (head = ring->sq_head;
+		done < n_submit && head != ring->sq_tail &&
+		ring->cq_tail - ring->cq_head < SRING_CQ_ENTRIES;
+		head++, done++)
 	{
-		err = syscall(syscallno[i], arguarray[0][i], arguarray[1][i], arguarray[2][i], arguarray[3][i], arguarray[4][i]);
-		if (err < 0)
-			return err;
+		// 先复制一份，执行期间用户改写提交项也不影响这里
+		sqe = ring->sq[head % SRING_SQ_ENTRIES];
+
+		if (curenv->env_ring_cancel)
+			ret = -E_CANCELED;
+		else if (sqe.sqe_num == SYS_enter_ring || !syscall_fast(sqe.sqe_num))
+			ret = -E_INVAL;
+		else
+			ret = syscall(sqe.sqe_num, sqe.sqe_args[0], sqe.sqe_args[1],
+				sqe.sqe_args[2], sqe.sqe_args[3], sqe.sqe_args[4]);
+		curenv->env_ring_cancel = (sqe.sqe_flags & SQE_LINK) &&
+			(ret < 0 || curenv->env_ring_cancel);
+
+		cqe = &ring->cq[ring->cq_tail % SRING_CQ_ENTRIES];
+		cqe->cqe_data = sqe.sqe_data;
+		cqe->cqe_result = ret;
+		ring->cq_tail++;
+		ring->sq_head = head + 1;
+
+		// 进程把自己销毁了，后面的提交项不再执行
+		if (curenv->env_status != ENV_RUNNING)
+			return done + 1;
+
+		// 最终项目：可抢占的内核操作
+		// 时间片可能已经用完：让进程带着剩下的数目重新进入，
+		// 以便调度器先处理计时器中断。进度记录在环里
+		if (done + 1 < n_submit && preempt_point() && percpu(cpu_syscall_tf))
+		{
+			percpu(cpu_syscall_tf)->tf_regs.reg_edx = n_submit - done - 1;
+			return syscall_restart();
+		}
+	}
+	return done;
+}
+
+// 最终项目：可抢占的内核操作
+// 让进程从陷入返回后重新执行 int $T_SYSCALL。返回值会被写回 %eax，
+// 所以返回原来的系统调用号
+static int32_t
+syscall_restart(void)
+{
+	struct Trapframe *tf = percpu(cpu_syscall_tf);
+
+	// 最终项目：sysenter 快速系统调用
+	// 重新执行 sysenter 时 %esi 必须是返回地址（见 lib/syscall.c）
+	if (tf->tf_err == SYSENTER_TF_ERR)
+		tf->tf_regs.reg_esi = tf->tf_eip;
+	tf->tf_eip -= 2;	// int $0x30 和 sysenter 的长度
+	return tf->tf_regs.reg_eax;
+}
+
+// 最终项目：sysenter 快速系统调用
+// 不会阻塞或者让出 CPU、也不读写 curenv->env_tf 的系统调用，
+// 从 sysenter 进入时可以不构造陷入帧直接 sysexit 返回
+// （改变了当前进程状态的情况由 sysenter_syscall 在返回前检查）
+bool
+syscall_fast(uint32_t syscallno)
+{
+	switch (syscallno)
+	{
+	case SYS_cputs:
+	case SYS_cgetc:
+	case SYS_getenvid:
+	case SYS_env_destroy:
+	case SYS_page_alloc:
+	case SYS_page_map:
+	case SYS_page_unmap:
+	case SYS_page_alloc_range:
+	case SYS_page_map_range:
+	case SYS_page_unmap_range:
+	case SYS_page_map_list:
+	case SYS_page_unmap_list:
+	case SYS_sysstat_ctl:
+	case SYS_msg_setup:
+	case SYS_futex_wake:
+	case SYS_env_set_status:
+	case SYS_env_set_pgfault_upcall:
+	case SYS_ipc_try_send:
+	case SYS_env_set_quantum:
+	case SYS_env_set_rt:
+	case 130: // SYS_env_set_other_exception_upcall
+	case 233:
+		return true;
+	default:
+		return false;
 	}
-	return 0;
 }
 
 // Dispatches to the correct kernel function, passing the arguments.
-int32_t
-syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+static int32_t
+syscall_dispatch(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	// Call the function corresponding to the 'syscallno' parameter.
 	// Return any appropriate return value.
@@ -712,16 +1836,145 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return sys_ipc_try_send(a1, a2, (void *)a3, a4);
 	case SYS_ipc_recv:
 		return sys_ipc_recv((void *)a1);
+	case SYS_ipc_send:
+		return sys_ipc_send(a1, a2, (void *)a3, a4);
+	case SYS_ipc_call:
+		return sys_ipc_call(a1, a2, (void *)a3, a4, (void *)a5);
+	case SYS_ipc_reply_wait:
+		return sys_ipc_reply_wait(a1, a2, (void *)a3, a4, (void *)a5);
+	case SYS_msg_setup:
+		return sys_msg_setup(a1);
+	case SYS_msg_send:
+		return sys_msg_send(a1, a2, (void *)a3, a4, a5);
+	case SYS_msg_recv:
+		return sys_msg_recv((void *)a1);
+	case SYS_futex_wait:
+		return futex_wait((uint32_t *)a1, a2, a3);
+	case SYS_futex_wake:
+		return futex_wake((uint32_t *)a1, a2);
+	case SYS_env_set_quantum:
+		return sys_env_set_quantum(a1, a2);
+	case SYS_yield_to:
+		sys_yield_to(a1);
+		return 0;
+	case SYS_env_set_rt:
+		return sys_env_set_rt(a1, a2, a3);
 	case 128: // SYS_capture_state
 		return sys_capture_state(a1);
 	case 129: // SYS_restore_state
 		return sys_restore_state(a1);
 	case 130: // SYS_env_set_other_exception_upcall
 		return sys_env_set_other_exception_upcall(a1, (void *)a2);
-	case 131: // SYS_run_batch_syscall
-		return sys_run_batch_syscall((uint32_t *)a1, (uint32_t **)a2);
+	case SYS_ring_setup:
+		return sys_ring_setup((void *)a1);
+	case SYS_enter_ring:
+		return sys_enter_ring(a1, a2);
+	case SYS_page_alloc_range:
+		return sys_page_alloc_range(a1, a2, a3, a4, a5);
+	case SYS_page_map_range:
+		return sys_page_map_range(a1, a2, a3, PTE_ADDR(a4), a5, PGOFF(a4));
+	case SYS_page_unmap_range:
+		return sys_page_unmap_range(a1, a2, a3);
+	case SYS_page_map_list:
+		return sys_page_map_list(a1, a2, (const uint32_t *)a3, a4);
+	case SYS_page_unmap_list:
+		return sys_page_unmap_list(a1, (const uint32_t *)a2, a3);
+	case SYS_sysstat_ctl:
+		return sysstat_control(a1);
+	default:
+		return -E_INVAL;
+	}
+}
+
+// 最终项目：系统调用统计
+// 打开时记录每次调用的次数和耗时。系统调用不会在别的 CPU 上返回
+// （会阻塞的调用都是重新执行而不是在内核里睡眠），所以不用加锁
+static bool sysstat_enabled;
+
+static int32_t __attribute__((noinline))
+syscall_profiled(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct SysstatCpu *ss = &sysstat->ss_cpu[cpunum()];
+	int slot = sysstat_slot(syscallno), b;
+	uint64_t t;
+	int32_t ret;
+
+	// 不返回的调用（sys_yield、sys_ipc_recv 等）只计数
+	ss->ss_count[slot]++;
+#ifdef SYSSTAT_PER_ENV
+	curenv->env_syscalls[slot]++;
+#endif
+	t = read_tsc();
+	ret = syscall_dispatch(syscallno, a1, a2, a3, a4, a5);
+	t = read_tsc() - t;
+
+	for (b = 0; b < SYSSTAT_BUCKETS - 1 && (t >> (b + 1)); b++)
+		;
+	ss->ss_cycles[slot] += t;
+	ss->ss_hist[slot][b]++;
+	return ret;
+}
+
+int32_t
+syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	// 关闭时只有这一次判断
+	if (__builtin_expect(!sysstat_enabled, 1))
+		return syscall_dispatch(syscallno, a1, a2, a3, a4, a5);
+	return syscall_profiled(syscallno, a1, a2, a3, a4, a5);
+}
+
+// 打开、关闭或者清空统计（SYSSTAT_ON 等）
+int
+sysstat_control(int op)
+{
+#ifdef SYSSTAT_PER_ENV
+	struct Env *e;
+#endif
+
+	switch (op)
+	{
+	case SYSSTAT_OFF:
+	case SYSSTAT_ON:
+		sysstat_enabled = (op == SYSSTAT_ON);
+		sysstat->ss_enabled = sysstat_enabled;
+		return 0;
+	case SYSSTAT_RESET:
+		memset(sysstat->ss_cpu, 0, sizeof(sysstat->ss_cpu));
+#ifdef SYSSTAT_PER_ENV
+		for (e = envs; e < envs + NENV; e++)
+			memset(e->env_syscalls, 0, sizeof(e->env_syscalls));
+#endif
+		return 0;
 	default:
 		return -E_INVAL;
 	}
 }
 
+// 合并所有 CPU 的统计，按槽输出次数、平均周期数和中位数/p99 所在桶的上界
+void
+sysstat_print(void)
+{
+	uint32_t count, hist[SYSSTAT_BUCKETS];
+	uint64_t cycles;
+	int slot, cpu, b;
+
+	cprintf("syscall statistics are %s\n", sysstat_enabled ? "on" : "off");
+	cprintf("%-24s %10s %10s %10s %10s\n", "syscall", "count", "avg", "p50<=", "p99<=");
+	for (slot = 0; slot < SYSSTAT_NSLOTS; slot++) {
+		count = 0;
+		cycles = 0;
+		memset(hist, 0, sizeof(hist));
+		for (cpu = 0; cpu < ncpu; cpu++) {
+			count += sysstat->ss_cpu[cpu].ss_count[slot];
+			cycles += sysstat->ss_cpu[cpu].ss_cycles[slot];
+			for (b = 0; b < SYSSTAT_BUCKETS; b++)
+				hist[b] += sysstat->ss_cpu[cpu].ss_hist[slot][b];
+		}
+		if (!count)
+			continue;
+		cprintf("%-24s %10u %10u %10u %10u\n", sysstat_name(slot), count,
+			(uint32_t) (cycles / count), sysstat_percentile(hist, 50),
+			sysstat_percentile(hist, 99));
+	}
+}
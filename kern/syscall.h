@@ -7,5 +7,10 @@
 #include <inc/syscall.h>
 
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+bool syscall_fast(uint32_t num);
+
+// 最终项目：系统调用统计
+int sysstat_control(int op);
+void sysstat_print(void);
 
 #endif /* !JOS_KERN_SYSCALL_H */
@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/string.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -69,6 +70,10 @@ static const char *trapname(int trapno)
 
 typedef void (*handler)(void);
 extern handler _handler_array[];
+extern void _syscall_handler(void);
+
+void trap(struct Trapframe *tf) __attribute__((noreturn));
+static void trap_exit(void) __attribute__((noreturn));
 
 void
 trap_init(void)
@@ -76,19 +81,14 @@ trap_init(void)
 	int i;
 	uint32_t cpuid_edx, a1, a2;
 	extern struct Segdesc gdt[];
-	extern handler _syscall_handler;
 
+	// 最终项目：sysenter 快速系统调用
+	// 用户库用同样的条件决定是否使用 sysenter（见 lib/syscall.c）
 	cpuid(1, NULL, NULL, NULL, &cpuid_edx);
-	msr_supported = (cpuid_edx >> CPUID_EDX_MSR_BIT) & 1;
-
+	msr_supported = ((cpuid_edx >> CPUID_EDX_MSR_BIT) & 1) &&
+		((cpuid_edx >> CPUID_EDX_SEP_BIT) & 1);
 	if (msr_supported)
-	{
-		// 下面那个取地址是为了对抗 GCC 很奇怪的行为（如果不加会把参数当成地址而不是立即数）
-		wrmsr(MSR_IA32_SYSENTER_CS, GD_KT, 0);
-		wrmsr(MSR_IA32_SYSENTER_ESP, &ts.ts_esp0, 0);
-		wrmsr(MSR_IA32_SYSENTER_EIP, &_syscall_handler, 0);
 		cprintf("\033[1;31;45mMSR is supported - ready to support sysenter\033[0m\n");
-	}
 
 	// LAB 3: Your code here.
 	for (i = 0; i < 256; i++)
@@ -130,7 +130,13 @@ trap_init_percpu(void)
 
 	// Setup a TSS so that we get the right stack
 	// when we trap to the kernel.
-	thists->ts_esp0 = KSTACKTOP - thiscpu->cpu_id * (KSTKGAP + KSTKSIZE);
+	// 最终项目：陷入时不再复制 Trapframe
+	// 从用户态陷入时 CPU 直接把陷入帧压进 curenv->env_tf（env_run 把
+	// ts_esp0 指向那里），_alltraps 再切换到这个 CPU 的内核栈
+	static_assert(offsetof(struct CpuInfo, cpu_kstacktop) == 4);
+	static_assert(offsetof(struct Trapframe, tf_cs) == 52);
+	thiscpu->cpu_kstacktop = KSTACKTOP - thiscpu->cpu_id * (KSTKGAP + KSTKSIZE);
+	thists->ts_esp0 = thiscpu->cpu_kstacktop;
 	thists->ts_ss0 = GD_KD;
 
 	// Initialize the TSS slot of the gdt.
@@ -138,6 +144,18 @@ trap_init_percpu(void)
 					sizeof(struct Taskstate) - 1, 0);
 	gdt[(GD_TSS0 >> 3) + thiscpu->cpu_id].sd_s = 0;
 
+	// 最终项目：sysenter 快速系统调用
+	// sysenter 直接切换到这个 CPU 自己的内核栈
+	if (msr_supported)
+	{
+		wrmsr(MSR_IA32_SYSENTER_CS, GD_KT, 0);
+		wrmsr(MSR_IA32_SYSENTER_ESP, thiscpu->cpu_kstacktop, 0);
+		wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) _syscall_handler, 0);
+	}
+
+	// 最终项目：延迟 FPU 切换
+	env_fpu_init_percpu();
+
 	// Load the TSS selector (like other segment selectors, the
 	// bottom three bits are special; we leave them 0)
 
@@ -193,6 +211,135 @@ print_regs(struct PushRegs *regs)
 	cprintf("  eax  0x%08x\n", regs->reg_eax);
 }
 
+// 最终项目：可抢占的内核操作
+// 内核里的长操作（见 preempt_point）会短暂地打开中断。在这个窗口里
+// 到来的中断不能像平常一样调度，因为被打断的内核代码还要继续运行在
+// 这个内核栈上：计时器中断只记下来，留到陷入返回前再交给 sched_tick
+
+// 回到被中断窗口打断的内核代码
+static void __attribute__((noreturn))
+trap_return_kernel(struct Trapframe *tf)
+{
+	__asm __volatile("movl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+		"\tiret"
+		: : "g" (tf) : "memory");
+	panic("iret failed");
+}
+
+static void __attribute__((noreturn))
+trap_in_window(struct Trapframe *tf)
+{
+	switch (tf->tf_trapno) {
+	case IRQ_OFFSET + IRQ_TIMER:
+		lapic_eoi();
+		percpu(cpu_ticks_pending)++;
+		break;
+	case IRQ_OFFSET + IRQ_RESCHED:
+		// 这个 CPU 没有停机，什么也不用做
+		lapic_eoi();
+		break;
+	case IRQ_OFFSET + IRQ_KBD:
+		kbd_intr();
+		break;
+	case IRQ_OFFSET + IRQ_SERIAL:
+		serial_intr();
+		break;
+	case IRQ_OFFSET + IRQ_SPURIOUS:
+		break;
+	default:
+		print_trapframe(tf);
+		panic("unexpected trap in a preemption window");
+	}
+	trap_return_kernel(tf);
+}
+
+// 距离上次打开中断窗口是否已经足够久
+bool
+preempt_due(void)
+{
+	return read_tsc() - percpu(cpu_preempt_mark) >=
+		(uint64_t) PREEMPT_INTERVAL_US * tsc_per_us;
+}
+
+// 抢占点：长时间运行的内核操作在循环中调用。到时间时短暂地打开中断，
+// 让积压的中断得到处理。调用者不能持有 cons_lock（键盘和串口中断要用），
+// 其他锁可以持有：窗口里的中断处理不获取它们，只是其他 CPU 要多等一会儿。
+// 返回当前进程的时间片是否可能已经用完，能够保存进度并稍后继续的
+// 操作（例如批量系统调用）可以据此提前返回
+bool
+preempt_point(void)
+{
+	if (preempt_due()) {
+		irqoff_end();
+		percpu(cpu_in_window) = true;
+		asm volatile("sti; nop; cli" ::: "memory");
+		percpu(cpu_in_window) = false;
+		percpu(cpu_preempt_mark) = read_tsc();
+		irqoff_begin();
+	}
+	return percpu(cpu_ticks_pending) != 0;
+}
+
+#ifdef IRQOFF_PROFILE
+// 最终项目：可抢占的内核操作
+// 关中断时长的直方图：第 b 个桶统计 [2^b, 2^(b+1)) 微秒（第 0 个桶包括 1 微秒以下）
+
+#define IRQOFF_BUCKETS	20
+
+static uint32_t irqoff_hist[NCPU][IRQOFF_BUCKETS];
+static uint64_t irqoff_max[NCPU];
+
+// 中断刚被关闭（进入内核）
+void
+irqoff_begin(void)
+{
+	percpu(cpu_irqoff_start) = read_tsc();
+}
+
+// 即将打开中断（返回用户态、停机或者打开中断窗口）
+void
+irqoff_end(void)
+{
+	uint64_t t = read_tsc() - percpu(cpu_irqoff_start);
+	uint32_t us = tsc_per_us ? t / tsc_per_us : 0;
+	int b, cpu = cpunum();
+
+	for (b = 0; b < IRQOFF_BUCKETS - 1 && (us >> (b + 1)); b++)
+		;
+	irqoff_hist[cpu][b]++;
+	if (t > irqoff_max[cpu])
+		irqoff_max[cpu] = t;
+}
+
+void
+irqoff_print(void)
+{
+	uint32_t n;
+	int b, cpu;
+
+	for (cpu = 0; cpu < ncpu; cpu++)
+		cprintf("CPU %d: max %u us with interrupts off\n", cpu,
+			(uint32_t) (irqoff_max[cpu] / tsc_per_us));
+	for (b = 0; b < IRQOFF_BUCKETS; b++) {
+		for (n = 0, cpu = 0; cpu < ncpu; cpu++)
+			n += irqoff_hist[cpu][b];
+		if (n)
+			cprintf("  %6u - %6u us: %u\n", b ? 1 << b : 0, 2 << b, n);
+	}
+}
+
+void
+irqoff_reset(void)
+{
+	memset(irqoff_hist, 0, sizeof(irqoff_hist));
+	memset(irqoff_max, 0, sizeof(irqoff_max));
+}
+#endif
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
@@ -206,15 +353,32 @@ trap_dispatch(struct Trapframe *tf)
 		if (!(tf->tf_eflags & FL_TF))
 			break;
 	case T_BRKPT:
-		return monitor(tf);
+		monitor(tf);
+		// 在监视器里停留的时间不算关中断延迟
+		irqoff_begin();
+		return;
+	case T_DEVICE:
+		// 最终项目：延迟 FPU 切换
+		if ((tf->tf_cs & 3) == 3) {
+			if (env_fpu_trap() < 0) {
+				cprintf("[%08x] no memory for FPU state\n", curenv->env_id);
+				env_destroy(curenv);
+			}
+			return;
+		}
+		break;
 	case T_SYSCALL:
-		return (void) (tf->tf_regs.reg_eax = syscall(
+		// 最终项目：可抢占的内核操作：记下陷入帧，系统调用可以要求重新执行
+		percpu(cpu_syscall_tf) = tf;
+		tf->tf_regs.reg_eax = syscall(
 			tf->tf_regs.reg_eax,
 			tf->tf_regs.reg_edx,
 			tf->tf_regs.reg_ecx,
 			tf->tf_regs.reg_ebx,
 			tf->tf_regs.reg_edi,
-			tf->tf_regs.reg_esi));
+			tf->tf_regs.reg_esi);
+		percpu(cpu_syscall_tf) = NULL;
+		return;
 	}
 
 	// Lab 4 挑战 5：允许用户处理更多异常
@@ -236,7 +400,17 @@ trap_dispatch(struct Trapframe *tf)
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER)
 	{
 		lapic_eoi();
-		return sched_yield();
+		return sched_tick();
+	}
+
+	// 最终项目：唤醒空闲 CPU
+	// 停机中的 CPU（没有 curenv）收到后重新调度，正在运行进程的 CPU 直接返回
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED)
+	{
+		lapic_eoi();
+		if (!curenv)
+			sched_yield();
+		return;
 	}
 
 	// Handle keyboard and serial interrupts.
@@ -270,10 +444,15 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acquire the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// 最终项目：可抢占的内核操作
+	// 在中断窗口里打断了内核自己，处理完直接回到被打断的地方
+	if ((tf->tf_cs & 3) == 0 && percpu(cpu_in_window))
+		trap_in_window(tf);
+
+	// Mark that we are no longer halted in sched_yield()
+	// 最终项目：细粒度锁：不再需要重新获取大内核锁
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
+	irqoff_begin();
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -281,11 +460,10 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-		lock_kernel();
+		// 最终项目：细粒度锁
+		// 内核各部分自己加锁，这里不再获取大内核锁
 		assert(curenv);
+		env_charge_user();
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
@@ -294,12 +472,10 @@ trap(struct Trapframe *tf)
 			sched_yield();
 		}
 
-		// Copy trap frame (which is currently on the stack)
-		// into 'curenv->env_tf', so that running the environment
-		// will restart at the trap point.
-		curenv->env_tf = *tf;
-		// The trapframe on the stack should be ignored from here on.
-		tf = &curenv->env_tf;
+		// 最终项目：陷入时不再复制 Trapframe
+		// 陷入帧已经在 curenv->env_tf 里了（见 _alltraps 和 env_run），
+		// running the environment will restart at the trap point.
+		assert(tf == &curenv->env_tf);
 	}
 
 	// Record that tf is the last real trapframe so
@@ -309,6 +485,23 @@ trap(struct Trapframe *tf)
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
+	trap_exit();
+}
+
+// 陷阱处理完毕，回到当前进程或者重新调度
+static void
+trap_exit(void)
+{
+	// 最终项目：可抢占的内核操作
+	// 补上在中断窗口里推迟处理的计时器中断
+	if (percpu(cpu_ticks_pending)) {
+		uint32_t n = percpu(cpu_ticks_pending);
+
+		percpu(cpu_ticks_pending) = 0;
+		while (n--)
+			sched_tick();
+	}
+
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
@@ -318,6 +511,84 @@ trap(struct Trapframe *tf)
 		sched_yield();
 }
 
+// 最终项目：sysenter 快速系统调用
+// sysenter 不保存任何用户态状态，_syscall_handler（kern/trapentry.S）
+// 把寄存器压成下面的样子再调用 sysenter_syscall。不会引起调度的系统调用
+// 直接在这里执行，然后用 sysexit 返回，完全不构造 Trapframe；
+// 其余的系统调用补出一个与 int $T_SYSCALL 等价的陷入帧，交给 trap()
+struct SysenterFrame {
+	uint32_t sf_eax;	// 系统调用号
+	uint32_t sf_edx;	// 参数 1～4
+	uint32_t sf_ecx;
+	uint32_t sf_ebx;
+	uint32_t sf_edi;
+	uint32_t sf_a5;		// 参数 5，在用户栈顶，由 sysenter_syscall 读取
+	uint32_t sf_eflags;	// 用户的 EFLAGS，在用户栈上，由 sysenter_syscall 读取
+	uint32_t sf_esp;	// 用户 %esp（用户库放在 %ebp 里传进来）
+	uint32_t sf_eip;	// 返回地址（用户库放在 %esi 里传进来）
+};
+
+// 用户栈上的 EFLAGS 只能提供用户态自己就能改的标志位
+#define SYSENTER_USER_FLAGS	(FL_CF | FL_PF | FL_AF | FL_ZF | FL_SF | \
+				 FL_TF | FL_DF | FL_OF | FL_AC)
+
+// 补出陷入帧。IOPL 不能来自用户栈，沿用进程原来的（文件系统进程是 3）
+static void
+sysenter_trapframe(struct Trapframe *tf, const struct SysenterFrame *sf)
+{
+	uint32_t iopl = tf->tf_eflags & FL_IOPL_MASK;
+
+	memset(tf, 0, sizeof(*tf));
+	tf->tf_regs.reg_eax = sf->sf_eax;
+	tf->tf_regs.reg_edx = sf->sf_edx;
+	tf->tf_regs.reg_ecx = sf->sf_ecx;
+	tf->tf_regs.reg_ebx = sf->sf_ebx;
+	tf->tf_regs.reg_edi = sf->sf_edi;
+	tf->tf_regs.reg_esi = sf->sf_a5;
+	tf->tf_regs.reg_ebp = sf->sf_esp;
+	tf->tf_es = tf->tf_ds = tf->tf_ss = GD_UD | 3;
+	tf->tf_cs = GD_UT | 3;
+	tf->tf_trapno = T_SYSCALL;
+	tf->tf_err = SYSENTER_TF_ERR;
+	tf->tf_eip = sf->sf_eip;
+	tf->tf_esp = sf->sf_esp;
+	tf->tf_eflags = (sf->sf_eflags & SYSENTER_USER_FLAGS) | iopl | FL_IF;
+}
+
+int32_t
+sysenter_syscall(struct SysenterFrame *sf)
+{
+	int32_t ret;
+
+	irqoff_begin();
+	env_charge_user();
+
+	user_mem_assert(curenv, (void *) sf->sf_esp, 12, PTE_U);
+	sf->sf_a5 = ((uint32_t *) sf->sf_esp)[0];
+	sf->sf_eflags = ((uint32_t *) sf->sf_esp)[2];
+
+	if (!syscall_fast(sf->sf_eax) || curenv->env_status != ENV_RUNNING) {
+		sysenter_trapframe(&curenv->env_tf, sf);
+		trap(&curenv->env_tf);
+	}
+
+	ret = syscall(sf->sf_eax, sf->sf_edx, sf->sf_ecx, sf->sf_ebx,
+		      sf->sf_edi, sf->sf_a5);
+
+	// 系统调用期间有推迟的计时器中断，或者进程不能继续运行了：
+	// 补一个陷入帧，走普通的陷阱返回路径
+	if (percpu(cpu_ticks_pending) || curenv->env_status != ENV_RUNNING) {
+		sysenter_trapframe(&curenv->env_tf, sf);
+		curenv->env_tf.tf_regs.reg_eax = ret;
+		trap_exit();
+	}
+
+	env_charge_system();
+	env_quiescent();
+	irqoff_end();
+	return ret;
+}
+
 void
 other_exception_handler(struct Trapframe *tf)
 {
@@ -367,6 +638,53 @@ other_exception_handler(struct Trapframe *tf)
 	return;
 }
 
+#ifdef KERNEL_COW
+// 最终项目：内核处理写时复制
+// 对 PTE_COW 页面的写错误直接在内核里解决，省去用户态处理函数和
+// 它的三次系统调用。只有自己还映射着的页面改成可写即可，否则复制一份。
+// 处理不了（不是写时复制错误，或者内存不足）时返回 false，交给用户态
+static bool
+page_fault_cow(uint32_t fault_va, uint32_t err)
+{
+	struct Env *e = curenv;
+	struct PageInfo *pp, *np;
+	void *va = ROUNDDOWN((void *) fault_va, PGSIZE);
+	pte_t *pte;
+	int perm;
+	bool done = false;
+
+	if ((err & (FEC_PR | FEC_WR)) != (FEC_PR | FEC_WR) || fault_va >= UTOP)
+		return false;
+
+	env_lock(e);
+	pte = pgdir_walk(e->env_pgdir, va, false);
+	if (!pte || (*pte & (PTE_P | PTE_U | PTE_COW)) != (PTE_P | PTE_U | PTE_COW))
+		goto out;
+
+	pp = pa2page(PTE_ADDR(*pte));
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+
+	// 持有 e 的锁时别人不能再把这个页面映射出去，
+	// 所以 pp_ref == 1 说明其他进程都已经不再共享它了
+	if (pp->pp_ref == 1) {
+		*pte = PTE_ADDR(*pte) | perm;
+		tlb_invalidate(e->env_pgdir, va);
+		done = true;
+		goto out;
+	}
+
+	if (!(np = page_alloc(0)))
+		goto out;
+	memcpy(page2kva(np), page2kva(pp), PGSIZE);
+	// 页表已经存在，page_insert 不会失败；它同时释放对原页面的引用
+	done = page_insert(e->env_pgdir, np, va, perm) == 0;
+
+out:
+	env_unlock(e);
+	return done;
+}
+#endif
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
@@ -388,6 +706,12 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+#ifdef KERNEL_COW
+	// 最终项目：内核处理写时复制
+	if (page_fault_cow(fault_va, tf->tf_err))
+		return;
+#endif
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
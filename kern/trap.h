@@ -9,6 +9,23 @@
 #include <inc/trap.h>
 #include <inc/mmu.h>
 
+// 最终项目：可抢占的内核操作
+// Uncomment this to keep a histogram of how long interrupts stay disabled
+// (see the irqoff monitor command)
+// #define IRQOFF_PROFILE
+
+// 长时间运行的内核操作每隔这么久打开一次中断窗口
+#define PREEMPT_INTERVAL_US	50
+
+// 最终项目：内核处理写时复制
+// 注释掉以后写时复制的页错误交回用户态处理（lib/libmain.c），可以用来对比开销
+#define KERNEL_COW
+
+// 最终项目：sysenter 快速系统调用
+// 从 sysenter 进入、需要完整陷入帧的系统调用在 tf_err 里带上这个标记
+// （int $T_SYSCALL 的 tf_err 总是 0）
+#define SYSENTER_TF_ERR		1
+
 /* The kernel's interrupt descriptor table */
 extern struct Gatedesc idt[];
 extern struct Pseudodesc idt_pd;
@@ -23,4 +40,18 @@ void page_fault_handler(struct Trapframe *);
 void other_exception_handler(struct Trapframe *);
 void backtrace(struct Trapframe *);
 
+// 最终项目：可抢占的内核操作
+bool preempt_due(void);
+bool preempt_point(void);
+
+#ifdef IRQOFF_PROFILE
+void irqoff_begin(void);
+void irqoff_end(void);
+void irqoff_print(void);
+void irqoff_reset(void);
+#else
+#define irqoff_begin()	do { } while (0)
+#define irqoff_end()	do { } while (0)
+#endif
+
 #endif /* JOS_KERN_TRAP_H */
@@ -0,0 +1,42 @@
+// 最终项目：IPC 基准测试
+// 基准测试程序共用的计时和输出。每个结果单独一行，格式固定，
+// 方便 bench-ipc 脚本收集：
+//
+//   BENCH <程序> <项目> <数值> <单位> ncpu=<CPU 数>
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// 开始计时，返回当前的 TSC
+uint64_t
+bench_start(void)
+{
+	return read_tsc();
+}
+
+// 从 bench_start 返回的 start 到现在经过的纳秒数（至少为 1）
+uint64_t
+bench_elapsed_ns(uint64_t start)
+{
+	return MAX(bench_cycles_ns(read_tsc() - start), 1);
+}
+
+// TSC 周期数换算成纳秒
+uint64_t
+bench_cycles_ns(uint64_t cycles)
+{
+	return cycles * 1000 / kinfo.ki_tsc_per_us;
+}
+
+// ns 纳秒内完成 n 次，每秒的次数
+uint64_t
+bench_rate(uint64_t n, uint64_t ns)
+{
+	return n * 1000000000ULL / MAX(ns, 1);
+}
+
+void
+bench_result(const char *prog, const char *item, uint64_t value, const char *unit)
+{
+	cprintf("BENCH %s %s %llu %s ncpu=%u\n", prog, item, value, unit, kinfo_ncpu());
+}
@@ -4,8 +4,6 @@
 
 // Maximum number of file descriptors a program may hold open concurrently
 #define MAXFD		32
-// Bottom of file descriptor area
-#define FDTABLE		0xD0000000
 // Bottom of file data area.  We reserve one data page for each FD,
 // which devices can use if they choose.
 #define FILEDATA	(FDTABLE + MAXFD*PGSIZE)
@@ -6,6 +6,21 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// 最终项目：多页 IPC 消息
+// FSREQ_READ_MAP 的回复映射在 FSIPC_WINDOW（紧挨在文件描述符区下面）；
+// FSREQ_WRITE_MAP 的数据不是按页对齐时先复制到 FSIPC_STAGE（第一次使用时分配）
+#define FSIPC_WINDOW	((char *) (FDTABLE - FSIPC_MAXPAGES * PGSIZE))
+#define FSIPC_STAGE	(FSIPC_WINDOW - FSIPC_MAXPAGES * PGSIZE)
+
+static envid_t
+fs_envid(void)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+	return fsenv;
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,17 +30,30 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	// 最终项目：调用/回复 IPC：发送请求和等待回复只陷入内核一次
+	return ipc_call(fs_envid(), type, &fsipcbuf, PTE_P | PTE_W | PTE_U, dstva, NULL);
+}
+
+// 最终项目：多页 IPC 消息
+// 同 fsipc，请求页之后再带上从 data 开始的 npages 个页面
+static int
+fsipc_data(unsigned type, const void *data, size_t npages)
+{
+	struct IpcSeg segs[2] = {
+		{ (uint32_t) &fsipcbuf, 1, PTE_P | PTE_W | PTE_U },
+		{ (uint32_t) data, npages, PTE_P | PTE_U },
+	};
+
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x + %d pages\n", thisenv->env_id, type,
+			*(uint32_t *)&fsipcbuf, npages);
+
+	return ipc_call(fs_envid(), type, segs, IPC_SEGV | 2, NULL, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -116,6 +144,23 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
 	int r;
+	off_t offset = fd->fd_offset;
+
+	// 最终项目：多页 IPC 消息
+	// 超过一页的读由文件系统服务把块缓存的页面直接映射过来，
+	// 它那一侧不用复制，一次最多 FSIPC_MAXPAGES 页
+	if (n > PGSIZE)
+	{
+		fsipcbuf.read.req_fileid = fd->fd_file.id;
+		fsipcbuf.read.req_n = n;
+		r = fsipc(FSREQ_READ_MAP, IPC_WINDOW(FSIPC_WINDOW, FSIPC_MAXPAGES));
+		if (r <= 0)
+			return r;
+		assert(r <= n);
+		// 窗口里除了最后一块都是服务端块缓存的别名，马上复制出来
+		memmove(buf, FSIPC_WINDOW + offset % BLKSIZE, r);
+		return r;
+	}
 
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
@@ -128,6 +173,42 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 }
 
 
+// 最终项目：多页 IPC 消息
+// FSREQ_WRITE_MAP：最多写 FSIPC_MAXPAGES 页，返回值同 devfile_write
+static ssize_t
+devfile_write_map(struct Fd *fd, const void *buf, size_t n)
+{
+	static bool staged;
+	size_t npages, i;
+	int r;
+
+	n = MIN(n, FSIPC_MAXPAGES * PGSIZE);
+	npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+
+	for (i = 0; (uint32_t) buf % PGSIZE == 0 && i < npages; i++)
+		if (!(uvpd[PDX(buf + i * PGSIZE)] & PTE_P) ||
+		    !(uvpt[PGNUM(buf + i * PGSIZE)] & PTE_P))
+			break;
+	if (i < npages) {
+		if (!staged) {
+			r = sys_page_alloc_range(0, FSIPC_STAGE, FSIPC_MAXPAGES,
+						 PTE_P | PTE_U | PTE_W);
+			if (r < 0)
+				return r;
+			staged = true;
+		}
+		memmove(FSIPC_STAGE, buf, n);
+		buf = FSIPC_STAGE;
+	}
+
+	fsipcbuf.write.req_fileid = fd->fd_file.id;
+	fsipcbuf.write.req_n = n;
+	if ((r = fsipc_data(FSREQ_WRITE_MAP, buf, npages)) < 0)
+		return r;
+	assert(r <= n);
+	return r;
+}
+
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
 //
 // Returns:
@@ -144,6 +225,11 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 
 	int r;
 
+	// 最终项目：多页 IPC 消息
+	// 放不进请求页的写把数据页面带在请求后面，按页对齐的缓冲区直接发送
+	if (n > sizeof(fsipcbuf.write.req_buf))
+		return devfile_write_map(fd, buf, n);
+
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
 	memmove(fsipcbuf.write.req_buf, buf, n);
@@ -10,6 +10,39 @@
 
 extern void default_pgfault_handler(struct UTrapframe *utf);
 
+// 最终项目：按范围操作页面的系统调用
+// duppage 把映射攒进两个页面列表（地址 | 权限），由 dup_flush 一起提交：
+// 先映射给子进程，再把自己的页面改成写时复制
+static uint32_t dup_child[PAGE_LIST_MAX], dup_self[PAGE_LIST_MAX];
+static size_t dup_nchild, dup_nself;
+
+static int
+dup_flush(envid_t envid)
+{
+	int r;
+
+	if (dup_nchild && (r = sys_page_map_list(0, envid, dup_child, dup_nchild)) < 0)
+		return r;
+	if (dup_nself && (r = sys_page_map_list(0, 0, dup_self, dup_nself)) < 0)
+		return r;
+	dup_nchild = dup_nself = 0;
+	return 0;
+}
+
+// 把给子进程的映射排进列表，列表满了先提交
+static int
+dup_queue(envid_t envid, uint32_t addr, int perm, bool self)
+{
+	int r;
+
+	if (dup_nchild == PAGE_LIST_MAX && (r = dup_flush(envid)) < 0)
+		return r;
+	dup_child[dup_nchild++] = addr | perm;
+	if (self)
+		dup_self[dup_nself++] = addr | perm;
+	return 0;
+}
+
 //
 // Map our virtual page pn (address pn*PGSIZE) into the target envid
 // at the same virtual address.  If the page is writable or copy-on-write,
@@ -21,32 +54,22 @@ extern void default_pgfault_handler(struct UTrapframe *utf);
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
+// 最终项目：按范围操作页面的系统调用
+// 映射只是排进页面列表，调用者最后要用 dup_flush 提交并检查错误
+//
 static int
 duppage(envid_t envid, unsigned pn)
 {
-	int r, perm;
-	void *addr = (void *)(pn * PGSIZE);
+	int perm;
+	uint32_t addr = pn * PGSIZE;
 
 	// LAB 4: Your code here.
 	perm = uvpt[pn] & PTE_SYSCALL;
 	if ((perm & PTE_COW || perm & PTE_W) && !(perm & PTE_SHARE))
-	{
-		r = sys_page_map(0, addr, envid, addr, PTE_COW | PTE_U | PTE_P);
-		if (r < 0)
-			return r;
-
-		r = sys_page_map(0, addr, 0, addr, PTE_COW | PTE_U | PTE_P);
-		if (r < 0)
-			return r;
-	}
+		return dup_queue(envid, addr, PTE_COW | PTE_U | PTE_P, true);
 	else
-	{
-		r = sys_page_map(0, addr, envid, addr, perm);
-		if (r < 0)
-			return r;
-	}
+		return dup_queue(envid, addr, perm, false);
 	// panic("duppage not implemented");
-	return 0;
 }
 
 //
@@ -79,16 +102,13 @@ fork(void)
 	if (child < 0)
 		return child;
 	else if (child == 0)
-	{
-		thisenv = envs + ENVX(sys_getenvid());
-		return 0;
-	}
+		return 0;	// sys_exofork 已经设置好了 thisenv
 
-	// Lab 4 挑战 7：批量系统调用
-	// 开始记录系统调用到缓存
-	begin_batchcall();
+	// 上一次 fork 时的子进程会继承没提交完的计数，这里清零
+	dup_nchild = dup_nself = 0;
 
 	// COW方式映射所有非异常栈区域
+	// 最终项目：共享内存系统调用环：环本身不复制，子进程用到时重新分配
 	for (pdeid = 0; ; pdeid++)
 		if (uvpd[pdeid] & PTE_P)
 		{
@@ -97,18 +117,8 @@ fork(void)
 			{
 				if (temp + pteid >= UXSTACKTOP / PGSIZE - 1)
 					goto copyend;
-				if (temp + pteid == batch_begin_pgnum)
-				{
-					// 提交所有系统调用
-					error = end_batchcall();
-					if (error < 0)
-						panic("fork: end_batchcall failed (%e)", error);
-				}
-				if (temp + pteid == batch_end_pgnum + 1)
-				{
-					// 开始记录系统调用到缓存
-					begin_batchcall();
-				}
+				if (temp + pteid == PGNUM(URING))
+					continue;
 				if (uvpt[temp + pteid] & PTE_P)
 				{
 					error = duppage(child, temp + pteid);
@@ -120,10 +130,10 @@ fork(void)
 
 copyend:
 
-	// 提交所有系统调用
-	error = end_batchcall();
+	// 提交所有排队的映射
+	error = dup_flush(child);
 	if (error < 0)
-		panic("fork: end_batchcall failed (%e)", error);
+		panic("fork: dup_flush failed (%e)", error);
 
 	// 复制异常栈
 	error = sys_page_alloc(child, (void *)(UXSTACKTOP - PGSIZE), PTE_U | PTE_W | PTE_P);
@@ -167,10 +177,10 @@ sfork(void)
 	if (child < 0)
 		return child;
 	else if (child == 0)
-	{
-		thisenv = envs + ENVX(sys_getenvid());
-		return 0;
-	}
+		return 0;	// sys_exofork 已经设置好了 thisenv
+
+	// 上一次 fork 时的子进程会继承没提交完的计数，这里清零
+	dup_nchild = dup_nself = 0;
 
 	// 直接映射方式映射所有非栈区域，COW方式映射栈
 	for (pdeid = 0;; pdeid++)
@@ -181,6 +191,8 @@ sfork(void)
 			{
 				if (temp + pteid >= UXSTACKTOP / PGSIZE - 1)
 					goto copyend;
+				if (temp + pteid == PGNUM(URING))
+					continue;
 				if (uvpt[temp + pteid] & PTE_P)
 				{
 					if (temp + pteid >= USTACKTOP / PGSIZE - 1)
@@ -191,10 +203,9 @@ sfork(void)
 					}
 					else
 					{
-						void *addr = (void *)((temp + pteid) * PGSIZE);
-						error = sys_page_map(0, addr, child, addr, uvpt[temp + pteid] & PTE_SYSCALL);
+						error = dup_queue(child, (temp + pteid) * PGSIZE, uvpt[temp + pteid] & PTE_SYSCALL, false);
 						if (error < 0)
-							panic("sfork: sys_page_map failed (%e)", error);
+							panic("sfork: dup_queue failed (%e)", error);
 					}
 				}
 			}
@@ -202,6 +213,11 @@ sfork(void)
 
 copyend:
 
+	// 最终项目：按范围操作页面的系统调用：提交排队的映射
+	error = dup_flush(child);
+	if (error < 0)
+		panic("sfork: dup_flush failed (%e)", error);
+
 	// 复制异常栈
 	error = sys_page_alloc(child, (void *)(UXSTACKTOP - PGSIZE), PTE_U | PTE_W | PTE_P);
 	if (error < 0)
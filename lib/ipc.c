@@ -2,6 +2,28 @@
 
 #include <inc/lib.h>
 
+// 从 thisenv 取出收到的消息，接收失败时返回错误（ipc_recv 和 ipc_call 共用）
+static int32_t
+ipc_result(int error, envid_t *from_env_store, int *perm_store)
+{
+	if (error < 0)
+	{
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+
+		return error;
+	}
+
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+
+	return thisenv->env_ipc_value;
+}
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -30,31 +52,18 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 		pg = (void *) 0xffffffff;
 
 	error = sys_ipc_recv(pg);
-	if (error < 0)
-	{
-		if (from_env_store)
-			*from_env_store = 0;
-		if (perm_store)
-			*perm_store = 0;
-
-		return error;
-	}
-
-	if (from_env_store)
-		*from_env_store = thisenv->env_ipc_from;
-	if (perm_store)
-		*perm_store = thisenv->env_ipc_perm;
-
-	return thisenv->env_ipc_value;
+	return ipc_result(error, from_env_store, perm_store);
 	// panic("ipc_recv not implemented");
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
 // This function keeps trying until it succeeds.
 // It should panic() on any error other than -E_IPC_NOT_RECV.
+// 最终项目：阻塞 IPC 发送
+// 改用 sys_ipc_send：接收方没有准备好时在内核里阻塞等待，不再反复重试
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
+//   Use sys_yield_to() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
@@ -67,20 +76,40 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	if (!pg)
 		pg = (void *)0xffffffff;
 
-	while (true)
-	{
-		error = sys_ipc_try_send(to_env, val, pg, perm);
-		if (error == -E_IPC_NOT_RECV)
-			sys_yield();
-		else if (error < 0)
-			panic("ipc_send: sys_ipc_try_send failed (%e)", error);
-		else
-			return;
-	}
+	error = sys_ipc_send(to_env, val, pg, perm);
+	if (error < 0)
+		panic("ipc_send: sys_ipc_send failed (%e)", error);
 
 	// panic("ipc_send not implemented");
 }
 
+// 最终项目：异步消息队列
+// 把 val（pg 非空时还有 pg 处的页面）排进 to_env 的消息队列，
+// 不等待接收方。队列满时 flags 带 MSG_BLOCK 就等到有空位，
+// 否则返回 -E_MSGQ_FULL；其他错误同 sys_msg_send
+int
+msg_send(envid_t to_env, uint32_t val, void *pg, int perm, int flags)
+{
+	if (!pg)
+		pg = (void *) 0xffffffff;
+
+	return sys_msg_send(to_env, val, pg, perm, flags);
+}
+
+// 从自己的消息队列（先用 sys_msg_setup 打开）取出一条消息，
+// 队列为空时等待。参数和返回值同 ipc_recv
+int32_t
+msg_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	int error;
+
+	if (!pg)
+		pg = (void *) 0xffffffff;
+
+	error = sys_msg_recv(pg);
+	return ipc_result(error, from_env_store, perm_store);
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
@@ -89,7 +118,55 @@ ipc_find_env(enum EnvType type)
 {
 	int i;
 	for (i = 0; i < NENV; i++)
-		if (envs[i].env_type == type)
+		// 最终项目：RCU 式进程回收：跳过已经释放或正在销毁的进程
+		if (envs[i].env_type == type &&
+		    envs[i].env_status != ENV_FREE && envs[i].env_status != ENV_DYING)
 			return envs[i].env_id;
 	return 0;
 }
+
+// 最终项目：调用/回复 IPC
+// 向 to_env 发送请求并等待它的回复，只陷入内核一次。
+// 回复的页面映射在 rcv_pg（为空表示不接收页面），返回回复的值，
+// 发送失败或者 to_env 在回复之前退出时返回错误
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm, void *rcv_pg, int *perm_store)
+{
+	int error;
+
+	if (!pg)
+		pg = (void *) 0xffffffff;
+	if (!rcv_pg)
+		rcv_pg = (void *) 0xffffffff;
+
+	error = sys_ipc_call(to_env, val, pg, perm, rcv_pg);
+	return ipc_result(error, NULL, perm_store);
+}
+
+// 服务端回复 to_env 并等待下一个请求，返回请求的值（同 ipc_recv）。
+// 客户端没有在 ipc_call 里等待时（例如用 ipc_send 和 ipc_recv
+// 发来的请求），退回到 ipc_send 之后再 ipc_recv；客户端已经退出时丢弃回复。
+// 其他的回复错误（例如 pg 无效，或者回复的页面映射不进客户端的窗口）
+// 直接返回：这时回复没有送达，也没有收到新的请求，由调用者决定怎么处理
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       void *rcv_pg, envid_t *from_env_store, int *perm_store)
+{
+	int error;
+
+	if (!pg)
+		pg = (void *) 0xffffffff;
+	if (!rcv_pg)
+		rcv_pg = (void *) 0xffffffff;
+
+	error = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg);
+	if (error < 0)
+	{
+		if (error == -E_IPC_NOT_RECV)
+			error = sys_ipc_send(to_env, val, pg, perm);
+		if (error < 0 && error != -E_BAD_ENV)
+			return ipc_result(error, from_env_store, perm_store);
+		error = sys_ipc_recv(rcv_pg);
+	}
+	return ipc_result(error, from_env_store, perm_store);
+}
@@ -0,0 +1,47 @@
+// 最终项目：内核信息页
+// 读取内核映射在 UKINFO 处的 struct KernInfo（见 inc/kinfo.h），不陷入内核
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// 启动以来的计时器中断数
+uint64_t
+kinfo_ticks(void)
+{
+	uint32_t seq;
+	uint64_t ticks;
+
+	do {
+		seq = kinfo.ki_seq;
+		ticks = kinfo.ki_ticks;
+	} while ((seq & 1) || seq != kinfo.ki_seq);
+	return ticks;
+}
+
+// 启动以来的纳秒数，由 TSC 换算（假定各 CPU 的 TSC 同步）
+uint64_t
+uptime_ns(void)
+{
+	return (read_tsc() - kinfo.ki_tsc_boot) * 1000 / kinfo.ki_tsc_per_us;
+}
+
+uint64_t
+uptime_us(void)
+{
+	return (read_tsc() - kinfo.ki_tsc_boot) / kinfo.ki_tsc_per_us;
+}
+
+uint32_t
+kinfo_ncpu(void)
+{
+	return kinfo.ki_ncpu;
+}
+
+// CPU cpu 近期的忙碌程度（千分比）
+uint32_t
+kinfo_cpu_load(int cpu)
+{
+	if (cpu < 0 || cpu >= kinfo.ki_ncpu)
+		return 0;
+	return kinfo.ki_cpu[cpu].kc_load;
+}
@@ -9,6 +9,7 @@ extern void umain(int argc, char **argv);
 // 对 thisenv 的 hack
 const volatile struct Env **_thisenv_addr;
 const char *binaryname = "<unknown>";
+envid_t start_envid;	// 由 entry.S 保存
 
 void default_pgfault_handler(struct UTrapframe *utf)
 {
@@ -74,16 +75,16 @@ libmain(int argc, char **argv)
 
 	// set thisenv to point at our Env structure in envs[].
 	// LAB 3: Your code here.
-	thisenv = envs + ENVX(sys_getenvid());
+	// 最终项目：内核信息页
+	// 内核让进程开始运行时 %edx 是自己的 envid（entry.S 保存在 start_envid）；
+	// 陷入帧是别的程序随意设置的话就退回 sys_getenvid
+	if (start_envid <= 0 || envs[ENVX(start_envid)].env_id != start_envid)
+		start_envid = sys_getenvid();
+	thisenv = envs + ENVX(start_envid);
 
 	// 设置全局缺页异常处理
 	set_pgfault_handler(default_pgfault_handler);
 
-	// Lab 4 挑战 7：批量系统调用
-	// 记录缓存页号，用于让批量系统调用避开缓存页
-	batch_begin_pgnum = ROUNDDOWN((uint32_t)&in_batch_state, PGSIZE) / PGSIZE,
-		batch_end_pgnum = ROUNDUP((uint32_t)(batch_argu + 4), PGSIZE) / PGSIZE;
-
 	// save the name of the program so that panic() can use it
 	if (argc > 0)
 		binaryname = argv[0];
@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
@@ -19,9 +20,17 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// 最终项目：futex
+// 管道空或者满的时候不再让出 CPU 轮询，而是在对方要改变的位置上睡眠。
+// 对方关闭管道不会改变位置，被杀死的进程连 close 都不会调用，
+// 所以睡眠带一个超时，醒来后重新检查管道是否已经关闭
+#define PIPE_WAIT_US	10000
+
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_rwaiters;	// readers sleeping on p_wpos
+	uint32_t p_wwaiters;	// writers sleeping on p_rpos
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
@@ -101,6 +110,27 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// 在 *pos 上睡眠，直到它不再等于 old（或者超时）。
+// 先登记为等待者再检查：对方在登记之后改变位置就会看到我们并唤醒，
+// 在那之前改变的话 sys_futex_wait 发现值已经不同，直接返回
+static void
+pipe_wait(volatile off_t *pos, off_t old, volatile uint32_t *waiters)
+{
+	xadd(waiters, 1);
+	if (*pos == old)
+		sys_futex_wait((volatile uint32_t *) pos, old, PIPE_WAIT_US);
+	xadd(waiters, -1);
+}
+
+// 改变了位置之后唤醒对方。带 lock 前缀的 xadd 保证位置的修改
+// 先于读取等待者的计数被对方看到
+static void
+pipe_wake(volatile off_t *pos, volatile uint32_t *waiters)
+{
+	if (xadd(waiters, 0))
+		sys_futex_wake((volatile uint32_t *) pos, FUTEX_WAKE_ALL);
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
@@ -119,20 +149,23 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				break;
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer moves wpos
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read wait\n");
+			pipe_wait(&p->p_wpos, p->p_rpos, &p->p_rwaiters);
 		}
+		if (p->p_rpos == p->p_wpos)
+			break;
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+	pipe_wake(&p->p_rpos, &p->p_wwaiters);
 	return i;
 }
 
@@ -157,16 +190,19 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let readers drain what we wrote, then sleep
+			// until one of them moves rpos
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write wait\n");
+			pipe_wake(&p->p_wpos, &p->p_rwaiters);
+			pipe_wait(&p->p_rpos, p->p_wpos - sizeof(p->p_buf), &p->p_wwaiters);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
 		p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
 		p->p_wpos++;
 	}
+	pipe_wake(&p->p_wpos, &p->p_rwaiters);
 
 	return i;
 }
@@ -35,6 +35,11 @@ static const char * const error_string[MAXERROR] =
 	[E_FILE_EXISTS]	= "file already exists",
 	[E_NOT_EXEC]	= "file is not a valid executable",
 	[E_NOT_SUPP]	= "operation not supported",
+	[E_NO_CAPACITY]	= "not enough CPU capacity",
+	[E_CANCELED]	= "operation canceled",
+	[E_MSGQ_FULL]	= "message queue is full",
+	[E_AGAIN]	= "try again",
+	[E_TIMEOUT]	= "timed out",
 };
 
 /*
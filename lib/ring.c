@@ -0,0 +1,115 @@
+// 最终项目：共享内存系统调用环
+// 把不会阻塞的系统调用攒在 URING 处的环里，一次 sys_enter_ring 执行一批
+// （见 inc/syscall.h 和 kern/syscall.c 的 sys_enter_ring）。
+// 用 ring_queue 排队，ring_flush 提交剩下的调用并返回其中第一个错误
+
+#include <inc/lib.h>
+
+// 环所在的页面。内核只用开头的 SyscallRing，后面是库自己的状态：
+// 它们跟着页面走，fork 或 sfork 出的进程看到的是别人的页面，会重新分配
+struct RingPage {
+	struct SyscallRing rp_ring;
+	envid_t rp_env;		// 注册了这个环的进程
+	int rp_error;		// 上次 ring_flush 以来第一个失败的调用的返回值
+};
+
+static struct RingPage *rpage = (struct RingPage *) URING;
+static struct SyscallRing *ring = (struct SyscallRing *) URING;
+
+// URING 处是否是当前进程注册的环
+static bool
+ring_mine(void)
+{
+	return (uvpd[PDX(URING)] & PTE_P) && (uvpt[PGNUM(URING)] & PTE_P) &&
+		rpage->rp_env == thisenv->env_id;
+}
+
+static int
+ring_setup(void)
+{
+	int r;
+
+	static_assert(sizeof(struct RingPage) <= PGSIZE);
+	if (ring_mine())
+		return 0;
+	if ((r = sys_page_alloc(0, rpage, PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	ring->sq_head = ring->sq_tail = 0;
+	ring->cq_head = ring->cq_tail = 0;
+	if ((r = sys_ring_setup(ring)) < 0)
+		return r;
+	rpage->rp_env = thisenv->env_id;
+	rpage->rp_error = 0;
+	return 0;
+}
+
+// 收走所有完成项，记下第一个错误
+static void
+ring_reap(void)
+{
+	struct SyscallCqe *cqe;
+
+	for (; ring->cq_head != ring->cq_tail; ring->cq_head++) {
+		cqe = &ring->cq[ring->cq_head % SRING_CQ_ENTRIES];
+		if (cqe->cqe_result < 0 && rpage->rp_error == 0)
+			rpage->rp_error = cqe->cqe_result;
+	}
+}
+
+// 提交队列里所有的调用
+static int
+ring_submit(void)
+{
+	int r;
+
+	while (ring->sq_head != ring->sq_tail) {
+		if ((r = sys_enter_ring(ring->sq_tail - ring->sq_head, 0)) < 0)
+			return r;
+		ring_reap();
+	}
+	return 0;
+}
+
+// 把系统调用 num 排进提交队列；队列满了先提交。
+// flags 为 SQE_LINK 时，这个调用失败会取消下一个调用
+int
+ring_queue(int num, uint32_t a1, uint32_t a2, uint32_t a3,
+	   uint32_t a4, uint32_t a5, int flags)
+{
+	struct SyscallSqe *sqe;
+	int r;
+
+	if ((r = ring_setup()) < 0)
+		return r;
+	if (ring->sq_tail - ring->sq_head == SRING_SQ_ENTRIES &&
+	    (r = ring_submit()) < 0)
+		return r;
+
+	sqe = &ring->sq[ring->sq_tail % SRING_SQ_ENTRIES];
+	sqe->sqe_num = num;
+	sqe->sqe_args[0] = a1;
+	sqe->sqe_args[1] = a2;
+	sqe->sqe_args[2] = a3;
+	sqe->sqe_args[3] = a4;
+	sqe->sqe_args[4] = a5;
+	sqe->sqe_flags = flags;
+	sqe->sqe_data = ring->sq_tail;
+	ring->sq_tail++;
+	return 0;
+}
+
+// 提交所有排队的调用，返回 0 或者其中第一个错误；
+// 当前进程还没有用 ring_queue 注册环时返回 -E_INVAL
+int
+ring_flush(void)
+{
+	int r;
+
+	if (!ring_mine())
+		return -E_INVAL;
+	if ((r = ring_submit()) < 0)
+		return r;
+	r = rpage->rp_error;
+	rpage->rp_error = 0;
+	return r;
+}
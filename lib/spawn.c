@@ -5,6 +5,10 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// 最终项目：按范围操作页面的系统调用
+// map_segment 一次从文件读入的最大页数
+#define NSPAWNTEMP		16
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
@@ -247,9 +251,12 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 
 	// After completing the stack, map it into the child's address space
 	// and unmap it from ours!
-	if ((r = sys_page_map(0, UTEMP, child, (void*) (USTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
+	// 最终项目：共享内存系统调用环：两个调用一起提交
+	if ((r = ring_queue(SYS_page_map, 0, (uint32_t) UTEMP, child, USTACKTOP - PGSIZE, PTE_P | PTE_U | PTE_W, 0)) < 0)
+		goto error;
+	if ((r = ring_queue(SYS_page_unmap, 0, (uint32_t) UTEMP, 0, 0, 0, 0)) < 0)
 		goto error;
-	if ((r = sys_page_unmap(0, UTEMP)) < 0)
+	if ((r = ring_flush()) < 0)
 		goto error;
 
 	return 0;
@@ -259,11 +266,14 @@ error:
 	return r;
 }
 
+// 最终项目：按范围操作页面的系统调用
+// 从文件读入的页面每次最多 NSPAWNTEMP 页一起放在 UTEMP 开始的临时页里，
+// 用一次 sys_page_map_range 映射给子进程；空白页一次分配完
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
+	int i, n, r;
 	void *blk;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
@@ -275,33 +285,41 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
+	for (i = 0; i < memsz; i += n * PGSIZE) {
 		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			// allocate blank pages
+			n = (ROUNDUP(memsz, PGSIZE) - i) / PGSIZE;
+			if ((r = sys_page_alloc_range(child, (void*) (va + i), n, perm)) < 0)
 				return r;
 		} else {
 			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			n = MIN((ROUNDUP(filesz, PGSIZE) - i) / PGSIZE, NSPAWNTEMP);
+			if ((r = sys_page_alloc_range(0, UTEMP, n, PTE_P|PTE_U|PTE_W)) < 0)
 				return r;
 			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+				goto error;
+			if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz-i))) < 0)
+				goto error;
+			if ((r = sys_page_map_range(0, UTEMP, child, (void*) (va + i), n, perm)) < 0)
+				panic("spawn: sys_page_map_range data: %e", r);
+			sys_page_unmap_range(0, UTEMP, n);
 		}
 	}
 	return 0;
+
+error:
+	sys_page_unmap_range(0, UTEMP, n);
+	return r;
 }
 
 // Copy the mappings for shared pages into the child address space.
+// 最终项目：按范围操作页面的系统调用：攒成页面列表一起映射
 static int
 copy_shared_pages(envid_t child)
 {
 	// LAB 5: Your code here.
-	int pdeid, pteid, temp, error;
+	static uint32_t list[PAGE_LIST_MAX];
+	int pdeid, pteid, temp, error, n = 0;
 
 	for (pdeid = 0; pdeid < NPDENTRIES; pdeid++)
 		if (uvpd[pdeid] & PTE_P)
@@ -311,13 +329,18 @@ copy_shared_pages(envid_t child)
 			{
 				if (uvpt[temp + pteid] & PTE_P && uvpt[temp + pteid] & PTE_SHARE)
 				{
-					void *addr = (void *)((temp + pteid) * PGSIZE);
-					error = sys_page_map(0, addr, child, addr, uvpt[temp + pteid] & PTE_SYSCALL);
-					if (error < 0)
-						panic("copy_shared_pages: sys_page_map failed (%e)", error);
+					list[n++] = (temp + pteid) * PGSIZE | (uvpt[temp + pteid] & PTE_SYSCALL);
+					if (n == PAGE_LIST_MAX)
+					{
+						error = sys_page_map_list(0, child, list, n);
+						if (error < 0)
+							panic("copy_shared_pages: sys_page_map_list failed (%e)", error);
+						n = 0;
+					}
 				}
 			}
 		}
+	if (n && (error = sys_page_map_list(0, child, list, n)) < 0)
+		panic("copy_shared_pages: sys_page_map_list failed (%e)", error);
 	return 0;
 }
-
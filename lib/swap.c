@@ -38,7 +38,7 @@ swap_page_to_disk(void *va)
 		(uint32_t)va == (uint32_t)ROUNDDOWN(&devfile, PGSIZE) ||
 		(uint32_t)va == (uint32_t)ROUNDDOWN(&devtab, PGSIZE) ||
 		(uint32_t)va == (uint32_t)ROUNDDOWN(&buf, PGSIZE) ||
-		(uint32_t)va >= 0xD0000000) // FDTABLE
+		(uint32_t)va >= FDTABLE)
 		return -E_INVAL;
 
 	in_urgency = true;
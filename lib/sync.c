@@ -0,0 +1,79 @@
+// 最终项目：futex
+// 建立在 sys_futex_wait/sys_futex_wake 上的互斥锁和条件变量，
+// 可以放在共享内存里（sfork 的进程之间、PTE_SHARE 页面）。
+// 没有争用时只有一条原子指令，不陷入内核
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// m_state：0 表示未锁，1 表示已锁，2 表示已锁并且可能有等待者
+void
+mutex_init(struct Mutex *m)
+{
+	m->m_state = 0;
+}
+
+void
+mutex_lock(struct Mutex *m)
+{
+	uint32_t c;
+
+	if ((c = cmpxchg(&m->m_state, 0, 1)) == 0)
+		return;
+	// 标记有等待者，这样解锁的一方才会唤醒我们
+	if (c != 2)
+		c = xchg(&m->m_state, 2);
+	while (c != 0) {
+		sys_futex_wait(&m->m_state, 2, 0);
+		c = xchg(&m->m_state, 2);
+	}
+}
+
+bool
+mutex_trylock(struct Mutex *m)
+{
+	return cmpxchg(&m->m_state, 0, 1) == 0;
+}
+
+void
+mutex_unlock(struct Mutex *m)
+{
+	if (xadd(&m->m_state, -1) != 1) {
+		m->m_state = 0;
+		sys_futex_wake(&m->m_state, 1);
+	}
+}
+
+// c_seq 每次通知加一：等待者在放开互斥锁之前记下它，
+// 之后的通知会改变它，sys_futex_wait 就不会睡下去
+void
+cond_init(struct Cond *c)
+{
+	c->c_seq = 0;
+}
+
+// 放开 m 并等待通知，返回前重新锁住 m。
+// 和其他实现一样可能被虚假唤醒，调用者要在循环里检查条件
+void
+cond_wait(struct Cond *c, struct Mutex *m)
+{
+	uint32_t seq = c->c_seq;
+
+	mutex_unlock(m);
+	sys_futex_wait(&c->c_seq, seq, 0);
+	mutex_lock(m);
+}
+
+void
+cond_signal(struct Cond *c)
+{
+	xadd(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, 1);
+}
+
+void
+cond_broadcast(struct Cond *c)
+{
+	xadd(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, FUTEX_WAKE_ALL);
+}
@@ -2,75 +2,36 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
 #undef dbg_cprintf
 #define dbg_cprintf(...) cprintf(__VA_ARGS__)
 
-// Lab 4 挑战 7：批量系统调用
-bool in_batch_state = false;
-int batch_syscall_count = 0;
-uint32_t batch_callno[64], argustores[5][64], 
-*batch_argu[5] = { argustores[0], argustores[1], argustores[2], argustores[3], argustores[4] };
-
 bool in_urgency = false;
 
 #ifdef USE_SYSENTER
+// 最终项目：sysenter 快速系统调用
+// CPU 不支持 sysenter/sysexit 时退回 int $T_SYSCALL
+static int sysenter_ok = -1;
 
-__attribute__((noinline)) static int32_t
-syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+static bool
+sysenter_supported(void)
 {
-	int32_t ret;
-
-	// sysenter 指令
-
-	asm volatile(
-		"push %%esi\n"
-		"push %%ebp\n"
-		"movl %%esp, %%ebp\n"
-		"push %%esp\n"
-		"leal _sysenter_end, %%esi\n"
-		"sysenter\n"
-		"_sysenter_end:\n"
-		"pop %%esp\n"
-		"pop %%ebp\n"
-		"pop %%esi\n"
-		: "=a" (ret)
-		:
-		"a" (num),
-		"d" (a1),
-		"c" (a2),
-		"b" (a3),
-		"D" (a4)
-		: "cc", "memory");
+	uint32_t edx;
 
-#else
+	if (sysenter_ok < 0) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		sysenter_ok = ((edx >> CPUID_EDX_SEP_BIT) & 1) &&
+			((edx >> CPUID_EDX_MSR_BIT) & 1);
+	}
+	return sysenter_ok;
+}
+#endif
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
 
-	if (in_batch_state && (num == SYS_page_map || num == SYS_page_unmap || num == SYS_page_alloc))
-	{
-		// 批量处理模式，先添加入缓存
-		if (batch_syscall_count == 64)
-		{
-			// 系统调用缓存满了，提交之前的系统调用
-			ret = syscall(131, 0, (uint32_t)batch_callno, (uint32_t)batch_argu, 0, 0, 0);
-			batch_syscall_count = 0;
-			if (ret < 0)
-				return ret;
-		}
-
-		batch_callno[batch_syscall_count] = num;
-		batch_argu[0][batch_syscall_count] = a1;
-		batch_argu[1][batch_syscall_count] = a2;
-		batch_argu[2][batch_syscall_count] = a3;
-		batch_argu[3][batch_syscall_count] = a4;
-		batch_argu[4][batch_syscall_count] = a5;
-		batch_syscall_count++;
-		return 0;
-	}
-
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
 	// Interrupt kernel with T_SYSCALL.
@@ -83,6 +44,32 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// potentially change the condition codes and arbitrary
 	// memory locations.
 
+#ifdef USE_SYSENTER
+	// 最终项目：sysenter 快速系统调用
+	// 参数寄存器与 int $T_SYSCALL 相同，但 %esi 要用来传返回地址、
+	// %ebp 用来传用户栈，所以第五个参数放在用户栈顶由内核读取，
+	// 再往上是 EFLAGS，内核需要补陷入帧时用它。
+	// sysexit 用 %edx 和 %ecx 返回，它们会被破坏
+	if (sysenter_supported()) {
+		asm volatile("pushfl\n\t"
+			"pushl %%ebp\n\t"
+			"pushl %%esi\n\t"
+			"movl %%esp, %%ebp\n\t"
+			"leal 1f, %%esi\n\t"
+			"sysenter\n"
+			"1:\tpopl %%esi\n\t"
+			"popl %%ebp\n\t"
+			"popfl"
+			: "=a" (ret),
+			  "+d" (a1),
+			  "+c" (a2)
+			: "a" (num),
+			  "b" (a3),
+			  "D" (a4),
+			  "S" (a5)
+			: "cc", "memory");
+	} else
+#endif
 	asm volatile("int %1\n"
 		: "=a" (ret)
 		: "i" (T_SYSCALL),
@@ -94,8 +81,6 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		  "S" (a5)
 		: "cc", "memory");
 
-#endif
-
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
 
@@ -138,55 +123,62 @@ sys_yield(void)
 	syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
 }
 
+void
+sys_yield_to(envid_t envid)
+{
+	syscall(SYS_yield_to, 0, envid, 0, 0, 0, 0);
+}
+
+// 最终项目：换页
+// 内存不足时换出一个页面到硬盘，先找没被访问过的。成功返回 0
+static int
+swap_out_one(void)
+{
+	int pdeid, pteid, temp;
+
+	dbg_cprintf("[%x]Insufficent space....\n", thisenv->env_id);
+
+	for (pdeid = 4; pdeid < NPDENTRIES; pdeid++)
+		if (uvpd[pdeid] & PTE_P)
+		{
+			temp = pdeid * NPTENTRIES;
+			for (pteid = 0; pteid < NPTENTRIES; pteid++)
+				if (uvpt[temp + pteid] & PTE_P && !(uvpt[temp + pteid] & PTE_A) &&
+					swap_page_to_disk((void *)((temp + pteid) * PGSIZE)) == 0)
+				{
+					return 0;
+				}
+		}
+
+	dbg_cprintf("All pages has PTE_A....\n");
+
+	// 不行……再来一次！（这次不舍去PTE_A了）
+	for (pdeid = 4; pdeid < NPDENTRIES; pdeid++)
+		if (uvpd[pdeid] & PTE_P)
+		{
+			temp = pdeid * NPTENTRIES;
+			for (pteid = 0; pteid < NPTENTRIES; pteid++)
+				if (uvpt[temp + pteid] & PTE_P &&
+					swap_page_to_disk((void *)((temp + pteid) * PGSIZE)) == 0)
+				{
+					return 0;
+				}
+		}
+
+	dbg_cprintf("Still insufficent space!\n");
+	return -E_NO_MEM;
+}
+
 int
 sys_page_alloc(envid_t envid, void *va, int perm)
 {
 	int r;
-	retry:
-
-	if (in_urgency) // 紧急分配
-		r = syscall(SYS_page_alloc, 1, envid, (uint32_t)va, perm, 1, 0);
-	else
-		r = syscall(SYS_page_alloc, 1, envid, (uint32_t)va, perm, 0, 0);
 
 	// 最终项目：换页
-	if (r == -E_NO_MEM)
-	{
-		// 没地方了……开始找页踢到硬盘！
-
-		int pdeid, pteid, temp;
-
-		dbg_cprintf("[%x]Insufficent space....\n", thisenv->env_id);
-
-		for (pdeid = 4; pdeid < NPDENTRIES; pdeid++)
-			if (uvpd[pdeid] & PTE_P)
-			{
-				temp = pdeid * NPTENTRIES;
-				for (pteid = 0; pteid < NPTENTRIES; pteid++)
-					if (uvpt[temp + pteid] & PTE_P && !(uvpt[temp + pteid] & PTE_A) &&
-						swap_page_to_disk((void *)((temp + pteid) * PGSIZE)) == 0)
-					{
-						goto retry;
-					}
-			}
-
-		dbg_cprintf("All pages has PTE_A....\n");
-
-		// 不行……再来一次！（这次不舍去PTE_A了）
-		for (pdeid = 4; pdeid < NPDENTRIES; pdeid++)
-			if (uvpd[pdeid] & PTE_P)
-			{
-				temp = pdeid * NPTENTRIES;
-				for (pteid = 0; pteid < NPTENTRIES; pteid++)
-					if (uvpt[temp + pteid] & PTE_P &&
-						swap_page_to_disk((void *)((temp + pteid) * PGSIZE)) == 0)
-					{
-						goto retry;
-					}
-			}
-
-		dbg_cprintf("Still insufficent space!\n");
-	}
+	// 没地方了……开始找页踢到硬盘！
+	do
+		r = syscall(SYS_page_alloc, 1, envid, (uint32_t)va, perm, in_urgency, 0);	// 紧急分配
+	while (r == -E_NO_MEM && swap_out_one() == 0);
 	return r;
 }
 
@@ -238,6 +230,70 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+// 最终项目：阻塞 IPC 发送
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+// 最终项目：调用/回复 IPC
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+// 最终项目：异步消息队列
+int
+sys_msg_setup(uint32_t depth)
+{
+	return syscall(SYS_msg_setup, 0, depth, 0, 0, 0, 0);
+}
+
+int
+sys_msg_send(envid_t envid, uint32_t value, void *srcva, int perm, int flags)
+{
+	return syscall(SYS_msg_send, 0, envid, value, (uint32_t) srcva, perm, flags);
+}
+
+int
+sys_msg_recv(void *dstva)
+{
+	return syscall(SYS_msg_recv, 0, (uint32_t) dstva, 0, 0, 0, 0);
+}
+
+// 最终项目：futex
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint32_t timeout_us)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected, timeout_us, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, uint32_t n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_env_set_quantum(envid_t envid, uint32_t us)
+{
+	return syscall(SYS_env_set_quantum, 0, envid, us, 0, 0, 0);
+}
+
+int
+sys_env_set_rt(envid_t envid, uint32_t period_us, uint32_t budget_us)
+{
+	return syscall(SYS_env_set_rt, 0, envid, period_us, budget_us, 0, 0);
+}
+
 int
 sys_capture_state(envid_t envid)
 {
@@ -256,29 +312,86 @@ sys_env_set_other_exception_upcall(envid_t envid, void *upcall)
 	return syscall(130, 1, envid, (uint32_t)upcall, 0, 0, 0);
 }
 
-// 清空缓存、记录其后的系统调用
+// 最终项目：共享内存系统调用环
+int
+sys_ring_setup(void *va)
+{
+	return syscall(SYS_ring_setup, 1, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_enter_ring(uint32_t n_submit, uint32_t min_complete)
+{
+	return syscall(SYS_enter_ring, 0, n_submit, min_complete, 0, 0, 0);
+}
+
+// 最终项目：按范围操作页面的系统调用
+// 内核一次最多处理 PAGE_RANGE_MAX 个页面，更大的范围在这里分批提交。
+// 分批以后出错时前面的批次已经生效（一批之内仍然是全部或者全不）
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	size_t n;
+	int r;
+
+	for (; npages; npages -= n, va += n * PGSIZE) {
+		n = MIN(npages, PAGE_RANGE_MAX);
+		// 最终项目：换页
+		do
+			r = syscall(SYS_page_alloc_range, 1, envid, (uint32_t) va, n, perm, in_urgency);
+		while (r == -E_NO_MEM && swap_out_one() == 0);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
 int
-begin_batchcall()
+sys_page_map_range(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva,
+		   size_t npages, int perm)
 {
-	if (in_batch_state)
-		return -E_INVAL;
-	in_batch_state = true;
-	batch_syscall_count = 0;
+	size_t n;
+	int r;
+
+	for (; npages; npages -= n, srcva += n * PGSIZE, dstva += n * PGSIZE) {
+		n = MIN(npages, PAGE_RANGE_MAX);
+		// 权限放在 dstva 的页内偏移里传递
+		if ((r = syscall(SYS_page_map_range, 1, srcenv, (uint32_t) srcva, dstenv,
+				 PTE_ADDR(dstva) | PGOFF(perm), n)) < 0)
+			return r;
+	}
 	return 0;
 }
 
-// 提交所有系统调用、清空缓存
 int
-end_batchcall()
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
 {
-	int32_t ret;
-	if (!in_batch_state)
-		return -E_INVAL;
-	if (batch_syscall_count < 64)
-		batch_callno[batch_syscall_count] = 0xFFFFFFFF;
-
-	ret = syscall(131, 0, (uint32_t)batch_callno, (uint32_t)batch_argu, 0, 0, 0);
-	batch_syscall_count = 0;
-	in_batch_state = false;
-	return ret;
+	size_t n;
+	int r;
+
+	for (; npages; npages -= n, va += n * PGSIZE) {
+		n = MIN(npages, PAGE_RANGE_MAX);
+		if ((r = syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, n, 0, 0)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+int
+sys_page_map_list(envid_t srcenv, envid_t dstenv, const uint32_t *list, size_t n)
+{
+	return syscall(SYS_page_map_list, 1, srcenv, dstenv, (uint32_t) list, n, 0);
+}
+
+int
+sys_page_unmap_list(envid_t envid, const uint32_t *list, size_t n)
+{
+	return syscall(SYS_page_unmap_list, 1, envid, (uint32_t) list, n, 0, 0);
+}
+
+// 最终项目：系统调用统计
+int
+sys_sysstat_ctl(int op)
+{
+	return syscall(SYS_sysstat_ctl, 1, op, 0, 0, 0, 0);
 }
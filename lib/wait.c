@@ -5,9 +5,17 @@ void
 wait(envid_t envid)
 {
 	const volatile struct Env *e;
+	uint32_t exits;
 
 	assert(envid != 0);
 	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	// 最终项目：futex
+	// 不再反复让出 CPU，而是在槽位的退出次数上睡眠，由内核在进程退出时唤醒。
+	// 先记下次数再检查：检查之后才退出的话次数已经变了，不会睡下去
+	while (1) {
+		exits = e->env_exit_count;
+		if (e->env_id != envid || e->env_status == ENV_FREE)
+			break;
+		sys_futex_wait((volatile uint32_t *) &e->env_exit_count, exits, 0);
+	}
 }
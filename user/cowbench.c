@@ -0,0 +1,69 @@
+// 最终项目：内核处理写时复制
+// fork 之后逐页写入，测量每次写时复制页错误的开销：
+// 子进程写入时页面仍与父进程共享，需要复制；子进程退出后父进程再写，
+// 页面只剩自己映射，只需要改成可写。
+// 在 kern/trap.h 中注释掉 KERNEL_COW 可以对比用户态处理的开销。
+//
+// 用法：cowbench [页数]
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define BUF	((volatile char *) 0xA0000000)
+#define MAXPAGES 1024
+
+struct Result {
+	volatile uint64_t copy;		// 子进程写入全部页面的周期数
+	volatile int done;
+};
+
+static struct Result *result = (struct Result *) (0xA0000000 - PGSIZE);
+
+static uint64_t
+touch(int npages, char v)
+{
+	uint64_t t = read_tsc();
+	int i;
+
+	for (i = 0; i < npages; i++)
+		BUF[i * PGSIZE] = v;
+	return read_tsc() - t;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r, npages = 256;
+	uint64_t fork_time, flip;
+	envid_t child;
+
+	binaryname = "cowbench";
+	if (argc > 1)
+		npages = MIN(strtol(argv[1], 0, 0), MAXPAGES);
+
+	if ((r = sys_page_alloc(0, result, PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	for (i = 0; i < npages; i++)
+		if ((r = sys_page_alloc(0, (void *) (BUF + i * PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	touch(npages, 1);
+
+	fork_time = read_tsc();
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		result->copy = touch(npages, 2);
+		result->done = 1;
+		return;
+	}
+	fork_time = read_tsc() - fork_time;
+
+	while (!result->done)
+		sys_yield();
+	wait(child);
+	flip = touch(npages, 3);
+
+	cprintf("cowbench: %d pages, fork %u cycles, copy fault %u cycles/page, "
+		"flip fault %u cycles/page\n", npages, (uint32_t) fork_time,
+		(uint32_t) (result->copy / npages), (uint32_t) (flip / npages));
+}
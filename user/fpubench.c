@@ -0,0 +1,63 @@
+// 最终项目：延迟 FPU 切换
+// 比较两个进程用 sys_yield 互相切换时的代价：
+//   none: 两个进程都不用 FPU，不会有任何 FPU 开销
+//   one:  只有一个进程用 SSE，它一直是 FPU 的主人，不会触发 #NM
+//   both: 两个进程都用 SSE，每次切换都要 #NM 并保存/恢复状态
+// 在单 CPU（make qemu CPUS=1）下运行才能保证两个进程轮流执行。
+//
+// 用法：fpubench [轮数]
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+static void
+touch_sse(void)
+{
+	asm volatile("pxor %%xmm0, %%xmm0" : : : "memory");
+}
+
+static void
+bench(const char *name, bool parent_sse, bool child_sse, int rounds)
+{
+	envid_t child;
+	uint64_t t;
+	int i;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0)
+		while (1) {
+			if (child_sse)
+				touch_sse();
+			sys_yield();
+		}
+
+	// 先让子进程跑起来
+	sys_yield();
+	t = read_tsc();
+	for (i = 0; i < rounds; i++) {
+		if (parent_sse)
+			touch_sse();
+		sys_yield();
+	}
+	t = read_tsc() - t;
+	sys_env_destroy(child);
+
+	// 每一轮包含两次切换
+	cprintf("fpubench: %-5s %d rounds, %u cycles per switch\n",
+		name, rounds, (uint32_t) (t / rounds / 2));
+}
+
+void
+umain(int argc, char **argv)
+{
+	int rounds = 10000;
+
+	binaryname = "fpubench";
+	if (argc > 1)
+		rounds = strtol(argv[1], 0, 0);
+
+	bench("none", false, false, rounds);
+	bench("one", true, false, rounds);
+	bench("both", true, true, rounds);
+}
@@ -0,0 +1,92 @@
+// 最终项目：延迟 FPU 切换
+// 两个进程同时在全部 8 个 XMM 寄存器里累加，期间不断 sys_yield，
+// 最后检查寄存器的值：FPU/SSE 状态在切换（以及多 CPU 下的迁移）后必须保持不变。
+//
+// 用法：fputest [轮数]
+
+#include <inc/lib.h>
+
+#define NWORKER	2
+
+// 把 8 个 XMM 寄存器都设为 init（每个寄存器的第 j 个 32 位元素加上 j）
+static void
+sse_load(uint32_t init)
+{
+	uint32_t v[4] __attribute__((aligned(16)));
+	int j;
+
+	for (j = 0; j < 4; j++)
+		v[j] = init + j;
+	asm volatile("movdqa %0, %%xmm0\n\tmovdqa %0, %%xmm1\n\t"
+		"movdqa %0, %%xmm2\n\tmovdqa %0, %%xmm3\n\t"
+		"movdqa %0, %%xmm4\n\tmovdqa %0, %%xmm5\n\t"
+		"movdqa %0, %%xmm6\n\tmovdqa %0, %%xmm7"
+		: : "m" (v));
+}
+
+// 每个寄存器的每个元素加 1（用 xmm 自身构造全 1 向量会破坏状态，所以从内存读）
+static void
+sse_step(void)
+{
+	static const uint32_t one[4] __attribute__((aligned(16))) = { 1, 1, 1, 1 };
+
+	asm volatile("paddd %0, %%xmm0\n\tpaddd %0, %%xmm1\n\t"
+		"paddd %0, %%xmm2\n\tpaddd %0, %%xmm3\n\t"
+		"paddd %0, %%xmm4\n\tpaddd %0, %%xmm5\n\t"
+		"paddd %0, %%xmm6\n\tpaddd %0, %%xmm7"
+		: : "m" (one));
+}
+
+static void
+sse_store(uint32_t out[8][4])
+{
+	asm volatile("movdqu %%xmm0, 0x00(%0)\n\tmovdqu %%xmm1, 0x10(%0)\n\t"
+		"movdqu %%xmm2, 0x20(%0)\n\tmovdqu %%xmm3, 0x30(%0)\n\t"
+		"movdqu %%xmm4, 0x40(%0)\n\tmovdqu %%xmm5, 0x50(%0)\n\t"
+		"movdqu %%xmm6, 0x60(%0)\n\tmovdqu %%xmm7, 0x70(%0)"
+		: : "r" (out) : "memory");
+}
+
+static void
+worker(int id, int rounds)
+{
+	uint32_t out[8][4], init = (id + 1) << 24;
+	int i, r, j;
+
+	sse_load(init);
+	for (i = 0; i < rounds; i++) {
+		sse_step();
+		sys_yield();
+	}
+	sse_store(out);
+
+	for (r = 0; r < 8; r++)
+		for (j = 0; j < 4; j++)
+			if (out[r][j] != init + j + rounds)
+				panic("worker %d: xmm%d[%d] = %08x, expected %08x",
+				      id, r, j, out[r][j], init + j + rounds);
+	cprintf("fputest: worker %d OK\n", id);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t workers[NWORKER];
+	int i, rounds = 1000;
+
+	binaryname = "fputest";
+	if (argc > 1)
+		rounds = strtol(argv[1], 0, 0);
+
+	for (i = 0; i < NWORKER; i++) {
+		if ((workers[i] = fork()) < 0)
+			panic("fork: %e", workers[i]);
+		if (workers[i] == 0) {
+			worker(i, rounds);
+			return;
+		}
+	}
+	for (i = 0; i < NWORKER; i++)
+		wait(workers[i]);
+	cprintf("fputest: done\n");
+}
@@ -0,0 +1,76 @@
+// 最终项目：调用/回复 IPC
+// 测量小块读的吞吐量：反复从文件开头读几个字节，每次读都是一次文件系统 RPC。
+// 先用旧的客户端协议（ipc_send 之后 ipc_recv）直接发 FSREQ_READ，
+// 再用 read（fsipc 里的 ipc_call）各跑一遍，报告每秒的读次数。
+// 服务端默认用 ipc_reply_wait，旧协议的客户端没有在等待回复，
+// 回复先失败，再由库退回到 ipc_send + ipc_recv，所以第一个数字是
+// 这条退回路径的开销，不是调用/回复之前的基线；要测基线，
+// 用 SERVE_SEND_RECV（fs/serv.c）编译文件系统服务。
+// 最终项目：多页 IPC 消息：每次字节数可以超过一页（最多 FSIPC_MAXPAGES 页），
+// 这时旧协议每页一次 FSREQ_READ，read 则是一次 FSREQ_READ_MAP 映射整个范围
+//
+// 用法：fsreadbench [次数 [每次字节数 [文件]]]
+
+#include <inc/lib.h>
+
+static char buf[FSIPC_MAXPAGES * PGSIZE];
+
+// 每秒的次数
+static uint32_t
+rate(uint32_t n, uint64_t begin)
+{
+	return (uint32_t) (n * 1000000ULL / MAX(uptime_us() - begin, 1));
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fdnum, i, r, got, n = 2000, size = 16;
+	const char *path = "/lorem";
+	struct Fd *fd;
+	envid_t fsenv;
+	uint64_t begin;
+	uint32_t old, call;
+
+	binaryname = "fsreadbench";
+	if (argc > 1)
+		n = MAX(strtol(argv[1], 0, 0), 1);
+	if (argc > 2)
+		size = MIN(MAX(strtol(argv[2], 0, 0), 1), (int) sizeof(buf));
+	if (argc > 3)
+		path = argv[3];
+
+	if ((fdnum = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fdnum);
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		panic("fd_lookup: %e", r);
+	fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	begin = uptime_us();
+	for (i = 0; i < n; i++) {
+		seek(fdnum, 0);
+		for (got = 0; got < size; got += r) {
+			fsipcbuf.read.req_fileid = fd->fd_file.id;
+			fsipcbuf.read.req_n = MIN(size - got, PGSIZE);
+			ipc_send(fsenv, FSREQ_READ, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+			if ((r = ipc_recv(NULL, NULL, NULL)) < 0)
+				panic("FSREQ_READ: %e", r);
+			if (r == 0)
+				break;
+		}
+	}
+	old = rate(n, begin);
+
+	begin = uptime_us();
+	for (i = 0; i < n; i++) {
+		seek(fdnum, 0);
+		if ((r = read(fdnum, buf, size)) < 0)
+			panic("read: %e", r);
+	}
+	call = rate(n, begin);
+
+	cprintf("fsreadbench: %d reads of %d bytes from %s: "
+		"send+recv (reply_wait fallback unless SERVE_SEND_RECV) %u/s, "
+		"call %u/s\n", n, size, path, old, call);
+	close(fdnum);
+}
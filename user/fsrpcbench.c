@@ -0,0 +1,77 @@
+// 最终项目：IPC 基准测试
+// 文件系统 RPC 的延迟：open+close、stat、读一小段（一次 FSREQ_READ），
+// 以及一次最多读 FSIPC_MAXPAGES 页（一次 FSREQ_READ_MAP）。
+// 小段从 path 读，大块从 bigpath 读，读到文件末尾就从头再来；
+// 文件末尾的读可能不满 FSIPC_MAXPAGES 页，所以另外报告平均每次读的字节数。
+//
+// 用法：fsrpcbench [次数 [path [bigpath]]]
+
+#include <inc/lib.h>
+
+#define PROG	"fsrpcbench"
+
+static char buf[FSIPC_MAXPAGES * PGSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	const char *path = "/lorem", *bigpath = "/sh";
+	uint32_t i, n = 1000;
+	uint64_t t, bytes = 0;
+	struct Stat st;
+	off_t off;
+	int fd, r;
+
+	binaryname = PROG;
+	if (argc > 1)
+		n = MAX(strtol(argv[1], 0, 0), 1);
+	if (argc > 2)
+		path = argv[2];
+	if (argc > 3)
+		bigpath = argv[3];
+
+	t = bench_start();
+	for (i = 0; i < n; i++) {
+		if ((fd = open(path, O_RDONLY)) < 0)
+			panic("open %s: %e", path, fd);
+		close(fd);
+	}
+	bench_result(PROG, "open_close", bench_elapsed_ns(t) / n, "ns");
+
+	t = bench_start();
+	for (i = 0; i < n; i++)
+		if ((r = stat(path, &st)) < 0)
+			panic("stat %s: %e", path, r);
+	bench_result(PROG, "stat", bench_elapsed_ns(t) / n, "ns");
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	t = bench_start();
+	for (i = 0; i < n; i++) {
+		seek(fd, 0);
+		if ((r = read(fd, buf, 16)) < 0)
+			panic("read: %e", r);
+	}
+	bench_result(PROG, "read_16", bench_elapsed_ns(t) / n, "ns");
+	close(fd);
+
+	if ((fd = open(bigpath, O_RDONLY)) < 0)
+		panic("open %s: %e", bigpath, fd);
+	if ((r = fstat(fd, &st)) < 0 || st.st_size == 0)
+		panic("fstat %s: %e", bigpath, r);
+	t = bench_start();
+	for (i = 0, off = 0; i < n; i++) {
+		// seek 不经过文件系统服务，所以每次计时的读都有数据
+		if (off >= st.st_size)
+			seek(fd, off = 0);
+		if ((r = read(fd, buf, sizeof(buf))) <= 0)
+			panic("read: %e", r);
+		off += r;
+		bytes += r;
+	}
+	t = bench_elapsed_ns(t);
+	bench_result(PROG, "read_map", t / n, "ns");
+	bench_result(PROG, "read_map_bytes", bytes / n, "B");
+	bench_result(PROG, "read_map_bandwidth", bench_rate(bytes, t) / 1024, "KB/s");
+	close(fd);
+}
@@ -0,0 +1,123 @@
+// 最终项目：futex
+// 检查 sys_futex_wait 的 -E_AGAIN 和超时，然后用 sfork 出的几个进程
+// 共享内存：在互斥锁保护下累加同一个计数器，再用条件变量做一个
+// 有界缓冲区的生产者/消费者。父进程用 wait() 等它们退出，等待期间不占 CPU。
+//
+// 用法：futextest [进程数 [每个进程的次数]]
+
+#include <inc/lib.h>
+
+#define NSLOTS	4
+
+static struct Mutex lock;
+static uint32_t counter;
+
+static struct Cond notempty, notfull;
+static uint32_t slots[NSLOTS], head, count;
+
+static void
+adder(uint32_t n)
+{
+	uint32_t i, v;
+
+	for (i = 0; i < n; i++) {
+		mutex_lock(&lock);
+		v = counter;
+		// 在临界区里让出 CPU，制造争用
+		if (i % 16 == 0)
+			sys_yield();
+		counter = v + 1;
+		mutex_unlock(&lock);
+	}
+}
+
+static void
+produce(uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 1; i <= n; i++) {
+		mutex_lock(&lock);
+		while (count == NSLOTS)
+			cond_wait(&notfull, &lock);
+		slots[(head + count++) % NSLOTS] = i;
+		cond_signal(&notempty);
+		mutex_unlock(&lock);
+	}
+}
+
+static void
+consume(uint32_t n)
+{
+	uint32_t i, v;
+
+	for (i = 1; i <= n; i++) {
+		mutex_lock(&lock);
+		while (count == 0)
+			cond_wait(&notempty, &lock);
+		v = slots[head];
+		head = (head + 1) % NSLOTS;
+		count--;
+		cond_signal(&notfull);
+		mutex_unlock(&lock);
+		if (v != i)
+			panic("consumer got %u, expected %u", v, i);
+	}
+}
+
+// sfork 一个执行 fn(n) 的进程
+static envid_t
+spawn_worker(void (*fn)(uint32_t), uint32_t n)
+{
+	envid_t who;
+
+	if ((who = sfork()) < 0)
+		panic("sfork: %e", who);
+	if (who == 0) {
+		fn(n);
+		exit();
+	}
+	return who;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t workers[16];
+	uint32_t i, nworkers = 4, n = 1000, word = 0;
+	uint64_t begin;
+	int r;
+
+	binaryname = "futextest";
+	if (argc > 1)
+		nworkers = MIN(MAX(strtol(argv[1], 0, 0), 1), 16);
+	if (argc > 2)
+		n = strtol(argv[2], 0, 0);
+
+	if ((r = sys_futex_wait(&word, 1, 0)) != -E_AGAIN)
+		panic("futex_wait on a changed word: %e", r);
+	begin = uptime_us();
+	if ((r = sys_futex_wait(&word, 0, 20000)) != -E_TIMEOUT)
+		panic("futex_wait with timeout: %e", r);
+	if (uptime_us() - begin < 20000)
+		panic("futex_wait timed out after %u us", (uint32_t) (uptime_us() - begin));
+	if ((r = sys_futex_wake(&word, FUTEX_WAKE_ALL)) != 0)
+		panic("futex_wake with no waiters: %e", r);
+
+	mutex_init(&lock);
+	for (i = 0; i < nworkers; i++)
+		workers[i] = spawn_worker(adder, n);
+	for (i = 0; i < nworkers; i++)
+		wait(workers[i]);
+	if (counter != nworkers * n)
+		panic("counter is %u, expected %u", counter, nworkers * n);
+	cprintf("futextest: %u envs x %u increments under a mutex OK\n", nworkers, n);
+
+	cond_init(&notempty);
+	cond_init(&notfull);
+	workers[0] = spawn_worker(consume, n);
+	workers[1] = spawn_worker(produce, n);
+	wait(workers[0]);
+	wait(workers[1]);
+	cprintf("futextest: %u items through a condition variable OK\n", n);
+}
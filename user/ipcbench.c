@@ -0,0 +1,33 @@
+// 最终项目：IPC 基准测试
+// 依次运行所有 IPC/RPC 基准测试，每个结束之后再开始下一个，
+// 最后输出 "BENCH done"。bench-ipc 脚本（make bench）把它作为
+// 第一个用户进程启动，收集各个程序输出的 BENCH 行。
+//
+// 用法：ipcbench
+
+#include <inc/lib.h>
+
+static const char *benches[][4] = {
+	{ "ipclatbench", "10000" },
+	{ "ipcpagebench", "5000" },
+	{ "ipcfaninbench", "4", "2000" },
+	{ "ipcfaninbench", "16", "500" },
+	{ "fsrpcbench", "1000" },
+};
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint32_t i;
+
+	binaryname = "ipcbench";
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		who = spawnl(benches[i][0], benches[i][0], benches[i][1],
+			     benches[i][2], benches[i][3], (char *) 0);
+		if (who < 0)
+			panic("spawn %s: %e", benches[i][0], who);
+		wait(who);
+	}
+	cprintf("BENCH done\n");
+}
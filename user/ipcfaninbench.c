@@ -0,0 +1,69 @@
+// 最终项目：IPC 基准测试
+// 多个客户端同时调用一个服务端：父进程是服务端，用 ipc_reply_wait
+// 回复并等待下一个请求；fork 出的客户端各自用 ipc_call 发送请求，
+// 完成后用 ipc_send 通知服务端。报告服务端每秒处理的请求数，
+// 以及请求方和服务端不在同一个 CPU 上的比例。
+//
+// 用法：ipcfaninbench [客户端数 [每个客户端的请求数]]
+
+#include <inc/lib.h>
+
+#define PROG		"ipcfaninbench"
+#define BENCH_END	0xffffffff
+#define MAXCLIENTS	16
+
+static void
+client(envid_t server, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		if (ipc_call(server, i, 0, 0, 0, 0) != i + 1)
+			panic("ipc_call: bad reply");
+	ipc_send(server, BENCH_END, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t clients[MAXCLIENTS], from;
+	uint32_t i, v, nclients = 4, n = 2000, done = 0, served = 0, cross = 0;
+	uint64_t t;
+
+	binaryname = PROG;
+	if (argc > 1)
+		nclients = MIN(MAX(strtol(argv[1], 0, 0), 1), MAXCLIENTS);
+	if (argc > 2)
+		n = MAX(strtol(argv[2], 0, 0), 1);
+
+	for (i = 0; i < nclients; i++) {
+		if ((clients[i] = fork()) < 0)
+			panic("fork: %e", clients[i]);
+		if (clients[i] == 0) {
+			client(thisenv->env_parent_id, n);
+			return;
+		}
+	}
+
+	v = ipc_recv(&from, 0, 0);
+	t = bench_start();
+	while (1) {
+		if (v == BENCH_END) {
+			if (++done == nclients)
+				break;
+			v = ipc_recv(&from, 0, 0);
+			continue;
+		}
+		served++;
+		cross += envs[ENVX(from)].env_cpunum != thisenv->env_cpunum;
+		v = ipc_reply_wait(from, v + 1, 0, 0, 0, &from, 0);
+	}
+	// 最后一个 BENCH_END 到达时停止计时，不算客户端退出的时间
+	t = bench_elapsed_ns(t);
+	for (i = 0; i < nclients; i++)
+		wait(clients[i]);
+
+	bench_result(PROG, "clients", nclients, "envs");
+	bench_result(PROG, "calls", bench_rate(served, t), "calls/s");
+	bench_result(PROG, "cross_cpu", (uint64_t) cross * 100 / MAX(served, 1), "%");
+}
@@ -0,0 +1,103 @@
+// 最终项目：IPC 基准测试
+// 空消息的 IPC 来回延迟。fork 出一个回显进程，先用 ipc_send/ipc_recv，
+// 再用 ipc_call/ipc_reply_wait 各跑一遍。每个来回单独计时，按回显进程
+// 上次运行的 CPU 是否和自己相同分成同 CPU 和跨 CPU 两类分别报告
+// （单 CPU 时全部是同 CPU）。
+//
+// 用法：ipclatbench [来回次数]
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define PROG		"ipclatbench"
+#define BENCH_END	0xffffffff
+
+struct Lat {
+	uint64_t cycles[2];	// 同 CPU、跨 CPU 来回的总周期数
+	uint32_t n[2];
+};
+
+static void
+echo_server(void)
+{
+	envid_t from;
+	uint32_t v;
+
+	while ((v = ipc_recv(&from, 0, 0)) != BENCH_END)
+		ipc_send(from, v, 0, 0);
+	v = ipc_recv(&from, 0, 0);
+	while (v != BENCH_END)
+		v = ipc_reply_wait(from, v, 0, 0, 0, &from, 0);
+}
+
+// 记下一个来回，peer 是回显进程
+static void
+account(struct Lat *lat, envid_t peer, uint64_t cycles)
+{
+	int cross = envs[ENVX(peer)].env_cpunum != thisenv->env_cpunum;
+
+	lat->cycles[cross] += cycles;
+	lat->n[cross]++;
+}
+
+static void
+report(const char *name, struct Lat *lat)
+{
+	static const char *kind[2] = { "same_cpu", "cross_cpu" };
+	char item[64];
+	uint32_t total = lat->n[0] + lat->n[1];
+	int i;
+
+	snprintf(item, sizeof(item), "%s_rtt", name);
+	bench_result(PROG, item,
+		bench_cycles_ns(lat->cycles[0] + lat->cycles[1]) / MAX(total, 1), "ns");
+	for (i = 0; i < 2; i++) {
+		if (!lat->n[i])
+			continue;
+		snprintf(item, sizeof(item), "%s_rtt_%s", name, kind[i]);
+		bench_result(PROG, item, bench_cycles_ns(lat->cycles[i]) / lat->n[i], "ns");
+	}
+	snprintf(item, sizeof(item), "%s_cross_cpu", name);
+	bench_result(PROG, item, (uint64_t) lat->n[1] * 100 / MAX(total, 1), "%");
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Lat sendrecv = { { 0 } }, call = { { 0 } };
+	uint32_t i, n = 10000;
+	uint64_t t;
+	envid_t who;
+
+	binaryname = PROG;
+	if (argc > 1)
+		n = MAX(strtol(argv[1], 0, 0), 1);
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		echo_server();
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		ipc_send(who, i, 0, 0);
+		if (ipc_recv(0, 0, 0) != i)
+			panic("send/recv: bad echo");
+		account(&sendrecv, who, read_tsc() - t);
+	}
+	ipc_send(who, BENCH_END, 0, 0);
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		if (ipc_call(who, i, 0, 0, 0, 0) != i)
+			panic("call/reply: bad echo");
+		account(&call, who, read_tsc() - t);
+	}
+	ipc_send(who, BENCH_END, 0, 0);
+	wait(who);
+
+	report("send_recv", &sendrecv);
+	report("call_reply", &call);
+}
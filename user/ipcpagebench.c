@@ -0,0 +1,81 @@
+// 最终项目：IPC 基准测试
+// 带页面的 IPC 吞吐量：父进程反复把同一组页面发给子进程，
+// 分别用每条消息一页（ipc_send）、每条消息 IPC_SEG_MAX 页的段向量，
+// 以及不等接收方的消息队列（msg_send，每条一页）。报告每秒传递的页数。
+//
+// 用法：ipcpagebench [消息数]
+
+#include <inc/lib.h>
+
+#define PROG		"ipcpagebench"
+#define BENCH_END	0xffffffff
+#define SRC		((char *) 0x10000000)
+#define DST		((char *) 0x20000000)
+
+static void
+receiver(void)
+{
+	// 前两种方式用 ipc_recv，最后一种用消息队列，取完之后告诉父进程
+	while (ipc_recv(0, IPC_WINDOW(DST, IPC_SEG_MAX), 0) != BENCH_END)
+		;
+	while (ipc_recv(0, IPC_WINDOW(DST, IPC_SEG_MAX), 0) != BENCH_END)
+		;
+	while (msg_recv(0, DST, 0) != BENCH_END)
+		;
+	ipc_send(thisenv->env_parent_id, 0, 0, 0);
+}
+
+static void
+report(const char *item, uint32_t pages, uint64_t ns)
+{
+	bench_result(PROG, item, bench_rate(pages, ns), "pages/s");
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct IpcSeg seg = { (uint32_t) SRC, IPC_SEG_MAX, PTE_P | PTE_U };
+	uint32_t i, n = 5000;
+	uint64_t t;
+	envid_t who;
+	int r;
+
+	binaryname = PROG;
+	if (argc > 1)
+		n = MAX(strtol(argv[1], 0, 0), 1);
+
+	if ((r = sys_page_alloc_range(0, SRC, IPC_SEG_MAX, PTE_P | PTE_W | PTE_U)) < 0)
+		panic("sys_page_alloc_range: %e", r);
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		if ((r = sys_msg_setup(MSGQ_DEPTH_DEFAULT)) < 0)
+			panic("sys_msg_setup: %e", r);
+		receiver();
+		return;
+	}
+
+	t = bench_start();
+	for (i = 0; i < n; i++)
+		ipc_send(who, i, SRC, PTE_P | PTE_U);
+	ipc_send(who, BENCH_END, 0, 0);
+	report("page_send", n, bench_elapsed_ns(t));
+
+	t = bench_start();
+	for (i = 0; i < n; i++)
+		ipc_send(who, i, &seg, IPC_SEGV | 1);
+	ipc_send(who, BENCH_END, 0, 0);
+	report("segv_send", n * IPC_SEG_MAX, bench_elapsed_ns(t));
+
+	// 子进程可能还没有打开消息队列
+	while ((r = msg_send(who, 0, SRC, PTE_P | PTE_U, MSG_BLOCK)) == -E_IPC_NOT_RECV)
+		sys_yield();
+	t = bench_start();
+	for (i = 1; i < n && r >= 0; i++)
+		r = msg_send(who, i, SRC, PTE_P | PTE_U, MSG_BLOCK);
+	if (r < 0 || (r = msg_send(who, BENCH_END, 0, 0, MSG_BLOCK)) < 0)
+		panic("msg_send: %e", r);
+	ipc_recv(0, 0, 0);
+	report("msg_send", n - 1, bench_elapsed_ns(t));
+	wait(who);
+}
@@ -0,0 +1,83 @@
+// 最终项目：异步消息队列
+// 子进程不等父进程接收，连续向父进程的队列发送：
+// 先不带 MSG_BLOCK 发送两倍深度的消息，后一半应该因为队列满被拒绝；
+// 再带 MSG_BLOCK 发送一批消息，每次都在父进程腾出空位后成功；
+// 最后发送一个页面，发送后立即取消映射，父进程仍然收到这个页面。
+// 父进程检查消息的顺序和内容，并显示队列的统计。
+//
+// 用法：msgqueue [队列深度 [阻塞发送的消息数]]
+
+#include <inc/lib.h>
+
+#define TEMP_ADDR	((char *) 0xa00000)
+
+static const char *str = "hello from the message queue";
+
+static void
+child(envid_t parent, uint32_t depth, uint32_t n)
+{
+	uint32_t i, full = 0;
+	int r;
+
+	for (i = 0; i < 2 * depth; i++)
+		if ((r = msg_send(parent, i, 0, 0, 0)) == -E_MSGQ_FULL)
+			full++;
+		else if (r < 0)
+			panic("msg_send: %e", r);
+	if (full != depth)
+		panic("%u of %u sends rejected, expected %u", full, 2 * depth, depth);
+
+	for (i = 0; i < n; i++)
+		if ((r = msg_send(parent, 1000 + i, 0, 0, MSG_BLOCK)) < 0)
+			panic("msg_send MSG_BLOCK: %e", r);
+
+	if ((r = sys_page_alloc(0, TEMP_ADDR, PTE_P | PTE_W | PTE_U)) < 0)
+		panic("sys_page_alloc: %e", r);
+	strcpy(TEMP_ADDR, str);
+	if ((r = msg_send(parent, 0, TEMP_ADDR, PTE_P | PTE_U, MSG_BLOCK)) < 0)
+		panic("msg_send page: %e", r);
+	sys_page_unmap(0, TEMP_ADDR);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t i, depth = MSGQ_DEPTH_DEFAULT, n = 100;
+	envid_t who, from;
+	int32_t v;
+	int r, perm;
+
+	binaryname = "msgqueue";
+	if (argc > 1)
+		depth = MIN(MAX(strtol(argv[1], 0, 0), 1), MSGQ_DEPTH_MAX);
+	if (argc > 2)
+		n = strtol(argv[2], 0, 0);
+
+	if ((r = sys_msg_setup(depth)) < 0)
+		panic("sys_msg_setup: %e", r);
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		child(thisenv->env_parent_id, depth, n);
+		return;
+	}
+
+	// 等子进程把队列填满再开始接收
+	while (thisenv->env_msg_count < depth)
+		sys_yield();
+
+	for (i = 0; i < depth + n; i++) {
+		v = msg_recv(&from, 0, 0);
+		if (from != who || v != (int32_t) (i < depth ? i : 1000 + i - depth))
+			panic("message %u: got %d from %08x", i, v, from);
+	}
+	v = msg_recv(&from, TEMP_ADDR, &perm);
+	if (v != 0 || !perm || strcmp(TEMP_ADDR, str) != 0)
+		panic("page message: got %d, perm %x", v, perm);
+
+	cprintf("msgqueue: depth %u, received %u, peak %u, overflows %u, "
+		"blocked sends %u\n", thisenv->env_msg_depth, thisenv->env_msg_received,
+		thisenv->env_msg_peak, thisenv->env_msg_overflows,
+		thisenv->env_msg_full_waits);
+	cprintf("msgqueue: OK\n");
+}
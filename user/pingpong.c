@@ -1,12 +1,71 @@
 // Ping-pong a counter between two processes.
 // Only need to start one of these -- splits into two with fork.
+// 最终项目：阻塞 IPC 发送
+// 带参数运行时（pingpong 来回次数）不再逐条输出，而是先后用旧的
+// 重试发送（sys_ipc_try_send + sys_yield_to）和阻塞发送（sys_ipc_send，
+// 接收方正在等待时直接切换）各跑一遍，比较每个来回的 TSC 周期数
 
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// 旧的发送方式：接收方没有准备好就把时间片让给它，然后重试
+static void
+send_poll(envid_t to, uint32_t val)
+{
+	int r;
+
+	while ((r = sys_ipc_try_send(to, val, (void *) UTOP, 0)) == -E_IPC_NOT_RECV)
+		sys_yield_to(to);
+	if (r < 0)
+		panic("sys_ipc_try_send: %e", r);
+}
+
+static void
+send_block(envid_t to, uint32_t val)
+{
+	ipc_send(to, val, 0, 0);
+}
+
+// 来回传递计数器直到 2 * n，由父进程开始；返回平均每个来回的周期数
+static uint32_t
+bench(envid_t who, bool parent, uint32_t n, void (*send)(envid_t, uint32_t))
+{
+	uint64_t begin = read_tsc();
+	uint32_t i;
+
+	if (parent)
+		send(who, 0);
+	while (1) {
+		i = ipc_recv(0, 0, 0);
+		if (i == 2 * n)
+			break;
+		send(who, ++i);
+		if (i == 2 * n)
+			break;
+	}
+	return (uint32_t) ((read_tsc() - begin) / n);
+}
 
 void
 umain(int argc, char **argv)
 {
-	envid_t who;
+	envid_t who, parent;
+	uint32_t n, poll, block;
+
+	if (argc > 1) {
+		n = MAX(strtol(argv[1], 0, 0), 1);
+		parent = sys_getenvid();
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0)
+			who = parent;
+		poll = bench(who, who != parent, n, send_poll);
+		block = bench(who, who != parent, n, send_block);
+		if (who != parent)
+			cprintf("pingpong: %u round trips, try_send+yield_to %u cycles each, "
+				"blocking send %u cycles each\n", n, poll, block);
+		return;
+	}
 
 	if ((who = fork()) != 0) {
 		// get the ball rolling
@@ -26,4 +85,3 @@ umain(int argc, char **argv)
 	}
 
 }
-
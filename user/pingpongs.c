@@ -1,15 +1,74 @@
 // Ping-pong a counter between two shared-memory processes.
 // Only need to start one of these -- splits into two with sfork.
+// 最终项目：阻塞 IPC 发送
+// 带参数运行时（pingpongs 来回次数）不再逐条输出，计数器放在共享内存里，
+// 先后用旧的重试发送和阻塞发送各跑一遍，报告每秒的来回次数
 
 #include <inc/lib.h>
 
 uint32_t val;
 
+// 旧的发送方式：接收方没有准备好就把时间片让给它，然后重试
+static void
+send_poll(envid_t to)
+{
+	int r;
+
+	while ((r = sys_ipc_try_send(to, 0, (void *) UTOP, 0)) == -E_IPC_NOT_RECV)
+		sys_yield_to(to);
+	if (r < 0)
+		panic("sys_ipc_try_send: %e", r);
+}
+
+static void
+send_block(envid_t to)
+{
+	ipc_send(to, 0, 0, 0);
+}
+
+// 来回传递共享计数器 n 个来回，由父进程开始；返回每秒的来回次数。
+// 计数器不清零：对方可能还没有读到上一轮的终值
+static uint32_t
+bench(envid_t who, bool parent, uint32_t n, void (*send)(envid_t))
+{
+	uint64_t begin = uptime_us(), elapsed;
+	uint32_t end = val + 2 * n;
+
+	if (parent)
+		send(who);
+	while (1) {
+		ipc_recv(0, 0, 0);
+		if (val == end)
+			break;
+		++val;
+		send(who);
+		if (val == end)
+			break;
+	}
+	elapsed = MAX(uptime_us() - begin, 1);
+	return (uint32_t) (n * 1000000ULL / elapsed);
+}
+
 void
 umain(int argc, char **argv)
 {
-	envid_t who;
-	uint32_t i;
+	envid_t who, parent;
+	uint32_t i, n, poll, block;
+
+	if (argc > 1) {
+		n = MAX(strtol(argv[1], 0, 0), 1);
+		parent = sys_getenvid();
+		if ((who = sfork()) < 0)
+			panic("sfork: %e", who);
+		if (who == 0)
+			who = parent;
+		poll = bench(who, who != parent, n, send_poll);
+		block = bench(who, who != parent, n, send_block);
+		if (who != parent)
+			cprintf("pingpongs: %u round trips, try_send+yield_to %u/s, "
+				"blocking send %u/s\n", n, poll, block);
+		return;
+	}
 
 	i = 0;
 	if ((who = sfork()) != 0) {
@@ -0,0 +1,54 @@
+// 最终项目：EDF 实时调度
+// 在若干个死循环进程的负载下运行一个周期性实时进程，统计错过截止时刻的次数。
+//
+// 用法：rtdeadline [死循环进程数 [周期（微秒） [预算（微秒） [作业数]]]]
+
+#include <inc/lib.h>
+
+#define NSPINMAX	16
+#define WORK		20000	// 每个作业的忙循环次数，应远小于预算
+
+void
+umain(int argc, char **argv)
+{
+	envid_t spinners[NSPINMAX];
+	int nspin = 4, jobs = 100, i, r;
+	uint32_t period = 20000, budget = 4000;
+	volatile int work;
+
+	binaryname = "rtdeadline";
+	if (argc > 1)
+		nspin = MIN(strtol(argv[1], 0, 0), NSPINMAX);
+	if (argc > 2)
+		period = strtol(argv[2], 0, 0);
+	if (argc > 3)
+		budget = strtol(argv[3], 0, 0);
+	if (argc > 4)
+		jobs = strtol(argv[4], 0, 0);
+
+	for (i = 0; i < nspin; i++) {
+		if ((spinners[i] = fork()) == 0)
+			while (1)
+				/* do nothing */;
+		if (spinners[i] < 0)
+			panic("fork: %e", spinners[i]);
+	}
+
+	if ((r = sys_env_set_rt(0, period, budget)) < 0)
+		panic("sys_env_set_rt: %e", r);
+
+	// 每个作业做一点工作，然后用 sys_yield 结束本周期
+	for (i = 0; i < jobs; i++) {
+		for (work = 0; work < WORK; work++)
+			;
+		sys_yield();
+	}
+
+	cprintf("rtdeadline: %d spinners, period %u us, budget %u us: "
+		"%u jobs, %u deadline misses\n", nspin, period, budget,
+		thisenv->env_rt_jobs, thisenv->env_rt_misses);
+
+	sys_env_set_rt(0, 0, 0);
+	for (i = 0; i < nspin; i++)
+		sys_env_destroy(spinners[i]);
+}
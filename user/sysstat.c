@@ -0,0 +1,75 @@
+// 最终项目：系统调用统计
+// 从 USYSSTAT 只读页读取各 CPU 的系统调用统计，合并后按调用次数排序，
+// 显示次数最多的若干个系统调用的次数、平均周期数和中位数/p99 所在桶的上界。
+//
+// 用法：sysstat [on|off|reset|显示个数]
+
+#include <inc/lib.h>
+
+struct Row {
+	int slot;
+	uint32_t count;
+	uint64_t cycles;
+	uint32_t hist[SYSSTAT_BUCKETS];
+};
+
+static struct Row rows[SYSSTAT_NSLOTS];
+
+void
+umain(int argc, char **argv)
+{
+	int top = 10, i, j, b, r, nrows = 0;
+	uint32_t cpu;
+	struct Row *row, tmp;
+	const volatile struct SysstatCpu *ss;
+
+	binaryname = "sysstat";
+	if (argc > 1) {
+		r = 0;
+		if (strcmp(argv[1], "on") == 0)
+			r = sys_sysstat_ctl(SYSSTAT_ON);
+		else if (strcmp(argv[1], "off") == 0)
+			r = sys_sysstat_ctl(SYSSTAT_OFF);
+		else if (strcmp(argv[1], "reset") == 0)
+			r = sys_sysstat_ctl(SYSSTAT_RESET);
+		else
+			top = strtol(argv[1], 0, 0);
+		if (r < 0)
+			panic("sys_sysstat_ctl: %e", r);
+		// on/off/reset 只改变状态，不显示
+		if (argv[1][0] < '0' || argv[1][0] > '9')
+			return;
+	}
+
+	for (i = 0; i < SYSSTAT_NSLOTS; i++) {
+		row = &rows[nrows];
+		memset(row, 0, sizeof(*row));
+		row->slot = i;
+		for (cpu = 0; cpu < kinfo_ncpu(); cpu++) {
+			ss = &sysstat.ss_cpu[cpu];
+			row->count += ss->ss_count[i];
+			row->cycles += ss->ss_cycles[i];
+			for (b = 0; b < SYSSTAT_BUCKETS; b++)
+				row->hist[b] += ss->ss_hist[i][b];
+		}
+		if (row->count)
+			nrows++;
+	}
+
+	// 按次数从多到少插入排序
+	for (i = 1; i < nrows; i++) {
+		tmp = rows[i];
+		for (j = i; j > 0 && rows[j - 1].count < tmp.count; j--)
+			rows[j] = rows[j - 1];
+		rows[j] = tmp;
+	}
+
+	cprintf("syscall statistics are %s\n", sysstat.ss_enabled ? "on" : "off");
+	cprintf("%-24s %10s %10s %10s %10s\n", "syscall", "count", "avg", "p50<=", "p99<=");
+	for (i = 0; i < nrows && i < top; i++) {
+		row = &rows[i];
+		cprintf("%-24s %10u %10u %10u %10u\n", sysstat_name(row->slot), row->count,
+			(uint32_t) (row->cycles / row->count),
+			sysstat_percentile(row->hist, 50), sysstat_percentile(row->hist, 99));
+	}
+}
@@ -0,0 +1,112 @@
+// 最终项目：CPU 时间统计
+// 周期性地从 UENVS 读取各进程的时间统计，显示每个采样周期内的
+// 用户态/内核态 CPU 占用、等待调度时间和切换次数。
+// 最终项目：内核信息页：采样周期用内核信息页的时钟计时，并显示各 CPU 的负载
+//
+// 用法：top [采样次数 [采样周期（毫秒）]]
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+struct Sample {
+	envid_t id;
+	uint64_t utime, stime, wait_time;
+	uint32_t nvcsw, nivcsw;
+};
+
+static struct Sample last[NENV];
+
+// 返回 part 占 whole 的千分比
+static uint32_t
+permille(uint64_t part, uint64_t whole)
+{
+	if (whole == 0)
+		return 0;
+	return (uint32_t)(part * 1000 / whole);
+}
+
+static void
+show(uint64_t elapsed)
+{
+	static const char *status_name[] = { "free", "dying", "runnable", "running", "blocked" };
+	const volatile struct Env *e;
+	struct Sample *s;
+	uint32_t u, k;
+	int i;
+
+	if (elapsed)
+		cprintf("envid     status    %%usr   %%sys   wait(Mcyc) vcsw    ivcsw   quantum(us)\n");
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		s = &last[i];
+		if (e->env_status == ENV_FREE) {
+			s->id = 0;
+			continue;
+		}
+		if (s->id != e->env_id) {
+			// 新出现的进程，上一次采样没有它的数据
+			memset(s, 0, sizeof(*s));
+			s->id = e->env_id;
+		}
+
+		u = permille(e->env_utime - s->utime, elapsed);
+		k = permille(e->env_stime - s->stime, elapsed);
+		if (elapsed)
+			cprintf("%08x  %-8s  %3u.%u  %3u.%u  %-10u %-7u %-7u %u\n",
+				e->env_id,
+				e->env_status <= ENV_NOT_RUNNABLE ? status_name[e->env_status] : "?",
+				u / 10, u % 10, k / 10, k % 10,
+				(uint32_t)((e->env_wait_time - s->wait_time) / 1000000),
+				e->env_nvcsw - s->nvcsw, e->env_preempts - s->nivcsw,
+				e->env_quantum);
+
+		s->utime = e->env_utime;
+		s->stime = e->env_stime;
+		s->wait_time = e->env_wait_time;
+		s->nvcsw = e->env_nvcsw;
+		s->nivcsw = e->env_preempts;
+	}
+}
+
+static void
+show_cpus(void)
+{
+	uint32_t i, load;
+
+	cprintf("cpu load:");
+	for (i = 0; i < kinfo_ncpu(); i++) {
+		load = kinfo_cpu_load(i);
+		cprintf("  cpu%u %3u.%u%%", i, load / 10, load % 10);
+	}
+	cprintf("\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, rounds = 5;
+	uint64_t period = 1000ULL * 1000, begin, begin_tsc, now_tsc;
+
+	binaryname = "top";
+	if (argc > 1)
+		rounds = strtol(argv[1], 0, 0);
+	if (argc > 2)
+		period = (uint64_t)strtol(argv[2], 0, 0) * 1000;
+
+	// 第一次采样只记录基准，不输出
+	show(0);
+	begin = uptime_us();
+	begin_tsc = read_tsc();
+	for (i = 0; i < rounds; i++) {
+		while (uptime_us() - begin < period)
+			sys_yield();
+		begin += period;
+		if (i > 0)
+			cprintf("\n");
+		// 进程的时间统计以 TSC 周期为单位
+		now_tsc = read_tsc();
+		show(now_tsc - begin_tsc);
+		show_cpus();
+		begin_tsc = now_tsc;
+	}
+}
@@ -0,0 +1,109 @@
+// 最终项目：%gs 每 CPU 数据
+// 测量一次系统调用往返（陷入、分发、返回）的周期数。
+// sys_getenvid 几乎不做任何工作，耗时基本就是陷阱路径本身；
+// sys_yield 还要经过调度器（系统里只有它可运行时会直接回到自己）。
+// 最终项目：sysenter 快速系统调用
+// 另外分别用 int $0x30 和 sysenter 直接发起空的 sys_getenvid，比较两条路径。
+// 最终项目：陷入时不再复制 Trapframe
+// 页错误一项读一个没有映射的地址，处理函数直接跳过这条指令，
+// 测量的是陷入、用户态页错误处理和返回的完整往返。
+//
+// 用法：trapbench [次数]
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+#include <inc/syscall.h>
+
+#define FAULT_VA	0xB0000000	// 不映射，读它总是引起页错误
+
+static void
+bench(const char *name, void (*fn)(void), int n)
+{
+	uint64_t t, min = ~0ULL, sum = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		fn();
+		t = read_tsc() - t;
+		sum += t;
+		if (t < min)
+			min = t;
+	}
+	cprintf("trapbench: %-12s %d calls, cycles min %u avg %u\n",
+		name, n, (uint32_t) min, (uint32_t) (sum / n));
+}
+
+static void
+do_getenvid(void)
+{
+	sys_getenvid();
+}
+
+static void
+do_yield(void)
+{
+	sys_yield();
+}
+
+static void
+do_getenvid_int(void)
+{
+	envid_t id;
+
+	asm volatile("int %1" : "=a" (id) : "i" (T_SYSCALL), "a" (SYS_getenvid)
+		: "cc", "memory");
+}
+
+// 与 lib/syscall.c 的约定相同
+static void
+do_getenvid_sysenter(void)
+{
+	envid_t id;
+
+	asm volatile("pushfl\n\t"
+		"pushl %%ebp\n\t"
+		"pushl %%esi\n\t"
+		"movl %%esp, %%ebp\n\t"
+		"leal 1f, %%esi\n\t"
+		"sysenter\n"
+		"1:\tpopl %%esi\n\t"
+		"popl %%ebp\n\t"
+		"popfl"
+		: "=a" (id) : "a" (SYS_getenvid) : "ecx", "edx", "cc", "memory");
+}
+
+static void
+skip_fault(struct UTrapframe *utf)
+{
+	if (utf->utf_fault_va != FAULT_VA)
+		panic("unexpected page fault at %08x", utf->utf_fault_va);
+	utf->utf_eip += 2;	// movl (%ecx), %eax 的长度
+}
+
+static void
+do_pgfault(void)
+{
+	asm volatile("movl (%%ecx), %%eax" : : "c" (FAULT_VA) : "eax", "memory");
+}
+
+void
+umain(int argc, char **argv)
+{
+	int n = 10000;
+	uint32_t edx;
+
+	binaryname = "trapbench";
+	if (argc > 1)
+		n = strtol(argv[1], 0, 0);
+
+	bench("sys_getenvid", do_getenvid, n);
+	bench("sys_yield", do_yield, n);
+	bench("int $0x30", do_getenvid_int, n);
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if ((edx >> CPUID_EDX_SEP_BIT) & 1)
+		bench("sysenter", do_getenvid_sysenter, n);
+
+	set_pgfault_handler(skip_fault);
+	bench("page fault", do_pgfault, n);
+}
@@ -0,0 +1,65 @@
+// 最终项目：唤醒空闲 CPU
+// 测量从 IPC 使接收方可运行，到接收方真正开始运行之间的延迟。
+// 父进程在共享页里写下发送时刻后一直忙等，不让出 CPU，
+// 所以接收方只能在另一个（原本停机的）CPU 上运行。
+// 多 CPU（例如 make qemu CPUS=2）下在 sh 里运行才有意义。
+//
+// 用法：wakeuplat [轮数]
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+struct Shared {
+	volatile uint64_t sent;		// 发送方发出 IPC 的时刻
+	volatile uint64_t latency;	// 接收方测得的延迟
+	volatile int done;		// 接收方写完 latency 后置 1
+};
+
+static struct Shared *shared = (struct Shared *) 0xA0000000;
+
+void
+umain(int argc, char **argv)
+{
+	int i, rounds = 100, r;
+	envid_t child;
+	uint64_t lat, min = ~0ULL, max = 0, sum = 0;
+
+	binaryname = "wakeuplat";
+	if (argc > 1)
+		rounds = strtol(argv[1], 0, 0);
+
+	if ((r = sys_page_alloc(0, shared, PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		while (1) {
+			ipc_recv(NULL, NULL, NULL);
+			shared->latency = read_tsc() - shared->sent;
+			shared->done = 1;
+		}
+	}
+
+	for (i = 0; i < rounds; i++) {
+		// 等接收方真正阻塞在 ipc_recv 里
+		while (envs[ENVX(child)].env_status != ENV_NOT_RUNNABLE)
+			;
+		shared->done = 0;
+		shared->sent = read_tsc();
+		ipc_send(child, i, NULL, 0);
+		// 忙等，不让出 CPU
+		while (!shared->done)
+			;
+		lat = shared->latency;
+		sum += lat;
+		if (lat < min)
+			min = lat;
+		if (lat > max)
+			max = lat;
+	}
+
+	cprintf("wakeuplat: %d rounds, wakeup-to-run cycles min %u avg %u max %u\n",
+		rounds, (uint32_t) min, (uint32_t) (sum / rounds), (uint32_t) max);
+	sys_env_destroy(child);
+}